@@ -0,0 +1,269 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>
+#include <brpc/controller.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/append_entries_batcher.h"
+
+namespace braft {
+
+DEFINE_bool(raft_heartbeat_batch, false,
+            "Pack the heartbeats of all the groups sent to the same process "
+            "into one RPC, which must be supported by all the peers");
+BRPC_VALIDATE_GFLAG(raft_heartbeat_batch, ::brpc::PassValidate);
+
+DEFINE_int32(raft_heartbeat_batch_delay_ms, 5,
+             "Max time a heartbeat waits for the others to the same process, "
+             "which should be much less than the heartbeat interval");
+BRPC_VALIDATE_GFLAG(raft_heartbeat_batch_delay_ms, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_append_entries_batch, false,
+            "Pack the AppendEntries requests of the groups sent to the same "
+            "process into one RPC, which must be supported by all the peers");
+BRPC_VALIDATE_GFLAG(raft_append_entries_batch, ::brpc::PassValidate);
+
+DEFINE_int32(raft_append_entries_batch_delay_us, 100,
+             "Max time an AppendEntries request waits for the others to the "
+             "same process");
+BRPC_VALIDATE_GFLAG(raft_append_entries_batch_delay_us,
+                    brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_append_entries_batch_max_bytes, 256 * 1024,
+             "Send the batched AppendEntries requests right away once their "
+             "data reaches this size");
+BRPC_VALIDATE_GFLAG(raft_append_entries_batch_max_bytes,
+                    brpc::PositiveInteger);
+
+static bvar::CounterRecorder g_heartbeat_batch_size(
+             "raft_heartbeat_batch_size");
+static bvar::CounterRecorder g_append_entries_batch_size(
+             "raft_append_entries_batch_size");
+
+// Dispatches the results of a heartbeat_batch or append_entries_batch RPC to
+// the requests
+class AppendEntriesBatcher::BatchClosure : public google::protobuf::Closure {
+public:
+    void Run() {
+        google::protobuf::RepeatedPtrField<AppendEntriesResult>& results =
+                heartbeat ? *heartbeat_response.mutable_results()
+                          : *response.mutable_results();
+        for (size_t i = 0; i < requests.size(); ++i) {
+            const Request& req = requests[i];
+            if (cntl.Failed()) {
+                req.cntl->SetFailed(cntl.ErrorCode(), "%s",
+                                    cntl.ErrorText().c_str());
+            } else if ((int)i >= results.size()) {
+                req.cntl->SetFailed(EPROTO, "Missing the result of request");
+            } else if (results.Get(i).error_code() != 0) {
+                req.cntl->SetFailed(results.Get(i).error_code(), "%s",
+                                    results.Get(i).error_text().c_str());
+            } else {
+                req.response->Swap(results.Mutable(i)->mutable_response());
+            }
+            req.done->Run();
+        }
+        delete this;
+    }
+
+    bool heartbeat;
+    brpc::Controller cntl;
+    HeartbeatBatchRequest heartbeat_request;
+    HeartbeatBatchResponse heartbeat_response;
+    AppendEntriesBatchRequest request;
+    AppendEntriesBatchResponse response;
+    std::vector<Request> requests;
+};
+
+AppendEntriesBatcher::AppendEntriesBatcher() {}
+
+AppendEntriesBatcher::~AppendEntriesBatcher() {
+    for (std::map<butil::EndPoint, Destination*>::iterator
+            it = _destinations.begin(); it != _destinations.end(); ++it) {
+        delete it->second;
+    }
+    _destinations.clear();
+}
+
+void AppendEntriesBatcher::send_heartbeat(const butil::EndPoint& addr,
+                                          brpc::Controller* cntl,
+                                          const AppendEntriesRequest* request,
+                                          AppendEntriesResponse* response,
+                                          google::protobuf::Closure* done) {
+    const Request req = { cntl, request, response, done };
+    send(addr, req, true, FLAGS_raft_heartbeat_batch_delay_ms * 1000L);
+}
+
+void AppendEntriesBatcher::send_append_entries(
+        const butil::EndPoint& addr, brpc::Controller* cntl,
+        const AppendEntriesRequest* request, AppendEntriesResponse* response,
+        google::protobuf::Closure* done) {
+    const Request req = { cntl, request, response, done };
+    send(addr, req, false, FLAGS_raft_append_entries_batch_delay_us);
+}
+
+void AppendEntriesBatcher::send(const butil::EndPoint& addr,
+                                const Request& req, bool heartbeat,
+                                int64_t delay_us) {
+    const int64_t now_us = butil::monotonic_time_us();
+    int64_t flush_time_us = now_us + delay_us;
+    Destination* dest = NULL;
+    Queue* queue = NULL;
+    bool schedule = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<butil::EndPoint, Destination*>::iterator
+                it = _destinations.find(addr);
+        if (it != _destinations.end()) {
+            dest = it->second;
+        } else {
+            dest = new Destination;
+            dest->addr = addr;
+            Queue* queues[2] = { &dest->heartbeats, &dest->entries };
+            for (size_t i = 0; i < ARRAY_SIZE(queues); ++i) {
+                queues[i]->dest = dest;
+                queues[i]->heartbeat = (queues[i] == &dest->heartbeats);
+                queues[i]->pending_bytes = 0;
+                queues[i]->flush_time_us = 0;
+            }
+            brpc::ChannelOptions options;
+            // The timeout is set to each batch
+            options.timeout_ms = -1;
+            if (dest->channel.Init(addr, &options) != 0) {
+                delete dest;
+                dest = NULL;
+            } else {
+                _destinations[addr] = dest;
+            }
+        }
+        if (dest != NULL) {
+            queue = heartbeat ? &dest->heartbeats : &dest->entries;
+            queue->pending.push_back(req);
+            queue->pending_bytes += req.cntl->request_attachment().size();
+            if (queue->pending_bytes 
+                    >= FLAGS_raft_append_entries_batch_max_bytes) {
+                flush_time_us = now_us;
+            }
+            // A request waiting for less than the scheduled flush needs
+            // another one
+            if (queue->flush_time_us == 0 
+                    || flush_time_us < queue->flush_time_us) {
+                queue->flush_time_us = flush_time_us;
+                schedule = true;
+            }
+        }
+    }
+    bthread_t tid;
+    if (dest == NULL) {
+        LOG(ERROR) << "Fail to init channel to " << addr;
+        req.cntl->SetFailed(EINVAL, "Fail to init channel to %s",
+                            butil::endpoint2str(addr).c_str());
+        // The caller may be holding the lock that |done| acquires
+        if (bthread_start_background(&tid, NULL, run_failed_done, 
+                                     req.done) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_failed_done(req.done);
+        }
+        return;
+    }
+    if (!schedule) {
+        return;
+    }
+    if (flush_time_us > now_us) {
+        bthread_timer_t timer;
+        if (bthread_timer_add(&timer,
+                    butil::microseconds_from_now(flush_time_us - now_us),
+                    on_timer, queue) == 0) {
+            return;
+        }
+    }
+    if (bthread_start_background(&tid, NULL, run_flush, queue) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_flush(queue);
+    }
+}
+
+void AppendEntriesBatcher::on_timer(void* arg) {
+    // Don't block the TimerThread
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_flush, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_flush(arg);
+    }
+}
+
+void* AppendEntriesBatcher::run_flush(void* arg) {
+    GetInstance()->flush((Queue*)arg);
+    return NULL;
+}
+
+void* AppendEntriesBatcher::run_failed_done(void* arg) {
+    ((google::protobuf::Closure*)arg)->Run();
+    return NULL;
+}
+
+void AppendEntriesBatcher::flush(Queue* queue) {
+    BatchClosure* batch = new BatchClosure;
+    batch->heartbeat = queue->heartbeat;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        batch->requests.swap(queue->pending);
+        queue->pending_bytes = 0;
+        queue->flush_time_us = 0;
+    }
+    // Flushed by an earlier timer
+    if (batch->requests.empty()) {
+        delete batch;
+        return;
+    }
+    RaftService_Stub stub(&queue->dest->channel);
+    if (!batch->heartbeat) {
+        // The results of a batch are returned together, which may take as
+        // long as the slowest disk write of the groups in it. Any timeout
+        // would fail all the requests, so there's none like the requests
+        // sent on their own
+        for (size_t i = 0; i < batch->requests.size(); ++i) {
+            const Request& req = batch->requests[i];
+            *batch->request.add_requests() = *req.request;
+            batch->request.add_data_sizes(
+                    req.cntl->request_attachment().size());
+            batch->cntl.request_attachment().append(
+                    req.cntl->request_attachment());
+        }
+        g_append_entries_batch_size << batch->requests.size();
+        batch->cntl.set_timeout_ms(-1);
+        stub.append_entries_batch(&batch->cntl, &batch->request,
+                                  &batch->response, batch);
+        return;
+    }
+    int64_t timeout_ms = -1;
+    for (size_t i = 0; i < batch->requests.size(); ++i) {
+        const Request& req = batch->requests[i];
+        *batch->heartbeat_request.add_heartbeats() = *req.request;
+        const int64_t req_timeout_ms = req.cntl->timeout_ms();
+        if (req_timeout_ms >= 0 
+                && (timeout_ms < 0 || req_timeout_ms < timeout_ms)) {
+            timeout_ms = req_timeout_ms;
+        }
+    }
+    g_heartbeat_batch_size << batch->requests.size();
+    batch->cntl.set_timeout_ms(timeout_ms);
+    stub.heartbeat_batch(&batch->cntl, &batch->heartbeat_request,
+                         &batch->heartbeat_response, batch);
+}
+
+}  //  namespace braft
@@ -0,0 +1,112 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_APPEND_ENTRIES_BATCHER_H
+#define  BRAFT_APPEND_ENTRIES_BATCHER_H
+
+#include <map>
+#include <vector>
+#include <butil/memory/singleton.h>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include "braft/raft.pb.h"
+#include "braft/util.h"
+
+namespace braft {
+
+// Packs the AppendEntries requests of different groups sent to the same
+// process into one RPC, which is dispatched to the nodes by NodeManager on
+// the other side. Heartbeats are packed into heartbeat_batch RPCs and the
+// requests with entries into append_entries_batch RPCs, so that heartbeats
+// never wait for the entries of other groups to be written to disk.
+//
+// Heartbeats wait for -raft_heartbeat_batch_delay_ms and the requests with
+// entries for -raft_append_entries_batch_delay_us, or until their data
+// reaches -raft_append_entries_batch_max_bytes. The send time recorded by
+// the replicators is before the delay, so the leader lease and the election
+// timeout of the followers are still conservative.
+class AppendEntriesBatcher {
+public:
+    // Leaky as the pending requests may still reference it at exit
+    static AppendEntriesBatcher* GetInstance() {
+        return Singleton<AppendEntriesBatcher,
+                         LeakySingletonTraits<AppendEntriesBatcher> >::get();
+    }
+
+    // Send the heartbeat |request| to |addr| in a batch. |done| is run in
+    // another bthread with |cntl| and |response| filled as if |request| were
+    // sent by append_entries on its own, and |cntl| is not used to issue any
+    // RPC. The timeout of the batch is the smallest one of the heartbeats in
+    // it. |cntl|, |request| and |response| must be valid until |done| is run.
+    void send_heartbeat(const butil::EndPoint& addr, brpc::Controller* cntl,
+                        const AppendEntriesRequest* request,
+                        AppendEntriesResponse* response,
+                        google::protobuf::Closure* done);
+
+    // Same as send_heartbeat for |request| with the data in the attachment
+    // of |cntl|, except that the batch has no timeout as the requests
+    // sent by the replicators don't.
+    void send_append_entries(const butil::EndPoint& addr,
+                             brpc::Controller* cntl,
+                             const AppendEntriesRequest* request,
+                             AppendEntriesResponse* response,
+                             google::protobuf::Closure* done);
+
+private:
+    AppendEntriesBatcher();
+    ~AppendEntriesBatcher();
+    DISALLOW_COPY_AND_ASSIGN(AppendEntriesBatcher);
+    friend struct DefaultSingletonTraits<AppendEntriesBatcher>;
+
+    struct Request {
+        brpc::Controller* cntl;
+        const AppendEntriesRequest* request;
+        AppendEntriesResponse* response;
+        google::protobuf::Closure* done;
+    };
+    class BatchClosure;
+    struct Destination;
+
+    // The heartbeats or the requests with entries to the same address
+    struct Queue {
+        Destination* dest;
+        bool heartbeat;
+        std::vector<Request> pending;
+        int64_t pending_bytes;
+        // When the pending requests are going to be sent, 0 if not scheduled
+        int64_t flush_time_us;
+    };
+
+    // Never destroyed until the batcher is
+    struct Destination {
+        butil::EndPoint addr;
+        brpc::Channel channel;
+        Queue heartbeats;
+        Queue entries;
+    };
+
+    void send(const butil::EndPoint& addr, const Request& req,
+              bool heartbeat, int64_t delay_us);
+    static void on_timer(void* arg);
+    static void* run_flush(void* arg);
+    static void* run_failed_done(void* arg);
+    void flush(Queue* queue);
+
+    raft_mutex_t _mutex;
+    std::map<butil::EndPoint, Destination*> _destinations;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_APPEND_ENTRIES_BATCHER_H
@@ -14,18 +14,32 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <algorithm>
+#include <functional>
+#include <butil/logging.h>
+#include <butil/macros.h>
 #include "braft/ballot.h"
 
 namespace braft {
 
-Ballot::Ballot() : _quorum(0), _old_quorum(0) {}
-Ballot::~Ballot() {}
+BallotVoters::BallotVoters()
+    : _quorum(0), _old_quorum(0), _has_old_conf(false) {}
+BallotVoters::~BallotVoters() {}
 
-int Ballot::init(const Configuration& conf, const Configuration* old_conf) {
+int BallotVoters::init(const Configuration& conf,
+                       const Configuration* old_conf) {
     _peers.clear();
     _old_peers.clear();
     _quorum = 0;
     _old_quorum = 0;
+    _has_old_conf = false;
+    if (conf.size() > MAX_PEERS
+            || (old_conf && old_conf->size() > MAX_PEERS)) {
+        LOG(ERROR) << "Too many peers in conf=" << conf
+                   << " old_conf=" << (old_conf ? *old_conf : Configuration())
+                   << ", at most " << MAX_PEERS << " are supported";
+        return EINVAL;
+    }
 
     _peers.reserve(conf.size());
     for (Configuration::const_iterator
@@ -36,6 +50,7 @@ int Ballot::init(const Configuration& conf, const Configuration* old_conf) {
     if (!old_conf) {
         return 0;
     }
+    _has_old_conf = true;
     _old_peers.reserve(old_conf->size());
     for (Configuration::const_iterator
             iter = old_conf->begin(); iter != old_conf->end(); ++iter) {
@@ -45,36 +60,48 @@ int Ballot::init(const Configuration& conf, const Configuration* old_conf) {
     return 0;
 }
 
-Ballot::PosHint Ballot::grant(const PeerId& peer, PosHint hint) {
-    std::vector<UnfoundPeerId>::iterator iter;
-    iter = find_peer(peer, _peers, hint.pos0);
-    if (iter != _peers.end()) {
-        if (!iter->found) {
-            iter->found = true;
-            --_quorum;
-        }
-        hint.pos0 = iter - _peers.begin();
-    } else {
-        hint.pos0 = -1;
+bool BallotVoters::equals(const Configuration& conf,
+                          const Configuration* old_conf) const {
+    if (!conf.equals(_peers) || _has_old_conf != (old_conf != NULL)) {
+        return false;
     }
+    return old_conf == NULL || old_conf->equals(_old_peers);
+}
 
-    if (_old_peers.empty()) {
-        hint.pos1 = -1;
-        return hint;
-    }
+Ballot::Ballot()
+    : _voters(NULL), _granted(0), _old_granted(0), _quorum(0), _old_quorum(0)
+{}
 
-    iter = find_peer(peer, _old_peers, hint.pos1);
+Ballot::~Ballot() {}
 
-    if (iter != _old_peers.end()) {
-        if (!iter->found) {
-            iter->found = true;
+void Ballot::init(const BallotVoters* voters) {
+    _voters = voters;
+    _granted = 0;
+    _old_granted = 0;
+    _quorum = voters->quorum();
+    _old_quorum = voters->old_quorum();
+}
+
+void Ballot::grant_at(const PosHint& pos) {
+    if (pos.pos0 >= 0) {
+        const uint64_t bit = (uint64_t)1 << pos.pos0;
+        if (!(_granted & bit)) {
+            _granted |= bit;
+            --_quorum;
+        }
+    }
+    if (pos.pos1 >= 0) {
+        const uint64_t bit = (uint64_t)1 << pos.pos1;
+        if (!(_old_granted & bit)) {
+            _old_granted |= bit;
             --_old_quorum;
         }
-        hint.pos1 = iter - _old_peers.begin();
-    } else {
-        hint.pos1 = -1;
     }
+}
 
+Ballot::PosHint Ballot::grant(const PeerId& peer, PosHint hint) {
+    hint = _voters->find(peer, hint);
+    grant_at(hint);
     return hint;
 }
 
@@ -82,4 +109,139 @@ void Ballot::grant(const PeerId& peer) {
     grant(peer, PosHint());
 }
 
+QuorumTracker::QuorumTracker() : _last_index(0) {}
+
+QuorumTracker::~QuorumTracker() {
+    for (size_t i = 0; i < _current.peers.size(); ++i) {
+        delete _current.peers[i].second;
+    }
+}
+
+size_t QuorumTracker::assign(Snapshot& bg, const Snapshot& snapshot) {
+    bg = snapshot;
+    return 1;
+}
+
+void QuorumTracker::publish() {
+    _snapshot.Modify(assign, _current);
+}
+
+void QuorumTracker::init_voters(const Configuration& conf, Voters* voters) {
+    voters->match_indexes.clear();
+    for (Configuration::const_iterator
+            iter = conf.begin(); iter != conf.end(); ++iter) {
+        MatchIndex* match_index = NULL;
+        for (size_t i = 0; i < _current.peers.size(); ++i) {
+            if (_current.peers[i].first == *iter) {
+                match_index = _current.peers[i].second;
+                break;
+            }
+        }
+        if (match_index == NULL) {
+            match_index = new MatchIndex(0);
+            _current.peers.push_back(std::make_pair(*iter, match_index));
+        }
+        voters->match_indexes.push_back(match_index);
+    }
+    voters->quorum = voters->match_indexes.size() / 2 + 1;
+}
+
+void QuorumTracker::set_configuration(int64_t first_index,
+                                      const Configuration& conf,
+                                      const Configuration* old_conf) {
+    const Configuration empty_conf;
+    if (old_conf == NULL) {
+        old_conf = &empty_conf;
+    }
+    if (!_current.segments.empty()
+            && _current.segments.back().conf.equals(conf)
+            && _current.segments.back().old_conf.equals(*old_conf)) {
+        return;
+    }
+    _current.segments.push_back(Segment());
+    Segment& segment = _current.segments.back();
+    segment.first_index = first_index;
+    segment.conf = conf;
+    segment.old_conf = *old_conf;
+    init_voters(conf, &segment.voters);
+    init_voters(*old_conf, &segment.old_voters);
+    publish();
+}
+
+int64_t QuorumTracker::quorum_index(const Voters& voters) {
+    const size_t n = voters.match_indexes.size();
+    if (n == 0) {
+        return 0;
+    }
+    DEFINE_SMALL_ARRAY(int64_t, indexes, n, 16);
+    for (size_t i = 0; i < n; ++i) {
+        indexes[i] = voters.match_indexes[i]->load(butil::memory_order_seq_cst);
+    }
+    std::nth_element(indexes, indexes + voters.quorum - 1, indexes + n,
+                     std::greater<int64_t>());
+    return indexes[voters.quorum - 1];
+}
+
+int64_t QuorumTracker::grant(const PeerId& peer, int64_t index) {
+    butil::DoublyBufferedData<Snapshot>::ScopedPtr ptr;
+    if (_snapshot.Read(&ptr) != 0) {
+        return 0;
+    }
+    MatchIndex* match_index = NULL;
+    for (size_t i = 0; i < ptr->peers.size(); ++i) {
+        if (ptr->peers[i].first == peer) {
+            match_index = ptr->peers[i].second;
+            break;
+        }
+    }
+    if (match_index == NULL) {
+        return 0;
+    }
+    // Concurrent grants are sequentially consistent, so the last one of them
+    // sees all the updates
+    int64_t prev = match_index->load(butil::memory_order_seq_cst);
+    while (prev < index && !match_index->compare_exchange_weak(
+                prev, index, butil::memory_order_seq_cst)) {
+    }
+    // Check the configurations from the last one, as a log granted commits
+    // all the logs before it as Ballot does
+    int64_t last_index = _last_index.load(butil::memory_order_acquire);
+    for (size_t i = ptr->segments.size(); i > 0; --i) {
+        const Segment& segment = ptr->segments[i - 1];
+        int64_t granted = quorum_index(segment.voters);
+        if (!segment.old_voters.match_indexes.empty()) {
+            granted = std::min(granted, quorum_index(segment.old_voters));
+        }
+        granted = std::min(granted, last_index);
+        if (granted >= segment.first_index) {
+            return granted;
+        }
+        last_index = segment.first_index - 1;
+    }
+    return 0;
+}
+
+void QuorumTracker::trim(int64_t index) {
+    size_t ntrimmed = 0;
+    while (ntrimmed + 1 < _current.segments.size()
+            && _current.segments[ntrimmed + 1].first_index <= index) {
+        ++ntrimmed;
+    }
+    if (ntrimmed == 0) {
+        return;
+    }
+    _current.segments.erase(_current.segments.begin(),
+                            _current.segments.begin() + ntrimmed);
+    publish();
+}
+
+void QuorumTracker::reset() {
+    _current.segments.clear();
+    publish();
+    for (size_t i = 0; i < _current.peers.size(); ++i) {
+        _current.peers[i].second->store(0, butil::memory_order_seq_cst);
+    }
+    _last_index.store(0, butil::memory_order_release);
+}
+
 }  // namespace braft
@@ -17,60 +17,169 @@
 #ifndef  BRAFT_BALLOT_H
 #define  BRAFT_BALLOT_H
 
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+#include <butil/containers/doubly_buffered_data.h>
 #include "braft/configuration.h"
 
 namespace braft {
 
-class Ballot {
+// Peers of a configuration, and of the old one during joint consensus, which
+// are shared by the Ballots of the logs in the configuration. Each peer is
+// identified by its positions in the configurations, which are the bits of
+// the peer in the bitmaps of a Ballot.
+class BallotVoters {
 public:
+    // Max number of peers in a configuration
+    static const size_t MAX_PEERS = 64;
+
     struct PosHint {
         PosHint() : pos0(-1), pos1(-1) {}
         int pos0;
         int pos1;
     };
 
-    Ballot();
-    ~Ballot();
-    void swap(Ballot& rhs) {
-        _peers.swap(rhs._peers);
-        std::swap(_quorum, rhs._quorum);
-        _old_peers.swap(rhs._old_peers);
-        std::swap(_old_quorum, rhs._old_quorum);
-    }
+    BallotVoters();
+    ~BallotVoters();
 
+    // Returns EINVAL if any configuration has more than MAX_PEERS peers
     int init(const Configuration& conf, const Configuration* old_conf);
-    PosHint grant(const PeerId& peer, PosHint hint);
-    void grant(const PeerId& peer);
-    bool granted() const { return _quorum <= 0 && _old_quorum <= 0; }
+
+    // Whether it's initialized with the same configurations
+    bool equals(const Configuration& conf, const Configuration* old_conf) const;
+
+    // Get the positions of |peer|, -1 if it's not in the configuration. The
+    // positions are checked with |hint| first, which are usually the same for
+    // consecutive logs.
+    PosHint find(const PeerId& peer, PosHint hint) const {
+        hint.pos0 = find_peer(peer, _peers, hint.pos0);
+        hint.pos1 = find_peer(peer, _old_peers, hint.pos1);
+        return hint;
+    }
+
+    int quorum() const { return _quorum; }
+    int old_quorum() const { return _old_quorum; }
+
 private:
-    struct UnfoundPeerId {
-        UnfoundPeerId(const PeerId& peer_id) : peer_id(peer_id), found(false) {}
-        PeerId peer_id;
-        bool found;
-        bool operator==(const PeerId& id) const {
-            return peer_id == id;
+    static int find_peer(const PeerId& peer, const std::vector<PeerId>& peers,
+                         int pos_hint) {
+        if (pos_hint >= 0 && pos_hint < (int)peers.size()
+                && peers[pos_hint] == peer) {
+            return pos_hint;
         }
-    };
-    std::vector<UnfoundPeerId>::iterator find_peer(
-            const PeerId& peer, std::vector<UnfoundPeerId>& peers, int pos_hint) {
-        if (pos_hint < 0 || pos_hint >= (int)peers.size()
-                || peers[pos_hint].peer_id != peer) {
-            for (std::vector<UnfoundPeerId>::iterator
-                    iter = peers.begin(); iter != peers.end(); ++iter) {
-                if (*iter == peer) {
-                    return iter;
-                }
+        for (size_t i = 0; i < peers.size(); ++i) {
+            if (peers[i] == peer) {
+                return i;
             }
-            return peers.end();
         }
-        return peers.begin() + pos_hint;
+        return -1;
     }
-    std::vector<UnfoundPeerId> _peers;
+    std::vector<PeerId> _peers;
+    int _quorum;
+    std::vector<PeerId> _old_peers;
+    int _old_quorum;
+    // Set if old_conf is given to init() even if it's empty
+    bool _has_old_conf;
+};
+
+// Votes for a log, which records the peers granted in flat bitmaps and
+// allocates nothing.
+class Ballot {
+public:
+    typedef BallotVoters::PosHint PosHint;
+
+    Ballot();
+    ~Ballot();
+
+    // |voters| must outlive the Ballot
+    void init(const BallotVoters* voters);
+    PosHint grant(const PeerId& peer, PosHint hint);
+    void grant(const PeerId& peer);
+    // Grant by the positions from BallotVoters::find()
+    void grant_at(const PosHint& pos);
+    bool granted() const { return _quorum <= 0 && _old_quorum <= 0; }
+    const BallotVoters* voters() const { return _voters; }
+private:
+    const BallotVoters* _voters;
+    uint64_t _granted;
+    uint64_t _old_granted;
     int _quorum;
-    std::vector<UnfoundPeerId> _old_peers;
     int _old_quorum;
 };
 
+// Tracks the last log index stable at each peer, from which the last log
+// index granted by a quorum is computed, i.e. the quorum-th largest one, or
+// the smaller one of the two quorums of a joint configuration. Unlike Ballot
+// which is kept for each log, granting costs O(peers) however many logs it
+// covers.
+//
+// grant() is lock-free and can be called concurrently, while the other
+// methods must be serialized by the caller.
+class QuorumTracker {
+public:
+    QuorumTracker();
+    ~QuorumTracker();
+
+    // Logs from |first_index| on are voted by |conf|, and by |old_conf| as
+    // well if it's not NULL. Nothing changes if the configuration is the same
+    // as the last one.
+    void set_configuration(int64_t first_index, const Configuration& conf,
+                           const Configuration* old_conf);
+
+    // Logs up to |last_index| are waiting to be granted
+    void set_last_index(int64_t last_index) {
+        _last_index.store(last_index, butil::memory_order_release);
+    }
+    int64_t last_index() const {
+        return _last_index.load(butil::memory_order_acquire);
+    }
+
+    // Logs up to |index| are stable at |peer|. Returns the last log index
+    // granted by a quorum, 0 if there's none.
+    int64_t grant(const PeerId& peer, int64_t index);
+
+    // Forget the configurations which only cover the logs before |index|
+    void trim(int64_t index);
+
+    // Forget all the configurations and the indexes of the peers
+    void reset();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(QuorumTracker);
+
+    typedef butil::atomic<int64_t> MatchIndex;
+    struct Voters {
+        Voters() : quorum(0) {}
+        std::vector<MatchIndex*> match_indexes;
+        int quorum;
+    };
+    struct Segment {
+        Segment() : first_index(0) {}
+        int64_t first_index;
+        Configuration conf;
+        Configuration old_conf;
+        Voters voters;
+        Voters old_voters;
+    };
+    struct Snapshot {
+        // MatchIndex of the peers ever seen, owned by the tracker
+        std::vector<std::pair<PeerId, MatchIndex*> > peers;
+        std::vector<Segment> segments;
+    };
+
+    // Functor to modify DBD
+    static size_t assign(Snapshot& bg, const Snapshot& snapshot);
+    static int64_t quorum_index(const Voters& voters);
+    void init_voters(const Configuration& conf, Voters* voters);
+    void publish();
+
+    butil::DoublyBufferedData<Snapshot> _snapshot;
+    // Copy of the published one, only accessed by the modifications
+    Snapshot _current;
+    butil::atomic<int64_t> _last_index;
+};
+
 };
 
 #endif  //BRAFT_BALLOT_H
@@ -14,7 +14,9 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <gflags/gflags.h>
 #include <butil/scoped_lock.h>
+#include <brpc/reloadable_flags.h>
 #include <bvar/latency_recorder.h>
 #include <bthread/unstable.h>
 #include "braft/ballot_box.h"
@@ -24,11 +26,20 @@
 
 namespace braft {
 
+DEFINE_bool(raft_commit_by_quorum_tracker, false,
+            "Commit logs by the last log index stable at each peer instead of "
+            "the ballot of each log, which costs O(peers) for each commit_at() "
+            "without holding the lock, taking effect on new nodes");
+BRPC_VALIDATE_GFLAG(raft_commit_by_quorum_tracker, ::brpc::PassValidate);
+
 BallotBox::BallotBox()
     : _waiter(NULL)
     , _closure_queue(NULL)
     , _last_committed_index(0)
     , _pending_index(0)
+    , _pending_tasks(0)
+    , _pending_bytes(0)
+    , _use_quorum_tracker(FLAGS_raft_commit_by_quorum_tracker)
 {
 }
 
@@ -48,6 +59,9 @@ int BallotBox::init(const BallotBoxOptions &options) {
 
 int BallotBox::commit_at(
         int64_t first_log_index, int64_t last_log_index, const PeerId& peer) {
+    if (_use_quorum_tracker) {
+        return commit_by_quorum_tracker(last_log_index, peer);
+    }
     // FIXME(chenzhangyi01): The cricital section is unacceptable because it 
     // blocks all the other Replicators and LogManagers
     std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -63,10 +77,16 @@ int BallotBox::commit_at(
 
     int64_t last_committed_index = 0;
     const int64_t start_at = std::max(_pending_index, first_log_index);
+    // The peer is looked up once for the logs sharing the same voters
+    const BallotVoters* voters = NULL;
     Ballot::PosHint pos_hint;
     for (int64_t log_index = start_at; log_index <= last_log_index; ++log_index) {
-        Ballot& bl = _pending_meta_queue[log_index - _pending_index];
-        pos_hint = bl.grant(peer, pos_hint);
+        Ballot& bl = _pending_meta_queue[log_index - _pending_index].ballot;
+        if (bl.voters() != voters) {
+            voters = bl.voters();
+            pos_hint = voters->find(peer, pos_hint);
+        }
+        bl.grant_at(pos_hint);
         if (bl.granted()) {
             last_committed_index = log_index;
         }
@@ -83,11 +103,7 @@ int BallotBox::commit_at(
     // removal request, we think it's safe to commit all the uncommitted 
     // previous logs, which is not well proved right now
     // TODO: add vlog when committing previous logs
-    for (int64_t index = _pending_index; index <= last_committed_index; ++index) {
-        _pending_meta_queue.pop_front();
-    }
-   
-    _pending_index = last_committed_index + 1;
+    pop_committed_tasks(last_committed_index);
     _last_committed_index.store(last_committed_index, butil::memory_order_relaxed);
     lck.unlock();
     // The order doesn't matter
@@ -95,12 +111,68 @@ int BallotBox::commit_at(
     return 0;
 }
 
+int BallotBox::commit_by_quorum_tracker(int64_t last_log_index,
+                                        const PeerId& peer) {
+    if (last_log_index > _quorum_tracker.last_index()) {
+        return ERANGE;
+    }
+    const int64_t granted = _quorum_tracker.grant(peer, last_log_index);
+    int64_t last_committed_index =
+            _last_committed_index.load(butil::memory_order_relaxed);
+    while (granted > last_committed_index) {
+        if (_last_committed_index.compare_exchange_weak(
+                    last_committed_index, granted,
+                    butil::memory_order_relaxed)) {
+            // Only the commit_at() advancing the committed index locks, and
+            // the cost doesn't depend on the number of peers
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                if (_pending_index != 0) {
+                    pop_committed_tasks(granted);
+                }
+            }
+            // The order doesn't matter
+            _waiter->on_committed(granted);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+void BallotBox::pop_committed_tasks(int64_t last_committed_index) {
+    const size_t ncommitted = std::min<int64_t>(
+            std::max<int64_t>(last_committed_index - _pending_index + 1, 0),
+            _pending_meta_queue.size());
+    int64_t committed_bytes = 0;
+    for (size_t i = 0; i < ncommitted; ++i) {
+        committed_bytes += _pending_meta_queue[i].data_size;
+    }
+    _pending_meta_queue.pop_front(ncommitted);
+    _pending_index += ncommitted;
+    _pending_tasks.fetch_sub(ncommitted, butil::memory_order_relaxed);
+    _pending_bytes.fetch_sub(committed_bytes, butil::memory_order_relaxed);
+    if (_use_quorum_tracker) {
+        _quorum_tracker.trim(_pending_index);
+        return;
+    }
+    // Drop the voters not used by any pending ballot
+    while (_voters.size() > 1 && (_pending_meta_queue.empty()
+                || &_voters.front() != _pending_meta_queue.front().ballot.voters())) {
+        _voters.pop_front();
+    }
+}
+
 int BallotBox::clear_pending_tasks() {
-    std::deque<Ballot> saved_meta;
     {
         BAIDU_SCOPED_LOCK(_mutex);
-        saved_meta.swap(_pending_meta_queue);
+        _pending_meta_queue.clear();
+        _voters.clear();
         _pending_index = 0;
+        if (_use_quorum_tracker) {
+            _quorum_tracker.reset();
+        }
+        _pending_tasks.store(0, butil::memory_order_relaxed);
+        _pending_bytes.store(0, butil::memory_order_relaxed);
     }
     _closure_queue->clear();
     return 0;
@@ -119,18 +191,53 @@ int BallotBox::reset_pending_index(int64_t new_pending_index) {
 }
 
 int BallotBox::append_pending_task(const Configuration& conf, const Configuration* old_conf,
-                                   Closure* closure) {
-    Ballot bl;
-    if (bl.init(conf, old_conf) != 0) {
-        CHECK(false) << "Fail to init ballot";
-        return -1;
-    }
+                                   Closure* closure, int64_t data_size) {
+    return append_pending_tasks(conf, old_conf, &closure, &data_size, 1);
+}
 
+int BallotBox::append_pending_tasks(const Configuration& conf,
+                                    const Configuration* old_conf,
+                                    Closure* const closures[],
+                                    const int64_t data_sizes[],
+                                    size_t size) {
+    if (size == 0) {
+        return 0;
+    }
     BAIDU_SCOPED_LOCK(_mutex);
     CHECK(_pending_index > 0);
-    _pending_meta_queue.push_back(Ballot());
-    _pending_meta_queue.back().swap(bl);
-    _closure_queue->append_pending_closure(closure);
+    const int64_t first_index = _pending_index + _pending_meta_queue.size();
+    const BallotVoters* voters = NULL;
+    if (_use_quorum_tracker) {
+        _quorum_tracker.set_configuration(first_index, conf, old_conf);
+    } else {
+        // The voters are shared by the ballots until the configuration changes
+        if (_voters.empty() || !_voters.back().equals(conf, old_conf)) {
+            _voters.push_back(BallotVoters());
+            if (_voters.back().init(conf, old_conf) != 0) {
+                // Such configurations are rejected before being proposed
+                _voters.pop_back();
+                return -1;
+            }
+        }
+        voters = &_voters.back();
+    }
+    const size_t offset = _pending_meta_queue.size();
+    _pending_meta_queue.append(size);
+    int64_t nbytes = 0;
+    for (size_t i = 0; i < size; ++i) {
+        PendingMeta& meta = _pending_meta_queue[offset + i];
+        if (voters) {
+            meta.ballot.init(voters);
+        }
+        meta.data_size = data_sizes ? data_sizes[i] : 0;
+        nbytes += meta.data_size;
+    }
+    if (_use_quorum_tracker) {
+        _quorum_tracker.set_last_index(first_index + size - 1);
+    }
+    _pending_tasks.fetch_add(size, butil::memory_order_relaxed);
+    _pending_bytes.fetch_add(nbytes, butil::memory_order_relaxed);
+    _closure_queue->append_pending_closures(closures, size);
     return 0;
 }
 
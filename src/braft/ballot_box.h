@@ -24,6 +24,7 @@
 #include "braft/raft.h"
 #include "braft/util.h"
 #include "braft/ballot.h"
+#include "braft/ring_queue.h"
 
 namespace braft {
 
@@ -77,7 +78,17 @@ public:
     // Store application context before replication.
     int append_pending_task(const Configuration& conf, 
                             const Configuration* old_conf,
-                            Closure* closure);
+                            Closure* closure,
+                            int64_t data_size = 0);
+
+    // Called by leader, otherwise the behavior is undefined
+    // Store application contexts of |size| consecutive logs, |data_sizes|
+    // may be NULL.
+    int append_pending_tasks(const Configuration& conf,
+                             const Configuration* old_conf,
+                             Closure* const closures[],
+                             const int64_t data_sizes[],
+                             size_t size);
 
     // Called by follower, otherwise the behavior is undefined.
     // Set committed index received from leader
@@ -86,18 +97,41 @@ public:
     int64_t last_committed_index() 
     { return _last_committed_index.load(butil::memory_order_acquire); }
 
+    // Number and total data size of the tasks waiting to be committed
+    int64_t pending_tasks() const
+    { return _pending_tasks.load(butil::memory_order_relaxed); }
+    int64_t pending_bytes() const
+    { return _pending_bytes.load(butil::memory_order_relaxed); }
+
     void describe(std::ostream& os, bool use_html);
 
     void get_status(BallotBoxStatus* ballot_box_status);
 
 private:
+    struct PendingMeta {
+        PendingMeta() : data_size(0) {}
+        Ballot ballot;
+        int64_t data_size;
+    };
+
+    int commit_by_quorum_tracker(int64_t last_log_index, const PeerId& peer);
+    // Drop the tasks up to |last_committed_index|, with _mutex held
+    void pop_committed_tasks(int64_t last_committed_index);
 
     FSMCaller*                                      _waiter;
     ClosureQueue*                                   _closure_queue;                            
     raft_mutex_t                                    _mutex;
     butil::atomic<int64_t>                          _last_committed_index;
     int64_t                                         _pending_index;
-    std::deque<Ballot>                              _pending_meta_queue;
+    RingQueue<PendingMeta>                          _pending_meta_queue;
+    // Voters of the pending ballots in the order of logs, the last one is
+    // used by the coming ones
+    std::deque<BallotVoters>                        _voters;
+    butil::atomic<int64_t>                          _pending_tasks;
+    butil::atomic<int64_t>                          _pending_bytes;
+    // Used instead of the ballots if it's on
+    bool                                            _use_quorum_tracker;
+    QuorumTracker                                   _quorum_tracker;
 
 };
 
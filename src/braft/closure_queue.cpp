@@ -30,18 +30,21 @@ ClosureQueue::~ClosureQueue() {
 }
 
 void ClosureQueue::clear() {
-    std::deque<Closure*> saved_queue;
+    std::vector<Closure*> saved_queue;
     {
         BAIDU_SCOPED_LOCK(_mutex);
-        saved_queue.swap(_queue);
+        saved_queue.reserve(_queue.size());
+        for (size_t i = 0; i < _queue.size(); ++i) {
+            saved_queue.push_back(_queue[i]);
+        }
+        _queue.clear();
         _first_index = 0;
     }
     bool run_bthread = false;
-    for (std::deque<Closure*>::iterator 
-            it = saved_queue.begin(); it != saved_queue.end(); ++it) {
-        if (*it) {
-            (*it)->status().set_error(EPERM, "leader stepped down");
-            run_closure_in_bthread_nosig(*it, _usercode_in_pthread);
+    for (size_t i = 0; i < saved_queue.size(); ++i) {
+        if (saved_queue[i]) {
+            saved_queue[i]->status().set_error(EPERM, "leader stepped down");
+            run_closure_in_bthread_nosig(saved_queue[i], _usercode_in_pthread);
             run_bthread = true;
         }
     }
@@ -61,6 +64,16 @@ void ClosureQueue::append_pending_closure(Closure* c) {
     _queue.push_back(c);
 }
 
+void ClosureQueue::append_pending_closures(Closure* const closures[],
+                                           size_t size) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const size_t offset = _queue.size();
+    _queue.append(size);
+    for (size_t i = 0; i < size; ++i) {
+        _queue[offset + i] = closures[i];
+    }
+}
+
 int ClosureQueue::pop_closure_until(int64_t index,
                                     std::vector<Closure*> *out, int64_t *out_first_index) {
     out->clear();
@@ -76,10 +89,12 @@ int ClosureQueue::pop_closure_until(int64_t index,
         return -1;
     }
     *out_first_index = _first_index;
-    for (int64_t i = _first_index; i <= index; ++i) {
-        out->push_back(_queue.front());
-        _queue.pop_front();
+    const size_t size = index - _first_index + 1;
+    out->reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        out->push_back(_queue[i]);
     }
+    _queue.pop_front(size);
     _first_index = index + 1;
     return 0;
 }
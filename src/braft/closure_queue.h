@@ -18,6 +18,7 @@
 #define  BRAFT_CLOSURE_QUEUE_H
 
 #include "braft/util.h"
+#include "braft/ring_queue.h"
 
 namespace braft {
 
@@ -39,6 +40,10 @@ public:
     // Append the closure
     void append_pending_closure(Closure* c);
 
+    // Called by leader, otherwise the behavior is undefined
+    // Append |size| closures at a time
+    void append_pending_closures(Closure* const closures[], size_t size);
+
     // Pop all the closure until |index| (included) into out in the same order
     // of their indexes, |out_first_index| would be assigned the index of out[0] if
     // out is not empty, index + 1 otherwise.
@@ -48,7 +53,7 @@ private:
     // TODO: a spsc lock-free queue would help
     raft_mutex_t                                    _mutex;
     int64_t                                         _first_index;
-    std::deque<Closure*>                            _queue;
+    RingQueue<Closure*>                             _queue;
     bool                                            _usercode_in_pthread;
 
 };
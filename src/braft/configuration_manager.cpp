@@ -30,6 +30,17 @@ int ConfigurationManager::add(const ConfigurationEntry& entry) {
     return 0;
 }
 
+int ConfigurationManager::add(const ConfigurationManager& other) {
+    for (std::deque<ConfigurationEntry>::const_iterator 
+            it = other._configurations.begin(); 
+            it != other._configurations.end(); ++it) {
+        if (add(*it) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void ConfigurationManager::truncate_prefix(const int64_t first_index_kept) {
     while (!_configurations.empty()
             && _configurations.front().id.index < first_index_kept) {
@@ -56,6 +56,10 @@ public:
     // add new configuration at index
     int add(const ConfigurationEntry& entry);
 
+    // add all the configurations of |other|, which must be after the ones
+    // in this manager
+    int add(const ConfigurationManager& other);
+
     // [1, first_index_kept) are being discarded
     void truncate_prefix(int64_t first_index_kept);
 
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <bvar/bvar.h>
+#include "braft/encoded_entries_cache.h"
+
+namespace braft {
+
+static bvar::Adder<int64_t> g_encoded_entries_hit
+            ("raft_encoded_entries_cache_hit_count");
+static bvar::Adder<int64_t> g_encoded_entries_miss
+            ("raft_encoded_entries_cache_miss_count");
+
+scoped_refptr<EncodedEntries> EncodedEntriesCache::get(
+        int64_t term, int64_t first_index, int max_entries,
+        size_t max_body_size, int64_t last_log_index) {
+    scoped_refptr<EncodedEntries> batch;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        batch = _slots[first_index % SLOTS];
+    }
+    if (batch == NULL || batch->term != term
+            || batch->first_index != first_index
+            || batch->entries.size() > max_entries
+            || (!batch->full && batch->last_index() < last_log_index)) {
+        g_encoded_entries_miss << 1;
+        return NULL;
+    }
+    // Every entry but the last one must have been appended within
+    // |max_body_size|, see Replicator::_prepare_entry
+    const int64_t last_data_len =
+            batch->entries.Get(batch->entries.size() - 1).data_len();
+    if (batch->data.length() - last_data_len >= max_body_size) {
+        g_encoded_entries_miss << 1;
+        return NULL;
+    }
+    g_encoded_entries_hit << 1;
+    return batch;
+}
+
+void EncodedEntriesCache::put(EncodedEntries* entries) {
+    CHECK_GT(entries->entries.size(), 0);
+    scoped_refptr<EncodedEntries> replaced(entries);
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _slots[entries->first_index % SLOTS].swap(replaced);
+    }
+    // The replaced batch is released out of the lock
+}
+
+void EncodedEntriesCache::clear() {
+    // Released after the lock is unlocked
+    scoped_refptr<EncodedEntries> slots[SLOTS];
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (int i = 0; i < SLOTS; ++i) {
+        _slots[i].swap(slots[i]);
+    }
+}
+
+}  //  namespace braft
@@ -0,0 +1,74 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_ENCODED_ENTRIES_CACHE_H
+#define  BRAFT_ENCODED_ENTRIES_CACHE_H
+
+#include <butil/iobuf.h>
+#include <butil/memory/ref_counted.h>
+#include "braft/raft.pb.h"
+#include "braft/util.h"
+
+namespace braft {
+
+// Consecutive logs encoded as the entries and the attachment of
+// AppendEntriesRequest by the leader of |term|. It's immutable once put into
+// EncodedEntriesCache.
+struct EncodedEntries : public butil::RefCountedThreadSafe<EncodedEntries> {
+    int64_t term;
+    int64_t first_index;
+    google::protobuf::RepeatedPtrField<EntryMeta> entries;
+    butil::IOBuf data;
+    // Whether the batch was cut by the limits of the request instead of
+    // reaching the last log
+    bool full;
+
+    EncodedEntries() : term(0), first_index(0), full(false) {}
+    int64_t last_index() const { return first_index + entries.size() - 1; }
+};
+
+// Recently encoded batches shared by the replicators of a group, so that the
+// logs are encoded once rather than once per follower when the followers
+// are replicating the same range, which is the common case.
+// Thread-safe.
+class EncodedEntriesCache {
+public:
+    EncodedEntriesCache() {}
+
+    // Get the batch encoded in |term| starting at |first_index|, which fits
+    // in a request of at most |max_entries| entries and |max_body_size|
+    // bytes. A batch that is not full is returned only if it reaches
+    // |last_log_index|. Returns NULL if there's no such batch.
+    scoped_refptr<EncodedEntries> get(int64_t term, int64_t first_index,
+                                      int max_entries, size_t max_body_size,
+                                      int64_t last_log_index);
+
+    // Put |entries| into the cache, replacing the batch at the same slot
+    void put(EncodedEntries* entries);
+
+    // Drop all the batches
+    void clear();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EncodedEntriesCache);
+
+    static const int SLOTS = 8;
+
+    raft_mutex_t _mutex;
+    scoped_refptr<EncodedEntries> _slots[SLOTS];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_ENCODED_ENTRIES_CACHE_H
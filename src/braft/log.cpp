@@ -18,6 +18,8 @@
 
 #include "braft/log.h"
 
+#include <algorithm>                                 // std::lower_bound
+#include <limits>                                    // std::numeric_limits
 #include <gflags/gflags.h>
 #include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
 #include <butil/file_util.h>                         // butil::CreateDirectory
@@ -25,7 +27,13 @@
 #include <butil/time.h>
 #include <butil/raw_pack.h>                          // butil::RawPacker
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
+#include <sys/mman.h>                                // mmap
+#include <butil/string_splitter.h>                  // butil::StringSplitter
+#include <bthread/execution_queue.h>                 // bthread::ExecutionQueueId
 #include <brpc/reloadable_flags.h>             // 
+#include <brpc/policy/snappy_compress.h>             // SnappyCompress
+#include <brpc/policy/gzip_compress.h>               // ZlibCompress
 
 #include "braft/local_storage.pb.h"
 #include "braft/log_entry.h"
@@ -37,6 +45,8 @@
 //#define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020ld_%020ld"
 #define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020" PRId64
 #define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020" PRId64 "_%020" PRId64
+#define BRAFT_SEGMENT_SPARE_PATTERN "log_spare_%020" PRId64
+#define BRAFT_SEGMENT_INDEX_PATTERN "log_index_%020" PRId64 "_%020" PRId64
 #define BRAFT_SEGMENT_META_FILE  "log_meta"
 
 namespace braft {
@@ -52,9 +62,61 @@ BRPC_VALIDATE_GFLAG(raft_max_segment_size, brpc::PositiveInteger);
 DEFINE_bool(raft_sync_segments, false, "call fsync when a segment is closed");
 BRPC_VALIDATE_GFLAG(raft_sync_segments, ::brpc::PassValidate);
 
+DEFINE_int32(raft_max_preallocated_segments, 0,
+             "Max number of zero-filled files of raft_max_segment_size bytes "
+             "kept by each segment log storage to become the next open "
+             "segments, segments removed by truncate_prefix are recycled into "
+             "them. 0 disables preallocation");
+BRPC_VALIDATE_GFLAG(raft_max_preallocated_segments, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_segment_index, true, 
+            "Save offsets and terms of the entries in an index file when a "
+            "segment is closed, which is loaded on restart instead of scanning "
+            "the whole segment");
+BRPC_VALIDATE_GFLAG(raft_segment_index, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_load_segment_concurrency, 4,
+             "Max number of closed segments loaded concurrently on init");
+BRPC_VALIDATE_GFLAG(raft_max_load_segment_concurrency, brpc::PositiveInteger);
+
+DEFINE_bool(raft_segment_direct_io, false,
+            "Write segments with O_DIRECT to keep the logs out of the page "
+            "cache, which are read through a private cache of each storage "
+            "then. Takes effect on storages initialized afterwards");
+BRPC_VALIDATE_GFLAG(raft_segment_direct_io, ::brpc::PassValidate);
+
+DEFINE_int32(raft_direct_io_read_cache_size, 4 * 1024 * 1024,
+             "Bytes of the private read cache of each segment log storage "
+             "in O_DIRECT mode");
+BRPC_VALIDATE_GFLAG(raft_direct_io_read_cache_size, brpc::PositiveInteger);
+
+DEFINE_bool(raft_segment_batch_frame, false,
+            "Write the entries of the same term appended together as one "
+            "batch frame with a single header and checksum. Segments written "
+            "this way can't be read by former versions");
+BRPC_VALIDATE_GFLAG(raft_segment_batch_frame, ::brpc::PassValidate);
+
+DEFINE_bool(raft_segment_mmap, false,
+            "Map closed segments into memory, entries read from them reference "
+            "the mapped pages without copying. Ignored in O_DIRECT mode");
+BRPC_VALIDATE_GFLAG(raft_segment_mmap, ::brpc::PassValidate);
+
+DEFINE_int32(raft_segment_reclaim_mb_per_second, 256,
+             "Max megabytes of discarded segments unlinked per second in "
+             "background, 0 means unlimited");
+BRPC_VALIDATE_GFLAG(raft_segment_reclaim_mb_per_second, 
+                    brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_max_prepared_log_bytes, 16 * 1024 * 1024,
+             "Max bytes of the records encoded by prepare_entries() and not "
+             "appended yet, entries beyond which are encoded when appending");
+BRPC_VALIDATE_GFLAG(raft_max_prepared_log_bytes, brpc::NonNegativeInteger);
+
 static bvar::LatencyRecorder g_open_segment_latency("raft_open_segment");
 static bvar::LatencyRecorder g_segment_append_entry_latency("raft_segment_append_entry");
 static bvar::LatencyRecorder g_sync_segment_latency("raft_sync_segment");
+static bvar::Adder<int64_t> g_reclaiming_segment_bytes(
+                                    "raft_reclaiming_segment_bytes");
 
 int ftruncate_uninterrupted(int fd, off_t length) {
     int rc = 0;
@@ -69,6 +131,12 @@ enum CheckSumType {
     CHECKSUM_CRC32 = 1,   
 };
 
+enum SegmentCompressType {
+    SEGMENT_COMPRESS_NONE = 0,
+    SEGMENT_COMPRESS_SNAPPY = 1,
+    SEGMENT_COMPRESS_ZLIB = 2,
+};
+
 enum RaftSyncPolicy {
     RAFT_SYNC_IMMEDIATELY = 0,
     RAFT_SYNC_BY_BYTES = 1,
@@ -77,16 +145,301 @@ enum RaftSyncPolicy {
 
 // Format of Header, all fields are in network order
 // | -------------------- term (64bits) -------------------------  |
-// | entry-type (8bits) | checksum_type (8bits) | reserved(16bits) |
+// | entry-type (8bits) | checksum_type (8bits) | flags (16bits)   |
 // | ------------------ data len (32bits) -----------------------  |
 // | data_checksum (32bits) | header checksum (32bits)             |
+//
+// The data is compressed if the compress type in bits 8-11 of flags is set,
+// data len and data_checksum are of the compressed bytes then.
+//
+// With ENTRY_FLAG_BATCH_FRAME the data is a batch frame holding several
+// entries of the term, which is checksumed as a whole:
+// | ------------------ entry count (32bits) --------------------  |
+// | entry-type (8bits) | entry data len (24bits) | ... (per entry) |
+// | data of the entries ...                                        |
 
 const static size_t ENTRY_HEADER_SIZE = 24;
 
+const static uint32_t ENTRY_FLAG_BATCH_FRAME = 1;
+const static size_t FRAME_SLOT_SIZE = 4;
+const static size_t MAX_FRAME_SLOT_SIZE = 1ul << 24;
+// Bytes of entries put in one frame, which is also the most a segment
+// may go beyond raft_max_segment_size by a frame
+const static size_t MAX_FRAME_BYTES = 1024 * 1024;
+
+const static uint32_t ENTRY_COMPRESS_SHIFT = 8;
+const static uint32_t ENTRY_COMPRESS_MASK = 0xF;
+// Data shorter than this is hardly compressed
+const static size_t MIN_COMPRESS_SIZE = 64;
+
+// Granularity at which a torn write leaves zeros in a preallocated segment
+const static off_t TORN_SECTOR_SIZE = 512;
+
+static const char s_zero_buf[1024 * 1024] = {};
+
+// Alignment of buffers, offsets and lengths of O_DIRECT reads and writes
+const static int64_t DIRECT_IO_ALIGNMENT = 4096;
+const static int64_t DIRECT_READ_CHUNK_SIZE = 64 * 1024;
+
+// Identifies the content of a segment file in DirectReadCache
+static butil::atomic<uint64_t> s_next_cache_id(1);
+
+inline int64_t align_down(int64_t n) {
+    return n / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+inline int64_t align_up(int64_t n) {
+    return align_down(n + DIRECT_IO_ALIGNMENT - 1);
+}
+
+static char* alloc_aligned(size_t size) {
+    void* buf = NULL;
+    if (posix_memalign(&buf, DIRECT_IO_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    return (char*)buf;
+}
+
+// Read at most |size| bytes at |offset| of |fd| into |buf|, which are all
+// aligned. Returns the number of bytes read, -1 on error
+static ssize_t direct_pread(int fd, char* buf, size_t size, off_t offset) {
+    size_t nread = 0;
+    while (nread < size) {
+        const ssize_t n = ::pread(fd, buf + nread, size - nread, offset + nread);
+        if (n > 0) {
+            nread += n;
+            if (nread % DIRECT_IO_ALIGNMENT != 0) {
+                // Reached the end of file
+                break;
+            }
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return nread;
+}
+
+static int direct_pwrite(int fd, const char* buf, size_t size, off_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = ::pwrite(fd, buf + written, size - written,
+                                   offset + written);
+        if (n > 0) {
+            written += n;
+        } else if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write |data| at the beginning of |fd| opened with O_DIRECT, staged in an
+// aligned buffer padded with zeros which are truncated afterwards. Returns the
+// number of bytes written, -1 on error
+static ssize_t direct_pwrite_iobuf(int fd, const butil::IOBuf& data) {
+    const size_t len = align_up(data.size());
+    if (len > 0) {
+        char* buf = alloc_aligned(len);
+        if (buf == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        data.copy_to(buf);
+        memset(buf + data.size(), 0, len - data.size());
+        const int rc = direct_pwrite(fd, buf, len, 0);
+        free(buf);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+    if (ftruncate_uninterrupted(fd, data.size()) != 0) {
+        return -1;
+    }
+    return data.size();
+}
+
+DirectReadCache::DirectReadCache(size_t capacity)
+    : _capacity(std::max<size_t>(capacity / DIRECT_READ_CHUNK_SIZE, 1))
+    , _clock(0)
+{}
+
+ssize_t DirectReadCache::read(uint64_t id, int fd, off_t offset, size_t size,
+                              int64_t cacheable_end, butil::IOBuf* out) {
+    size_t nread = 0;
+    char* buf = NULL;
+    while (nread < size) {
+        const off_t pos = offset + nread;
+        const off_t chunk_offset = 
+                pos / DIRECT_READ_CHUNK_SIZE * DIRECT_READ_CHUNK_SIZE;
+        butil::IOBuf chunk;
+        bool hit = false;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            for (size_t i = 0; i < _chunks.size(); ++i) {
+                if (_chunks[i].id == id && _chunks[i].offset == chunk_offset) {
+                    _chunks[i].last_access = ++_clock;
+                    chunk = _chunks[i].data;
+                    hit = true;
+                    break;
+                }
+            }
+        }
+        if (!hit) {
+            if (buf == NULL) {
+                buf = alloc_aligned(DIRECT_READ_CHUNK_SIZE);
+                if (buf == NULL) {
+                    LOG(ERROR) << "Fail to allocate read buffer";
+                    return -1;
+                }
+            }
+            const ssize_t n = direct_pread(fd, buf, DIRECT_READ_CHUNK_SIZE,
+                                           chunk_offset);
+            if (n < 0) {
+                PLOG(WARNING) << "Fail to read fd=" << fd
+                              << " offset=" << chunk_offset;
+                free(buf);
+                return -1;
+            }
+            chunk.append(buf, n);
+            // Partial chunks at the end of file are not cached as they grow
+            if (n == DIRECT_READ_CHUNK_SIZE 
+                    && chunk_offset + DIRECT_READ_CHUNK_SIZE <= cacheable_end) {
+                BAIDU_SCOPED_LOCK(_mutex);
+                size_t victim = _chunks.size();
+                for (size_t i = 0; i < _chunks.size(); ++i) {
+                    if (_chunks[i].id == id && _chunks[i].offset == chunk_offset) {
+                        // Inserted by a concurrent reader
+                        victim = i;
+                        break;
+                    }
+                    if (_chunks.size() >= _capacity && (victim == _chunks.size()
+                            || _chunks[i].last_access < _chunks[victim].last_access)) {
+                        victim = i;
+                    }
+                }
+                if (victim == _chunks.size()) {
+                    _chunks.push_back(Chunk());
+                }
+                _chunks[victim].id = id;
+                _chunks[victim].offset = chunk_offset;
+                _chunks[victim].last_access = ++_clock;
+                _chunks[victim].data = chunk;
+            }
+        }
+        const size_t skip = pos - chunk_offset;
+        if (chunk.length() <= skip) {
+            break;
+        }
+        const size_t len = std::min(chunk.length() - skip, size - nread);
+        chunk.append_to(out, len, skip);
+        nread += len;
+        if (chunk.length() < (size_t)DIRECT_READ_CHUNK_SIZE) {
+            break;
+        }
+    }
+    free(buf);
+    return nread;
+}
+
+static bool compress_data(int compress_type, const butil::IOBuf& in, 
+                          butil::IOBuf* out) {
+    switch (compress_type) {
+    case SEGMENT_COMPRESS_SNAPPY:
+        return brpc::policy::SnappyCompress(in, out);
+    case SEGMENT_COMPRESS_ZLIB:
+        return brpc::policy::ZlibCompress(in, out, NULL);
+    default:
+        return false;
+    }
+}
+
+static bool decompress_data(int compress_type, const butil::IOBuf& in, 
+                            butil::IOBuf* out) {
+    switch (compress_type) {
+    case SEGMENT_COMPRESS_SNAPPY:
+        return brpc::policy::SnappyDecompress(in, out);
+    case SEGMENT_COMPRESS_ZLIB:
+        return brpc::policy::ZlibDecompress(in, out);
+    default:
+        LOG(ERROR) << "Unknown compress_type=" << compress_type;
+        return false;
+    }
+}
+
+// Mappings by their end address, to find the mapping of the data released
+// by IOBuf
+struct SegmentMappingRegistry {
+    raft_mutex_t mutex;
+    std::map<uintptr_t, SegmentMapping*> mappings;
+};
+
+SegmentMapping* SegmentMapping::create(int fd, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap fd=" << fd << " size=" << size;
+        return NULL;
+    }
+    SegmentMapping* mapping = new SegmentMapping((char*)data, size);
+    SegmentMappingRegistry* registry = 
+            butil::get_leaky_singleton<SegmentMappingRegistry>();
+    BAIDU_SCOPED_LOCK(registry->mutex);
+    registry->mappings[(uintptr_t)data + size] = mapping;
+    return mapping;
+}
+
+SegmentMapping::~SegmentMapping() {
+    SegmentMappingRegistry* registry = 
+            butil::get_leaky_singleton<SegmentMappingRegistry>();
+    {
+        // Unregistered before unmapping, as the address may be mapped again
+        BAIDU_SCOPED_LOCK(registry->mutex);
+        registry->mappings.erase((uintptr_t)_data + _size);
+    }
+    if (munmap(_data, _size) != 0) {
+        PLOG(ERROR) << "Fail to munmap " << (void*)_data << " size=" << _size;
+    }
+}
+
+ssize_t SegmentMapping::read(off_t offset, size_t size, butil::IOBuf* buf) {
+    if (offset >= (off_t)_size) {
+        return 0;
+    }
+    const size_t n = std::min<size_t>(size, _size - offset);
+    // Released by release_data() when the block is freed
+    AddRef();
+    if (buf->append_user_data(_data + offset, n, release_data) != 0) {
+        Release();
+        return -1;
+    }
+    return n;
+}
+
+void SegmentMapping::release_data(void* data) {
+    SegmentMapping* mapping = NULL;
+    {
+        SegmentMappingRegistry* registry = 
+                butil::get_leaky_singleton<SegmentMappingRegistry>();
+        BAIDU_SCOPED_LOCK(registry->mutex);
+        std::map<uintptr_t, SegmentMapping*>::iterator it = 
+                registry->mappings.upper_bound((uintptr_t)data);
+        CHECK(it != registry->mappings.end()) 
+                << "Fail to find the mapping of " << data;
+        mapping = it->second;
+    }
+    // Alive as the released block holds a reference
+    mapping->Release();
+}
+
 struct Segment::EntryHeader {
     int64_t term;
     int type;
     int checksum_type;
+    int flags;
     uint32_t data_len;
     uint32_t data_checksum;
 };
@@ -94,10 +447,101 @@ struct Segment::EntryHeader {
 std::ostream& operator<<(std::ostream& os, const Segment::EntryHeader& h) {
     os << "{term=" << h.term << ", type=" << h.type << ", data_len="
        << h.data_len << ", checksum_type=" << h.checksum_type
-       << ", data_checksum=" << h.data_checksum << '}';
+       << ", flags=" << h.flags << ", data_checksum=" << h.data_checksum << '}';
     return os;
 }
 
+struct FrameSlot {
+    int type;
+    // offset of the data in the frame
+    size_t offset;
+    size_t length;
+};
+
+// Parse the entry table of a batch frame
+static int parse_frame(const butil::IOBuf& frame, std::vector<FrameSlot>* slots) {
+    char count_buf[4];
+    if (frame.copy_to(count_buf, sizeof(count_buf)) != sizeof(count_buf)) {
+        return -1;
+    }
+    uint32_t count = 0;
+    RawUnpacker(count_buf).unpack32(count);
+    size_t offset = sizeof(count_buf) + (size_t)count * FRAME_SLOT_SIZE;
+    if (count == 0 || offset > frame.length()) {
+        return -1;
+    }
+    std::vector<char> table(count * FRAME_SLOT_SIZE);
+    frame.copy_to(&table[0], table.size(), sizeof(count_buf));
+    slots->resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = 0;
+        RawUnpacker(&table[i * FRAME_SLOT_SIZE]).unpack32(slot);
+        (*slots)[i].type = slot >> 24;
+        (*slots)[i].offset = offset;
+        (*slots)[i].length = slot & (MAX_FRAME_SLOT_SIZE - 1);
+        offset += (*slots)[i].length;
+    }
+    return offset == frame.length() ? 0 : -1;
+}
+
+// Number of the entries from |begin| to be written in one batch frame, which
+// share the same term and are small enough
+static size_t frame_size(const std::vector<LogEntry*>& entries, size_t begin) {
+    size_t bytes = 0;
+    size_t end = begin;
+    for (; end < entries.size(); ++end) {
+        const LogEntry* entry = entries[end];
+        bytes += entry->data.size();
+        if (entry->id.term != entries[begin]->id.term 
+                || entry->data.size() >= MAX_FRAME_SLOT_SIZE
+                || (end > begin && bytes > MAX_FRAME_BYTES)) {
+            break;
+        }
+    }
+    return std::max<size_t>(end - begin, 1);
+}
+
+// Entries in a batch frame share the offset of the frame
+struct OffsetLess {
+    bool operator()(const std::pair<int64_t, int64_t>& p, int64_t offset) const {
+        return p.first < offset;
+    }
+    bool operator()(int64_t offset, const std::pair<int64_t, int64_t>& p) const {
+        return offset < p.first;
+    }
+};
+
+// Find the position of the |meta_index|-th entry, |end_offset| is the end of
+// the last entry
+static void locate_entry(
+        const std::vector<std::pair<int64_t, int64_t> >& offset_and_term,
+        int64_t meta_index, int64_t end_offset, 
+        int64_t* offset, int64_t* length, int* slot) {
+    typedef std::vector<std::pair<int64_t, int64_t> >::const_iterator Iterator;
+    const int64_t entry_offset = offset_and_term[meta_index].first;
+    Iterator it = offset_and_term.begin() + meta_index;
+    int64_t next_offset = end_offset;
+    if (it + 1 != offset_and_term.end() && (it + 1)->first == entry_offset) {
+        it = std::upper_bound(it + 1, offset_and_term.end(), entry_offset, 
+                              OffsetLess());
+        if (it != offset_and_term.end()) {
+            next_offset = it->first;
+        }
+    } else if (it + 1 != offset_and_term.end()) {
+        next_offset = (it + 1)->first;
+    }
+    int64_t first = meta_index;
+    if (meta_index > 0 && offset_and_term[meta_index - 1].first == entry_offset) {
+        first = std::lower_bound(offset_and_term.begin(), 
+                                 offset_and_term.begin() + meta_index,
+                                 entry_offset, OffsetLess())
+                - offset_and_term.begin();
+    }
+    *offset = entry_offset;
+    *length = next_offset - entry_offset;
+    *slot = meta_index - first;
+}
+
 int Segment::create() {
     if (!_is_open) {
         CHECK(false) << "Create on a closed segment at first_index=" 
@@ -107,15 +551,68 @@ int Segment::create() {
 
     std::string path(_path);
     butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
-    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    _fd = ::open(path.c_str(), _open_flags() | O_CREAT | O_TRUNC, 0644);
     if (_fd >= 0) {
         butil::make_close_on_exec(_fd);
     }
     LOG_IF(INFO, _fd >= 0) << "Created new segment `" << path 
                            << "' with fd=" << _fd ;
+    if (_fd >= 0 && _direct_io) {
+        return _reset_tail(0);
+    }
     return _fd >= 0 ? 0 : -1;
 }
 
+// Make the renaming of the files in |dir| durable
+static int sync_dir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << dir;
+        return -1;
+    }
+    const int ret = ::fsync(fd);
+    PLOG_IF(WARNING, ret != 0) << "Fail to sync " << dir;
+    ::close(fd);
+    return ret;
+}
+
+int Segment::create(const std::string& spare_path) {
+    if (!_is_open) {
+        CHECK(false) << "Create on a closed segment at first_index=" 
+                     << _first_index << " in " << _path;
+        return -1;
+    }
+
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    if (::rename(spare_path.c_str(), path.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to rename `" << spare_path << "' to `" 
+                      << path << '\'';
+        return create();
+    }
+    _fd = ::open(path.c_str(), _open_flags());
+    if (_fd < 0) {
+        PLOG(WARNING) << "Fail to open " << path;
+        return create();
+    }
+    butil::make_close_on_exec(_fd);
+    // Writing the preallocated blocks doesn't commit the metadata, make the
+    // new name durable before any entry is reported to be stable in it, or
+    // the file would be taken as a spare one after a crash
+    if (FLAGS_raft_sync && sync_dir(_path) != 0) {
+        ::close(_fd);
+        _fd = -1;
+        return -1;
+    }
+    _preallocated = true;
+    if (_direct_io && _reset_tail(0) != 0) {
+        return -1;
+    }
+    LOG(INFO) << "Created new segment `" << path << "' from `" << spare_path
+              << "' with fd=" << _fd;
+    return 0;
+}
+
 inline bool verify_checksum(int checksum_type,
                             const char* data, size_t len, uint32_t value) {
     switch (checksum_type) {
@@ -168,16 +665,18 @@ inline uint32_t get_checksum(int checksum_type, const butil::IOBuf& data) {
     }
 }
 
-int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
-                         size_t size_hint) const {
-    butil::IOPortal buf;
-    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
-    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
-    if (n != (ssize_t)to_read) {
-        return n < 0 ? -1 : 1;
-    }
+int Segment::_parse_header(off_t offset, const butil::IOBuf& buf, 
+                           EntryHeader* head) const {
     char header_buf[ENTRY_HEADER_SIZE];
     const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    if (p == NULL) {
+        return 1;
+    }
+    if (is_zero(p, ENTRY_HEADER_SIZE)) {
+        // Reached the zero-filled tail of a preallocated segment, which is
+        // never a valid header as the term of any entry is positive
+        return 1;
+    }
     int64_t term = 0;
     uint32_t meta_field;
     uint32_t data_len = 0;
@@ -192,6 +691,7 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
     tmp.term = term;
     tmp.type = meta_field >> 24;
     tmp.checksum_type = (meta_field << 8) >> 24;
+    tmp.flags = meta_field & 0xFFFF;
     tmp.data_len = data_len;
     tmp.data_checksum = data_checksum;
     if (!verify_checksum(tmp.checksum_type, 
@@ -200,13 +700,58 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
                    << ", header=" << tmp << ", path: " << _path;
         return -1;
     }
+    *head = tmp;
+    return 0;
+}
+
+int Segment::_parse_data(off_t offset, const EntryHeader& head, 
+                         butil::IOBuf* buf, butil::IOBuf* data) const {
+    if (!verify_checksum(head.checksum_type, *buf, head.data_checksum)) {
+        LOG(ERROR) << "Found corrupted data at offset=" 
+                   << offset + ENTRY_HEADER_SIZE
+                   << " header=" << head
+                   << " path: " << _path;
+        // TODO: abort()?
+        return -1;
+    }
+    const int compress_type = 
+            (head.flags >> ENTRY_COMPRESS_SHIFT) & ENTRY_COMPRESS_MASK;
+    if (compress_type != SEGMENT_COMPRESS_NONE) {
+        butil::IOBuf plain;
+        if (!decompress_data(compress_type, *buf, &plain)) {
+            LOG(ERROR) << "Fail to decompress data at offset=" 
+                       << offset + ENTRY_HEADER_SIZE
+                       << " header=" << head
+                       << " path: " << _path;
+            return -1;
+        }
+        buf->swap(plain);
+    }
+    data->swap(*buf);
+    return 0;
+}
+
+int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
+                         size_t size_hint) const {
+    butil::IOPortal buf;
+    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
+    const ssize_t n = _pread(&buf, offset, to_read);
+    if (n != (ssize_t)to_read) {
+        return n < 0 ? -1 : 1;
+    }
+    EntryHeader tmp;
+    const int rc = _parse_header(offset, buf, &tmp);
+    if (rc != 0) {
+        return rc;
+    }
     if (head != NULL) {
         *head = tmp;
     }
     if (data != NULL) {
+        const uint32_t data_len = tmp.data_len;
         if (buf.length() < ENTRY_HEADER_SIZE + data_len) {
             const size_t to_read = ENTRY_HEADER_SIZE + data_len - buf.length();
-            const ssize_t n = file_pread(&buf, _fd, offset + buf.length(), to_read);
+            const ssize_t n = _pread(&buf, offset + buf.length(), to_read);
             if (n != (ssize_t)to_read) {
                 return n < 0 ? -1 : 1;
             }
@@ -215,19 +760,123 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
         }
         CHECK_EQ(buf.length(), ENTRY_HEADER_SIZE + data_len);
         buf.pop_front(ENTRY_HEADER_SIZE);
-        if (!verify_checksum(tmp.checksum_type, buf, tmp.data_checksum)) {
-            LOG(ERROR) << "Found corrupted data at offset=" 
-                       << offset + ENTRY_HEADER_SIZE
-                       << " header=" << tmp
-                       << " path: " << _path;
-            // TODO: abort()?
+        return _parse_data(offset, tmp, &buf, data);
+    }
+    return 0;
+}
+
+void Segment::set_direct_io(DirectReadCache* read_cache) {
+    _direct_io = true;
+    _read_cache = read_cache;
+    _cache_id = s_next_cache_id.fetch_add(1, butil::memory_order_relaxed);
+}
+
+int Segment::_open_flags() const {
+#if defined(O_DIRECT)
+    if (_direct_io) {
+        return O_RDWR | O_DIRECT;
+    }
+#endif
+    return O_RDWR;
+}
+
+ssize_t Segment::_pread(butil::IOPortal* buf, off_t offset, size_t size) const {
+    if (!_direct_io) {
+        scoped_refptr<SegmentMapping> mapping;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            mapping = _mapping;
+        }
+        if (mapping) {
+            return mapping->read(offset, size, buf);
+        }
+        return file_pread(buf, _fd, offset, size);
+    }
+    // The bytes after _tail_offset of the open segment are read from memory as
+    // they might not be written yet
+    butil::IOBuf tail;
+    int64_t disk_end = std::numeric_limits<int64_t>::max();
+    uint64_t cache_id = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        cache_id = _cache_id;
+        if (_tail_buf != NULL) {
+            disk_end = _tail_offset;
+            const int64_t begin = std::max<int64_t>(offset, _tail_offset);
+            const int64_t end = std::min<int64_t>(offset + size, 
+                    std::min<int64_t>(_bytes, _tail_offset + _tail_cap));
+            if (end > begin) {
+                tail.append(_tail_buf + (begin - _tail_offset), end - begin);
+            }
+        }
+    }
+    ssize_t nread = 0;
+    if (offset < disk_end) {
+        const size_t disk_size = std::min<int64_t>(size, disk_end - offset);
+        nread = _read_cache->read(cache_id, _fd, offset, disk_size, 
+                                  disk_end, buf);
+        if (nread != (ssize_t)disk_size) {
+            return nread;
+        }
+    }
+    buf->append(tail);
+    return nread + tail.length();
+}
+
+int Segment::_reserve_tail(size_t size) {
+    if (size <= _tail_cap) {
+        return 0;
+    }
+    const size_t cap = std::max<size_t>(_tail_cap * 2, align_up(size));
+    char* buf = alloc_aligned(cap);
+    if (buf == NULL) {
+        LOG(ERROR) << "Fail to allocate " << cap << " bytes, path: " << _path;
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    memcpy(buf, _tail_buf, _bytes - _tail_offset);
+    free(_tail_buf);
+    _tail_buf = buf;
+    _tail_cap = cap;
+    return 0;
+}
+
+int Segment::_reset_tail(int64_t size) {
+    // The last partial block is kept in memory and rewritten together with the
+    // following entries, as O_DIRECT only writes whole blocks
+    const int64_t tail_offset = align_down(size);
+    const size_t cap = std::max<size_t>(_tail_cap, DIRECT_IO_ALIGNMENT);
+    char* buf = alloc_aligned(cap);
+    if (buf == NULL) {
+        LOG(ERROR) << "Fail to allocate " << cap << " bytes, path: " << _path;
+        return -1;
+    }
+    if (size > tail_offset) {
+        const ssize_t n = direct_pread(_fd, buf, DIRECT_IO_ALIGNMENT, tail_offset);
+        if (n < size - tail_offset) {
+            PLOG(ERROR) << "Fail to read the last block of " << _path 
+                        << " at offset=" << tail_offset;
+            free(buf);
             return -1;
         }
-        data->swap(buf);
     }
+    BAIDU_SCOPED_LOCK(_mutex);
+    free(_tail_buf);
+    _tail_buf = buf;
+    _tail_cap = cap;
+    _tail_offset = tail_offset;
+    _flushed_bytes = size;
     return 0;
 }
 
+void Segment::_release_tail() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    free(_tail_buf);
+    _tail_buf = NULL;
+    _tail_cap = 0;
+    _tail_offset = 0;
+}
+
 int Segment::_get_meta(int64_t index, LogMeta* meta) const {
     BAIDU_SCOPED_LOCK(_mutex);
     if (index > _last_index.load(butil::memory_order_relaxed) 
@@ -242,17 +891,290 @@ int Segment::_get_meta(int64_t index, LogMeta* meta) const {
         // empty
         return -1;
     }
-    int64_t meta_index = index - _first_index;
-    int64_t entry_cursor = _offset_and_term[meta_index].first;
-    int64_t next_cursor = (index < _last_index.load(butil::memory_order_relaxed))
-                          ? _offset_and_term[meta_index + 1].first : _bytes;
-    DCHECK_LT(entry_cursor, next_cursor);
-    meta->offset = entry_cursor;
-    meta->term = _offset_and_term[meta_index].second;
-    meta->length = next_cursor - entry_cursor;
+    int64_t meta_index = index - _first_index;
+    int64_t entry_cursor = 0;
+    int64_t length = 0;
+    locate_entry(_offset_and_term, meta_index, _bytes, 
+                 &entry_cursor, &length, &meta->slot);
+    DCHECK_LT(0, length);
+    meta->offset = entry_cursor;
+    meta->term = _offset_and_term[meta_index].second;
+    meta->length = length;
+    return 0;
+}
+
+int Segment::_load_slot(off_t offset, int slot, EntryHeader* head, 
+                        butil::IOBuf* data, size_t size_hint) const {
+    EntryHeader header;
+    butil::IOBuf frame;
+    bool cached = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_frame_cache_offset == offset) {
+            memset(&header, 0, sizeof(header));
+            header.term = _frame_cache_term;
+            header.flags = ENTRY_FLAG_BATCH_FRAME;
+            frame = _frame_cache;
+            cached = true;
+        }
+    }
+    if (!cached) {
+        const int rc = _load_entry(offset, &header, &frame, size_hint);
+        if (rc != 0) {
+            return rc;
+        }
+        if (!(header.flags & ENTRY_FLAG_BATCH_FRAME)) {
+            if (slot != 0) {
+                LOG(ERROR) << "Found no batch frame at offset=" << offset
+                           << " for slot=" << slot << ", path: " << _path;
+                return -1;
+            }
+            *head = header;
+            data->swap(frame);
+            return 0;
+        }
+        // Followers read the entries of a frame one by one
+        BAIDU_SCOPED_LOCK(_mutex);
+        _frame_cache_offset = offset;
+        _frame_cache_term = header.term;
+        _frame_cache = frame;
+    }
+    std::vector<FrameSlot> slots;
+    if (parse_frame(frame, &slots) != 0 || slot >= (int)slots.size()) {
+        LOG(ERROR) << "Found corrupted batch frame at offset=" << offset
+                   << " for slot=" << slot << ", path: " << _path;
+        return -1;
+    }
+    *head = header;
+    head->type = slots[slot].type;
+    head->data_len = slots[slot].length;
+    data->clear();
+    frame.append_to(data, slots[slot].length, slots[slot].offset);
+    return 0;
+}
+
+bool Segment::_is_torn_entry(off_t offset, size_t length) const {
+    // Sectors of a partially persisted entry are still zero in a preallocated
+    // segment, while a corrupted one hardly has a whole zero sector
+    butil::IOPortal buf;
+    if (_pread(&buf, offset, length) != (ssize_t)length) {
+        return false;
+    }
+    char sector[TORN_SECTOR_SIZE];
+    const off_t end = offset + length;
+    while (offset < end) {
+        const off_t sector_end = std::min(end,
+                (offset / TORN_SECTOR_SIZE + 1) * TORN_SECTOR_SIZE);
+        const size_t n = sector_end - offset;
+        buf.cutn(sector, n);
+        if (is_zero(sector, n)) {
+            return true;
+        }
+        offset = sector_end;
+    }
+    return false;
+}
+
+int Segment::_drop_torn_entries(ConfigurationManager* configuration_manager,
+                                int64_t* last_index, int64_t* entry_off) {
+    for (size_t i = 0; i < _offset_and_term.size(); ++i) {
+        if (i > 0 && _offset_and_term[i].first == _offset_and_term[i - 1].first) {
+            // In the batch frame checked already
+            continue;
+        }
+        int64_t offset = 0;
+        int64_t length = 0;
+        int slot = 0;
+        locate_entry(_offset_and_term, i, *entry_off, &offset, &length, &slot);
+        butil::IOBuf data;
+        if (_load_entry(offset, NULL, &data, length) == 0) {
+            continue;
+        }
+        if (!_is_torn_entry(offset, length)) {
+            LOG(ERROR) << "Found corrupted entry at offset=" << offset
+                       << " in open segment, path: " << _path;
+            return -1;
+        }
+        LOG(WARNING) << "Found torn entry at offset=" << offset
+                     << " index=" << _first_index + (int64_t)i 
+                     << ", drop it and the following entries, path: " << _path;
+        _offset_and_term.resize(i);
+        *last_index = _first_index + (int64_t)i - 1;
+        while (!_configuration_indexes.empty() 
+                && _configuration_indexes.back() > *last_index) {
+            _configuration_indexes.pop_back();
+        }
+        *entry_off = offset;
+        configuration_manager->truncate_suffix(*last_index);
+        return 0;
+    }
+    return 0;
+}
+
+static void segment_index_data(const SegmentIndexPBMeta& index, butil::IOBuf* buf) {
+    const int64_t fields[3] = { index.first_index(), index.last_index(), 
+                                index.bytes() };
+    buf->append(fields, sizeof(fields));
+    buf->append(index.offset_deltas().data(), 
+                index.offset_deltas_size() * sizeof(int64_t));
+    buf->append(index.terms().data(), index.terms_size() * sizeof(int64_t));
+    buf->append(index.term_counts().data(), 
+                index.term_counts_size() * sizeof(int64_t));
+    buf->append(index.configuration_indexes().data(), 
+                index.configuration_indexes_size() * sizeof(int64_t));
+}
+
+std::string Segment::_index_path() const {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_INDEX_PATTERN,
+                         _first_index, _last_index.load());
+    return path;
+}
+
+int Segment::_save_index() {
+    SegmentIndexPBMeta index;
+    index.set_first_index(_first_index);
+    index.set_last_index(_last_index.load(butil::memory_order_relaxed));
+    index.set_checksum_type(_checksum_type);
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        index.set_bytes(_bytes);
+        int64_t prev_offset = 0;
+        for (size_t i = 0; i < _offset_and_term.size(); ++i) {
+            index.add_offset_deltas(_offset_and_term[i].first - prev_offset);
+            prev_offset = _offset_and_term[i].first;
+            const int64_t term = _offset_and_term[i].second;
+            const int nruns = index.terms_size();
+            if (nruns > 0 && index.terms(nruns - 1) == term) {
+                index.set_term_counts(nruns - 1, index.term_counts(nruns - 1) + 1);
+            } else {
+                index.add_terms(term);
+                index.add_term_counts(1);
+            }
+        }
+        for (size_t i = 0; i < _configuration_indexes.size(); ++i) {
+            index.add_configuration_indexes(_configuration_indexes[i]);
+        }
+    }
+    butil::IOBuf data;
+    segment_index_data(index, &data);
+    index.set_checksum(get_checksum(_checksum_type, data));
+
+    const std::string path = _index_path();
+    ProtoBufFile pb_file(path);
+    // Not synced as a broken index is detected by checksum and ignored
+    const int ret = pb_file.save(&index, false);
+    LOG_IF(WARNING, ret != 0) << "Fail to save index " << path;
+    return ret;
+}
+
+int Segment::_load_index(ConfigurationManager* configuration_manager,
+                         int64_t file_size) {
+    const std::string path = _index_path();
+    if (!butil::PathExists(butil::FilePath(path))) {
+        return -1;
+    }
+    SegmentIndexPBMeta index;
+    ProtoBufFile pb_file(path);
+    if (pb_file.load(&index) != 0) {
+        LOG(WARNING) << "Fail to load index " << path;
+        return -1;
+    }
+    const int64_t last_index = _last_index.load(butil::memory_order_relaxed);
+    const int64_t count = last_index - _first_index + 1;
+    butil::IOBuf data;
+    segment_index_data(index, &data);
+    if (!index.IsInitialized() 
+            || index.first_index() != _first_index
+            || index.last_index() != last_index
+            || index.bytes() != file_size
+            || index.offset_deltas_size() != count
+            || index.terms_size() != index.term_counts_size()
+            || !verify_checksum(index.checksum_type(), data, index.checksum())) {
+        LOG(WARNING) << "Found invalid index " << path 
+                     << ", scan the segment instead";
+        return -1;
+    }
+
+    std::vector<std::pair<int64_t, int64_t> > offset_and_term;
+    offset_and_term.reserve(count);
+    int64_t offset = 0;
+    int run = -1;
+    int64_t left_in_run = 0;
+    for (int64_t i = 0; i < count; ++i) {
+        offset += index.offset_deltas(i);
+        if (left_in_run == 0) {
+            if (++run >= index.terms_size() || index.term_counts(run) <= 0) {
+                break;
+            }
+            left_in_run = index.term_counts(run);
+        }
+        --left_in_run;
+        // Entries in a batch frame share the same offset
+        if (offset >= file_size || (i == 0 && offset != 0) || (i > 0 
+                && offset != offset_and_term.back().first
+                && offset < offset_and_term.back().first + (int64_t)ENTRY_HEADER_SIZE)) {
+            break;
+        }
+        offset_and_term.push_back(std::make_pair(offset, index.terms(run)));
+    }
+    if ((int64_t)offset_and_term.size() != count || left_in_run != 0
+            || run + 1 != index.terms_size()) {
+        LOG(WARNING) << "Found inconsistent index " << path
+                     << ", scan the segment instead";
+        return -1;
+    }
+
+    std::vector<ConfigurationEntry> conf_entries;
+    for (int i = 0; i < index.configuration_indexes_size(); ++i) {
+        const int64_t conf_index = index.configuration_indexes(i);
+        if (conf_index < _first_index || conf_index > last_index) {
+            LOG(WARNING) << "Found invalid configuration index=" << conf_index
+                         << " in " << path << ", scan the segment instead";
+            return -1;
+        }
+        int64_t entry_off = 0;
+        int64_t length = 0;
+        int slot = 0;
+        locate_entry(offset_and_term, conf_index - _first_index, file_size,
+                     &entry_off, &length, &slot);
+        EntryHeader header;
+        butil::IOBuf conf_data;
+        if (_load_slot(entry_off, slot, &header, &conf_data, length) != 0
+                || header.type != ENTRY_TYPE_CONFIGURATION) {
+            LOG(WARNING) << "Fail to load configuration at index=" << conf_index
+                         << " in " << path << ", scan the segment instead";
+            return -1;
+        }
+        scoped_refptr<LogEntry> entry = new LogEntry();
+        entry->id.index = conf_index;
+        entry->id.term = header.term;
+        butil::Status status = parse_configuration_meta(conf_data, entry);
+        if (!status.ok()) {
+            LOG(WARNING) << "Fail to parse configuration meta at index=" 
+                         << conf_index << " in " << path 
+                         << ", scan the segment instead";
+            return -1;
+        }
+        conf_entries.push_back(ConfigurationEntry(*entry));
+    }
+
+    for (size_t i = 0; i < conf_entries.size(); ++i) {
+        configuration_manager->add(conf_entries[i]);
+    }
+    _offset_and_term.swap(offset_and_term);
+    _configuration_indexes.assign(index.configuration_indexes().begin(),
+                                  index.configuration_indexes().end());
     return 0;
 }
 
+void Segment::_unlink_index() {
+    const std::string path = _index_path();
+    if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Fail to unlink " << path;
+    }
+}
+
 int Segment::load(ConfigurationManager* configuration_manager) {
     int ret = 0;
 
@@ -264,7 +1186,7 @@ int Segment::load(ConfigurationManager* configuration_manager) {
         butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN, 
                              _first_index, _last_index.load());
     }
-    _fd = ::open(path.c_str(), O_RDWR);
+    _fd = ::open(path.c_str(), _open_flags());
     if (_fd < 0) {
         LOG(ERROR) << "Fail to open " << path << ", " << berror();
         return -1;
@@ -282,6 +1204,13 @@ int Segment::load(ConfigurationManager* configuration_manager) {
 
     // load entry index
     int64_t file_size = st_buf.st_size;
+    if (!_is_open && FLAGS_raft_segment_index 
+            && _load_index(configuration_manager, file_size) == 0) {
+        BRAFT_VLOG << "Loaded segment " << path << " from index";
+        _bytes = file_size;
+        _map();
+        return 0;
+    }
     int64_t entry_off = 0;
     int64_t actual_last_index = _first_index - 1;
     for (int64_t i = _first_index; entry_off < file_size; i++) {
@@ -302,6 +1231,50 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             // truncated
             break;
         }
+        if (header.flags & ENTRY_FLAG_BATCH_FRAME) {
+            butil::IOBuf frame;
+            if (_load_entry(entry_off, NULL, &frame, skip_len) != 0) {
+                break;
+            }
+            std::vector<FrameSlot> slots;
+            if (parse_frame(frame, &slots) != 0) {
+                LOG(ERROR) << "Found corrupted batch frame, path: " << _path
+                           << " entry_off " << entry_off;
+                ret = -1;
+                break;
+            }
+            for (size_t k = 0; k < slots.size() && ret == 0; ++k) {
+                if (slots[k].type != ENTRY_TYPE_CONFIGURATION) {
+                    continue;
+                }
+                butil::IOBuf data;
+                frame.append_to(&data, slots[k].length, slots[k].offset);
+                scoped_refptr<LogEntry> entry = new LogEntry();
+                entry->id.index = i + k;
+                entry->id.term = header.term;
+                butil::Status status = parse_configuration_meta(data, entry);
+                if (status.ok()) {
+                    ConfigurationEntry conf_entry(*entry);
+                    configuration_manager->add(conf_entry); 
+                    _configuration_indexes.push_back(i + k);
+                } else {
+                    LOG(ERROR) << "fail to parse configuration meta, path: " 
+                               << _path << " entry_off " << entry_off;
+                    ret = -1;
+                }
+            }
+            if (ret != 0) {
+                break;
+            }
+            // Entries of the frame share its offset
+            for (size_t k = 0; k < slots.size(); ++k) {
+                _offset_and_term.push_back(std::make_pair(entry_off, header.term));
+            }
+            actual_last_index += slots.size();
+            i += slots.size() - 1;
+            entry_off += skip_len;
+            continue;
+        }
         if (header.type == ENTRY_TYPE_CONFIGURATION) {
             butil::IOBuf data;
             // Header will be parsed again but it's fine as configuration
@@ -316,6 +1289,7 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             if (status.ok()) {
                 ConfigurationEntry conf_entry(*entry);
                 configuration_manager->add(conf_entry); 
+                _configuration_indexes.push_back(i);
             } else {
                 LOG(ERROR) << "fail to parse configuration meta, path: " << _path
                     << " entry_off " << entry_off;
@@ -328,6 +1302,16 @@ int Segment::load(ConfigurationManager* configuration_manager) {
         entry_off += skip_len;
     }
 
+    if (ret == 0 && _is_open && entry_off != file_size) {
+        // The unsynced tail was not completely written before crash, entries
+        // in the middle of it may be torn as well if the file was
+        // preallocated or padded, which can't be told by the file size.
+        // Whether it was is not told by the current flags either, which may
+        // have changed since the file was written
+        ret = _drop_torn_entries(configuration_manager, 
+                                 &actual_last_index, &entry_off);
+    }
+
     const int64_t last_index = _last_index.load(butil::memory_order_relaxed);
     if (ret == 0 && !_is_open) {
         if (actual_last_index < last_index) {
@@ -363,57 +1347,191 @@ int Segment::load(ConfigurationManager* configuration_manager) {
     ::lseek(_fd, entry_off, SEEK_SET);
 
     _bytes = entry_off;
+    if (ret == 0 && _is_open && _direct_io) {
+        // Chunks read by the scan may cover the truncated tail
+        _cache_id = s_next_cache_id.fetch_add(1, butil::memory_order_relaxed);
+        ret = _reset_tail(entry_off);
+    }
+    if (ret == 0 && !_is_open && FLAGS_raft_segment_index) {
+        // Segments closed by former versions have no index
+        _save_index();
+    }
+    if (ret == 0 && !_is_open) {
+        _map();
+    }
     return ret;
 }
 
-int Segment::append(const LogEntry* entry) {
-
-    if (BAIDU_UNLIKELY(!entry || !_is_open)) {
-        return EINVAL;
-    } else if (entry->id.index != 
-                    _last_index.load(butil::memory_order_consume) + 1) {
-        CHECK(false) << "entry->index=" << entry->id.index
-                  << " _last_index=" << _last_index
-                  << " _first_index=" << _first_index;
-        return ERANGE;
-    }
-
-    butil::IOBuf data;
+static int serialize_entry(const LogEntry* entry, butil::IOBuf* data) {
     switch (entry->type) {
     case ENTRY_TYPE_DATA:
-        data.append(entry->data);
+        data->append(entry->data);
         break;
     case ENTRY_TYPE_NO_OP:
         break;
     case ENTRY_TYPE_CONFIGURATION: 
         {
-            butil::Status status = serialize_configuration_meta(entry, data);
+            butil::Status status = serialize_configuration_meta(entry, *data);
             if (!status.ok()) {
-                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, path: " 
-                           << _path;
+                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, index: "
+                           << entry->id.index;
                 return -1; 
             }
         }
         break;
     default:
         LOG(FATAL) << "unknow entry type: " << entry->type
-                   << ", path: " << _path;
+                   << ", index: " << entry->id.index;
         return -1;
     }
-    CHECK_LE(data.length(), 1ul << 56ul);
+    return 0;
+}
+
+// Compress |data| in place when it gets smaller, returns the flags to be set
+// in the header
+static uint32_t compress_record(int compress_type, butil::IOBuf* data) {
+    if (compress_type == SEGMENT_COMPRESS_NONE 
+            || data->length() < MIN_COMPRESS_SIZE) {
+        return 0;
+    }
+    butil::IOBuf compressed;
+    if (!compress_data(compress_type, *data, &compressed)) {
+        LOG(WARNING) << "Fail to compress data with compress_type=" 
+                     << compress_type;
+        return 0;
+    }
+    if (compressed.length() >= data->length()) {
+        return 0;
+    }
+    data->swap(compressed);
+    return (uint32_t)compress_type << ENTRY_COMPRESS_SHIFT;
+}
+
+SegmentRecord::~SegmentRecord() {
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        _entries[i]->Release();
+    }
+}
+
+int SegmentRecord::encode(const LogEntry* const entries[], size_t size,
+                          int checksum_type, int compress_type) {
+    CHECK(_entries.empty());
+    CHECK_GT(size, 0u);
+    uint32_t meta_field = 0;
+    if (size == 1) {
+        if (serialize_entry(entries[0], &_body) != 0) {
+            return -1;
+        }
+        CHECK_LE(_body.length(), 1ul << 56ul);
+        meta_field = (entries[0]->type << 24) | (checksum_type << 16)
+                     | compress_record(compress_type, &_body);
+    } else {
+        butil::IOBuf payload;
+        char count_buf[4];
+        RawPacker(count_buf).pack32(size);
+        _body.append(count_buf, sizeof(count_buf));
+        for (size_t i = 0; i < size; ++i) {
+            CHECK_EQ(entries[0]->id.term, entries[i]->id.term);
+            CHECK_EQ(entries[0]->id.index + (int64_t)i, entries[i]->id.index);
+            butil::IOBuf data;
+            if (serialize_entry(entries[i], &data) != 0) {
+                _body.clear();
+                return -1;
+            }
+            CHECK_LT(data.length(), MAX_FRAME_SLOT_SIZE);
+            char slot_buf[FRAME_SLOT_SIZE];
+            RawPacker(slot_buf).pack32((entries[i]->type << 24) | data.length());
+            _body.append(slot_buf, sizeof(slot_buf));
+            payload.append(data);
+        }
+        _body.append(payload);
+        meta_field = (ENTRY_TYPE_UNKNOWN << 24) | (checksum_type << 16)
+                     | ENTRY_FLAG_BATCH_FRAME
+                     | compress_record(compress_type, &_body);
+        CHECK_LE(_body.length(), 0xFFFFFFFFul);
+    }
     char header_buf[ENTRY_HEADER_SIZE];
-    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16);
     RawPacker packer(header_buf);
-    packer.pack64(entry->id.term)
+    packer.pack64(entries[0]->id.term)
           .pack32(meta_field)
-          .pack32((uint32_t)data.length())
-          .pack32(get_checksum(_checksum_type, data));
+          .pack32((uint32_t)_body.length())
+          .pack32(get_checksum(checksum_type, _body));
     packer.pack32(get_checksum(
-                  _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-    butil::IOBuf header;
-    header.append(header_buf, ENTRY_HEADER_SIZE);
-    const size_t to_write = header.length() + data.length();
-    butil::IOBuf* pieces[2] = { &header, &data };
+                  checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
+    _header.append(header_buf, ENTRY_HEADER_SIZE);
+    _entries.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        entries[i]->AddRef();
+        _entries.push_back(entries[i]);
+    }
+    return 0;
+}
+
+void Segment::_map() {
+    if (!FLAGS_raft_segment_mmap || _direct_io) {
+        return;
+    }
+    SegmentMapping* mapping = SegmentMapping::create(_fd, _bytes);
+    if (mapping == NULL) {
+        // Read with pread instead
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    _mapping = mapping;
+    _mapped = true;
+}
+
+int Segment::_rewrite(const std::string& path, const butil::IOBuf& data) {
+    std::string tmp_path(path);
+    tmp_path.append(".tmp");
+    // Opened with the flags of _fd, which is replaced by it
+    int fd = ::open(tmp_path.c_str(), _open_flags() | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << tmp_path;
+        return -1;
+    }
+    const ssize_t written = _direct_io ? direct_pwrite_iobuf(fd, data)
+                                       : file_pwrite(data, fd, 0);
+    if (written != (ssize_t)data.size() || raft_fsync(fd) != 0 
+            || ::rename(tmp_path.c_str(), path.c_str()) != 0
+            || (FLAGS_raft_sync && sync_dir(_path) != 0)) {
+        PLOG_IF(ERROR, written == (ssize_t)data.size()) 
+                << "Fail to replace " << path << " with " << tmp_path;
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    // Appended at the end of the file by _write
+    if (::lseek(fd, data.size(), SEEK_SET) < 0) {
+        PLOG(ERROR) << "Fail to lseek " << tmp_path;
+        ::close(fd);
+        return -1;
+    }
+    // Replaced atomically as readers may be using _fd
+    if (dup2(fd, _fd) < 0) {
+        PLOG(ERROR) << "Fail to dup2 " << fd << " to " << _fd;
+        ::close(fd);
+        return -1;
+    }
+    ::close(fd);
+    butil::make_close_on_exec(_fd);
+    LOG(INFO) << "Rewrote " << path << " with size=" << data.size();
+    return 0;
+}
+
+int Segment::_write(butil::IOBuf* header, butil::IOBuf* data) {
+    const size_t to_write = header->length() + data->length();
+    if (_direct_io) {
+        // Staged until flush()
+        const size_t pos = _bytes - _tail_offset;
+        if (_reserve_tail(pos + to_write) != 0) {
+            return -1;
+        }
+        header->copy_to(_tail_buf + pos);
+        data->copy_to(_tail_buf + pos + header->length());
+        return 0;
+    }
+    butil::IOBuf* pieces[2] = { header, data };
     size_t start = 0;
     ssize_t written = 0;
     while (written < (ssize_t)to_write) {
@@ -427,15 +1545,91 @@ int Segment::append(const LogEntry* entry) {
         written += n;
         for (;start < ARRAY_SIZE(pieces) && pieces[start]->empty(); ++start) {}
     }
+    return 0;
+}
+
+int Segment::append(const LogEntry* entry) {
+    if (BAIDU_UNLIKELY(!entry)) {
+        return EINVAL;
+    }
+    return append(&entry, 1);
+}
+
+int Segment::append(const LogEntry* const entries[], size_t size) {
+    if (BAIDU_UNLIKELY(size == 0 || !_is_open)) {
+        return EINVAL;
+    }
+    SegmentRecord record;
+    if (record.encode(entries, size, _checksum_type, _compress_type) != 0) {
+        return -1;
+    }
+    return append(record);
+}
+
+int Segment::append(const SegmentRecord& record) {
+    const std::vector<const LogEntry*>& entries = record.entries();
+    if (BAIDU_UNLIKELY(entries.empty() || !_is_open)) {
+        return EINVAL;
+    } else if (entries[0]->id.index != 
+                    _last_index.load(butil::memory_order_consume) + 1) {
+        CHECK(false) << "entry->index=" << entries[0]->id.index
+                  << " _last_index=" << _last_index
+                  << " _first_index=" << _first_index;
+        return ERANGE;
+    }
+    // Copy the IOBufs (by reference) as they are consumed by _write
+    butil::IOBuf header(record.header());
+    butil::IOBuf body(record.body());
+    const size_t to_write = header.length() + body.length();
+    if (_write(&header, &body) != 0) {
+        return -1;
+    }
     BAIDU_SCOPED_LOCK(_mutex);
-    _offset_and_term.push_back(std::make_pair(_bytes, entry->id.term));
-    _last_index.fetch_add(1, butil::memory_order_relaxed);
+    // All the entries of a batch frame share its offset
+    for (size_t i = 0; i < entries.size(); ++i) {
+        _offset_and_term.push_back(std::make_pair(_bytes, entries[i]->id.term));
+        if (entries[i]->type == ENTRY_TYPE_CONFIGURATION) {
+            _configuration_indexes.push_back(entries[i]->id.index);
+        }
+    }
+    _last_index.fetch_add(entries.size(), butil::memory_order_relaxed);
     _bytes += to_write;
     _unsynced_bytes += to_write;
 
     return 0;
 }
 
+int Segment::flush() {
+    if (!_direct_io || _bytes == _flushed_bytes) {
+        return 0;
+    }
+    // Pad the last partial block with zeros, which is rewritten with the
+    // following entries by the next flush. Sectors of the bytes written before
+    // are unchanged, so a torn rewrite doesn't break them
+    const int64_t bytes = _bytes;
+    const size_t used = bytes - _tail_offset;
+    const size_t len = align_up(used);
+    memset(_tail_buf + used, 0, len - used);
+    if (direct_pwrite(_fd, _tail_buf, len, _tail_offset) != 0) {
+        PLOG(ERROR) << "Fail to write to fd=" << _fd << ", path: " << _path;
+        return -1;
+    }
+    _flushed_bytes = bytes;
+    if (len > used) {
+        // Zero-filled after _bytes as a preallocated file, which is
+        // dropped by close()
+        _preallocated = true;
+    }
+    const int64_t tail_offset = align_down(bytes);
+    if (tail_offset > _tail_offset) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        memmove(_tail_buf, _tail_buf + (tail_offset - _tail_offset), 
+                bytes - tail_offset);
+        _tail_offset = tail_offset;
+    }
+    return 0;
+}
+
 int Segment::sync(bool will_sync) {
     if (_last_index < _first_index) {
         return 0;
@@ -445,16 +1639,53 @@ int Segment::sync(bool will_sync) {
         if (!FLAGS_raft_sync) {
             return 0;
         }
-        if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
-            && FLAGS_raft_sync_per_bytes > _unsynced_bytes) {
-            return 0;
+        {
+            // Might be called out of the appending thread by
+            // SegmentLogStorage::sync_entries
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
+                && FLAGS_raft_sync_per_bytes > _unsynced_bytes) {
+                return 0;
+            }
+            _unsynced_bytes = 0;
         }
-        _unsynced_bytes = 0;
         return raft_fsync(_fd);
     }
     return 0;
 }
 
+LogEntry* Segment::_build_entry(int64_t index, const EntryHeader& header,
+                                butil::IOBuf* data) const {
+    LogEntry* entry = new LogEntry();
+    entry->AddRef();
+    switch (header.type) {
+    case ENTRY_TYPE_DATA:
+        entry->data.swap(*data);
+        break;
+    case ENTRY_TYPE_NO_OP:
+        CHECK(data->empty()) << "Data of NO_OP must be empty";
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        {
+            butil::Status status = parse_configuration_meta(*data, entry); 
+            if (!status.ok()) {
+                LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
+                             << _path;
+                entry->Release();
+                return NULL;
+            }
+        }
+        break;
+    default:
+        CHECK(false) << "Unknown entry type, path: " << _path;
+        break;
+    }
+    entry->id.index = index;
+    entry->id.term = header.term;
+    entry->type = (EntryType)header.type;
+    return entry;
+}
+
 LogEntry* Segment::get(const int64_t index) const {
 
     LogMeta meta;
@@ -462,56 +1693,117 @@ LogEntry* Segment::get(const int64_t index) const {
         return NULL;
     }
 
-    bool ok = true;
-    LogEntry* entry = NULL;
-    do {
-        ConfigurationPBMeta configuration_meta;
+    EntryHeader header;
+    butil::IOBuf data;
+    if (_load_slot(meta.offset, meta.slot, &header, &data, 
+                   meta.length) != 0) {
+        return NULL;
+    }
+    CHECK_EQ(meta.term, header.term);
+    return _build_entry(index, header, &data);
+}
+
+int Segment::get_entries(int64_t first_index, int64_t last_index, 
+                         size_t max_bytes, std::vector<LogEntry*>* entries,
+                         size_t* bytes) const {
+    if (first_index < _first_index) {
+        return 0;
+    }
+    std::vector<LogMeta> metas;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        last_index = std::min(last_index, 
+                              _last_index.load(butil::memory_order_relaxed));
+        size_t read_bytes = 0;
+        for (int64_t index = first_index; index <= last_index; ++index) {
+            LogMeta meta;
+            int64_t offset = 0;
+            int64_t length = 0;
+            locate_entry(_offset_and_term, index - _first_index, _bytes,
+                         &offset, &length, &meta.slot);
+            if (metas.empty() || offset != metas.back().offset) {
+                // Entries of a batch frame are read together
+                if (!metas.empty() && read_bytes >= max_bytes) {
+                    break;
+                }
+                read_bytes += length;
+            }
+            meta.offset = offset;
+            meta.length = length;
+            meta.term = _offset_and_term[index - _first_index].second;
+            metas.push_back(meta);
+        }
+    }
+    if (metas.empty()) {
+        return 0;
+    }
+    // Read all of them at once
+    const off_t begin = metas.front().offset;
+    const size_t size = metas.back().offset + metas.back().length - begin;
+    butil::IOPortal buf;
+    if (_pread(&buf, begin, size) != (ssize_t)size) {
+        LOG(ERROR) << "Fail to read entries from " << first_index 
+                   << " to " << first_index + (int64_t)metas.size() - 1
+                   << ", path: " << _path;
+        return -1;
+    }
+    *bytes += size;
+    size_t i = 0;
+    while (i < metas.size()) {
+        const off_t offset = metas[i].offset;
+        butil::IOBuf piece;
+        buf.cutn(&piece, metas[i].length);
         EntryHeader header;
         butil::IOBuf data;
-        if (_load_entry(meta.offset, &header, &data, 
-                        meta.length) != 0) {
-            ok = false;
+        if (_parse_header(offset, piece, &header) != 0) {
             break;
         }
-        CHECK_EQ(meta.term, header.term);
-        entry = new LogEntry();
-        entry->AddRef();
-        switch (header.type) {
-        case ENTRY_TYPE_DATA:
-            entry->data.swap(data);
+        piece.pop_front(ENTRY_HEADER_SIZE);
+        if (piece.length() != header.data_len
+                || _parse_data(offset, header, &piece, &data) != 0) {
             break;
-        case ENTRY_TYPE_NO_OP:
-            CHECK(data.empty()) << "Data of NO_OP must be empty";
-            break;
-        case ENTRY_TYPE_CONFIGURATION:
-            {
-                butil::Status status = parse_configuration_meta(data, entry); 
-                if (!status.ok()) {
-                    LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
-                                 << _path;
-                    ok = false;
-                    break;
-                }
+        }
+        CHECK_EQ(metas[i].term, header.term);
+        if (!(header.flags & ENTRY_FLAG_BATCH_FRAME)) {
+            LogEntry* entry = _build_entry(first_index + i, header, &data);
+            if (entry == NULL) {
+                break;
             }
-            break;
-        default:
-            CHECK(false) << "Unknown entry type, path: " << _path;
+            entries->push_back(entry);
+            ++i;
+            continue;
+        }
+        std::vector<FrameSlot> slots;
+        if (parse_frame(data, &slots) != 0) {
+            LOG(ERROR) << "Found corrupted batch frame at offset=" << offset
+                       << ", path: " << _path;
             break;
         }
-
-        if (!ok) { 
+        for (; i < metas.size() && metas[i].offset == offset; ++i) {
+            if (metas[i].slot >= (int)slots.size()) {
+                LOG(ERROR) << "Found no slot=" << metas[i].slot 
+                           << " in batch frame at offset=" << offset
+                           << ", path: " << _path;
+                break;
+            }
+            const FrameSlot& slot = slots[metas[i].slot];
+            EntryHeader slot_header = header;
+            slot_header.type = slot.type;
+            slot_header.data_len = slot.length;
+            butil::IOBuf slot_data;
+            data.append_to(&slot_data, slot.length, slot.offset);
+            LogEntry* entry = _build_entry(first_index + i, slot_header, 
+                                           &slot_data);
+            if (entry == NULL) {
+                break;
+            }
+            entries->push_back(entry);
+        }
+        if (i < metas.size() && metas[i].offset == offset) {
             break;
         }
-        entry->id.index = index;
-        entry->id.term = header.term;
-        entry->type = (EntryType)header.type;
-    } while (0);
-
-    if (!ok && entry != NULL) {
-        entry->Release();
-        entry = NULL;
     }
-    return entry;
+    return i;
 }
 
 int64_t Segment::get_term(const int64_t index) const {
@@ -538,13 +1830,27 @@ int Segment::close(bool will_sync) {
               << " raft_sync_segments: " << FLAGS_raft_sync_segments 
               << " will_sync: " << will_sync 
               << " path: " << new_path;
-    int ret = 0;
-    if (_last_index > _first_index) {
+    int ret = flush();
+    if (ret == 0 && _preallocated) {
+        // Drop the zero-filled tail so that closed segments are laid out the
+        // same as the ones never preallocated
+        ret = ftruncate_uninterrupted(_fd, _bytes);
+        PLOG_IF(ERROR, ret != 0) << "Fail to truncate " << old_path 
+                                 << " to size=" << _bytes;
+        if (ret == 0) {
+            _preallocated = false;
+        }
+    }
+    if (ret == 0 && _last_index > _first_index) {
         if (FLAGS_raft_sync_segments && will_sync) {
             ret = raft_fsync(_fd);
         }
     }
     if (ret == 0) {
+        if (_direct_io) {
+            // All the bytes are on disk now
+            _release_tail();
+        }
         _is_open = false;
         const int rc = ::rename(old_path.c_str(), new_path.c_str());
         LOG_IF(INFO, rc == 0) << "Renamed `" << old_path
@@ -552,6 +1858,12 @@ int Segment::close(bool will_sync) {
         LOG_IF(ERROR, rc != 0) << "Fail to rename `" << old_path
                                << "' to `" << new_path <<"\', "
                                << berror();
+        if (rc == 0 && FLAGS_raft_segment_index) {
+            _save_index();
+        }
+        if (rc == 0) {
+            _map();
+        }
         return rc;
     }
     return ret;
@@ -565,17 +1877,72 @@ std::string Segment::file_name() {
     }
 }
 
-static void* run_unlink(void* arg) {
-    std::string* file_path = (std::string*) arg;
-    butil::Timer timer;
-    timer.start();
-    int ret = ::unlink(file_path->c_str());
-    timer.stop();
-    BRAFT_VLOG << "unlink " << *file_path << " ret " << ret << " time: " << timer.u_elapsed();
-    delete file_path;
+// Unlinks the discarded segment files one by one in background at a limited
+// rate, so that deleting lots of large files neither blocks the disk thread
+// nor floods the device. Segments are released there as well, which closes
+// their fds.
+class SegmentReclaimer {
+public:
+    struct Task {
+        scoped_refptr<Segment> segment;
+        std::string path;
+        int64_t bytes;
+    };
+
+    SegmentReclaimer() : _started(false) {
+        bthread::ExecutionQueueOptions options;
+        options.bthread_attr = BTHREAD_ATTR_NORMAL;
+        _started = (bthread::execution_queue_start(
+                            &_queue_id, &options, run, this) == 0);
+        LOG_IF(WARNING, !_started) << "Fail to start segment reclaimer, "
+                                      "unlink segments in place";
+    }
+
+    void reclaim(Task* task) {
+        g_reclaiming_segment_bytes << task->bytes;
+        if (!_started 
+                || bthread::execution_queue_execute(_queue_id, task) != 0) {
+            unlink_file(task);
+        }
+    }
 
-    return NULL;
-}
+private:
+    static void unlink_file(Task* task) {
+        butil::Timer timer;
+        timer.start();
+        const int ret = ::unlink(task->path.c_str());
+        PLOG_IF(WARNING, ret != 0 && errno != ENOENT) 
+                << "Fail to unlink " << task->path;
+        // Close the fd here if it's the last reference
+        task->segment = NULL;
+        timer.stop();
+        BRAFT_VLOG << "unlink " << task->path << " ret " << ret 
+                   << " time: " << timer.u_elapsed();
+        g_reclaiming_segment_bytes << -task->bytes;
+        delete task;
+    }
+
+    static int run(void* /*meta*/, bthread::TaskIterator<Task*>& iter) {
+        for (; iter; ++iter) {
+            const int64_t start_us = butil::monotonic_time_us();
+            const int64_t bytes = (*iter)->bytes;
+            unlink_file(*iter);
+            const int64_t rate = FLAGS_raft_segment_reclaim_mb_per_second;
+            if (rate > 0) {
+                const int64_t expected_us = 
+                        bytes * 1000000 / ((int64_t)rate * 1024 * 1024);
+                const int64_t elapsed_us = butil::monotonic_time_us() - start_us;
+                if (expected_us > elapsed_us) {
+                    bthread_usleep(expected_us - elapsed_us);
+                }
+            }
+        }
+        return 0;
+    }
+
+    bthread::ExecutionQueueId<Task*> _queue_id;
+    bool _started;
+};
 
 int Segment::unlink() {
     int ret = 0;
@@ -588,30 +1955,193 @@ int Segment::unlink() {
             butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
                                 _first_index, _last_index.load());
         }
-
-        std::string tmp_path(path);
-        tmp_path.append(".tmp");
-        ret = ::rename(path.c_str(), tmp_path.c_str());
-        if (ret != 0) {
-            PLOG(ERROR) << "Fail to rename " << path << " to " << tmp_path;
-            break;
+
+        if (!_is_open) {
+            _unlink_index();
+        }
+        std::string tmp_path(path);
+        tmp_path.append(".tmp");
+        ret = ::rename(path.c_str(), tmp_path.c_str());
+        if (ret != 0) {
+            PLOG(ERROR) << "Fail to rename " << path << " to " << tmp_path;
+            break;
+        }
+
+        // The file is logically deleted by the rename, unlink it in
+        // background
+        SegmentReclaimer::Task* task = new SegmentReclaimer::Task;
+        task->segment = this;
+        task->path = tmp_path;
+        task->bytes = _bytes;
+        butil::get_leaky_singleton<SegmentReclaimer>()->reclaim(task);
+
+        LOG(INFO) << "Unlinked segment `" << path << '\'';
+    } while (0);
+
+    return ret;
+}
+
+int Segment::recycle(const std::string& new_path) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_mapped) {
+            // The file is overwritten after being recycled, while IOBufs
+            // referencing the mapped pages may outlive the segment
+            LOG(INFO) << "Segment " << _path << " first_index: " << _first_index
+                      << " was mapped, unlink it instead of recycling";
+            return -1;
+        }
+    }
+    std::string path(_path);
+    if (_is_open) {
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
+                             _first_index);
+    } else {
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                             _first_index, _last_index.load());
+        _unlink_index();
+    }
+    const int ret = ::rename(path.c_str(), new_path.c_str());
+    LOG_IF(INFO, ret == 0) << "Recycled segment `" << path << "' to `" 
+                           << new_path << '\'';
+    PLOG_IF(ERROR, ret != 0) << "Fail to rename " << path << " to " << new_path;
+    return ret;
+}
+
+int Segment::truncate(const int64_t last_index_kept) {
+    int64_t frame_first_index = last_index_kept + 1;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (last_index_kept >= _last_index) {
+            return 0;
+        }
+        const int64_t meta_index = last_index_kept + 1 - _first_index;
+        const int64_t offset = _offset_and_term[meta_index].first;
+        if (meta_index > 0 && _offset_and_term[meta_index - 1].first == offset) {
+            frame_first_index = _first_index + (std::lower_bound(
+                    _offset_and_term.begin(), 
+                    _offset_and_term.begin() + meta_index,
+                    offset, OffsetLess()) - _offset_and_term.begin());
+        }
+    }
+    if (frame_first_index > last_index_kept) {
+        return _truncate(last_index_kept);
+    }
+    // Cutting in the middle of a batch frame. The kept entries of the frame
+    // are written as a new frame into a copy of the file which replaces the
+    // file then, so that a crash leaves either the whole old frame or the
+    // kept entries, but never drops the kept entries which might have been
+    // committed
+    LOG(INFO) << "Rewriting entries from " << frame_first_index << " to "
+              << last_index_kept << " of the truncated batch frame, path: " 
+              << _path;
+    std::vector<LogEntry*> kept;
+    int ret = 0;
+    for (int64_t index = frame_first_index; index <= last_index_kept; ++index) {
+        LogEntry* entry = get(index);
+        if (entry == NULL) {
+            LOG(ERROR) << "Fail to get entry at index=" << index 
+                       << ", path: " << _path;
+            ret = -1;
+            break;
+        }
+        kept.push_back(entry);
+    }
+    if (ret == 0) {
+        ret = _rewrite_frame(frame_first_index, kept);
+    }
+    for (size_t i = 0; i < kept.size(); ++i) {
+        kept[i]->Release();
+    }
+    return ret;
+}
+
+int Segment::_rewrite_frame(const int64_t frame_first_index,
+                            const std::vector<LogEntry*>& kept) {
+    const int64_t last_index_kept = frame_first_index + kept.size() - 1;
+    int64_t frame_offset = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        frame_offset = _offset_and_term[frame_first_index - _first_index].first;
+    }
+    SegmentRecord record;
+    if (record.encode(&kept[0], kept.size(), 
+                      _checksum_type, _compress_type) != 0) {
+        return -1;
+    }
+    butil::IOPortal data;
+    if (frame_offset > 0 
+            && _pread(&data, 0, frame_offset) != (ssize_t)frame_offset) {
+        LOG(ERROR) << "Fail to read " << frame_offset << " bytes, path: " 
+                   << _path;
+        return -1;
+    }
+    data.append(record.header());
+    data.append(record.body());
+    if (!_is_open) {
+        scoped_refptr<SegmentMapping> mapping;
+        if (_reopen(&mapping) != 0) {
+            return -1;
+        }
+        // IOBufs referencing |mapping| keep reading the replaced file
+    }
+    if (_rewrite(_open_path(), data) != 0) {
+        return -1;
+    }
+    _preallocated = false;
+    if (_direct_io) {
+        {
+            // Cached chunks may cover the rewritten entries
+            BAIDU_SCOPED_LOCK(_mutex);
+            _cache_id = s_next_cache_id.fetch_add(1, butil::memory_order_relaxed);
         }
-
-        // start bthread to unlink
-        // TODO unlink follow control
-        std::string* file_path = new std::string(tmp_path);
-        bthread_t tid;
-        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL, run_unlink, file_path) != 0) {
-            run_unlink(file_path);
+        if (_reset_tail(data.size()) != 0) {
+            return -1;
         }
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    // The kept entries still start at |frame_offset|
+    _offset_and_term.resize(last_index_kept + 1 - _first_index);
+    while (!_configuration_indexes.empty() 
+            && _configuration_indexes.back() > last_index_kept) {
+        _configuration_indexes.pop_back();
+    }
+    _last_index.store(last_index_kept, butil::memory_order_relaxed);
+    _bytes = data.size();
+    _unsynced_bytes = 0;
+    _frame_cache_offset = -1;
+    return 0;
+}
 
-        LOG(INFO) << "Unlinked segment `" << path << '\'';
-    } while (0);
+std::string Segment::_open_path() const {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    return path;
+}
 
-    return ret;
+int Segment::_reopen(scoped_refptr<SegmentMapping>* mapping) {
+    // The index is out of date since then
+    _unlink_index();
+    std::string old_path(_path);
+    butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                         _first_index, _last_index.load());
+    const std::string new_path(_open_path());
+    int ret = ::rename(old_path.c_str(), new_path.c_str());
+    LOG_IF(INFO, ret == 0) << "Renamed `" << old_path << "' to `"
+                           << new_path << '\'';
+    LOG_IF(ERROR, ret != 0) << "Fail to rename `" << old_path << "' to `"
+                            << new_path << "', " << berror();
+    if (ret != 0) {
+        return ret;
+    }
+    _is_open = true;
+    // The file is appended to from now on
+    BAIDU_SCOPED_LOCK(_mutex);
+    mapping->swap(_mapping);
+    return 0;
 }
 
-int Segment::truncate(const int64_t last_index_kept) {
+int Segment::_truncate(const int64_t last_index_kept) {
     int64_t truncate_size = 0;
     int64_t first_truncate_in_offset = 0;
     std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -628,22 +2158,22 @@ int Segment::truncate(const int64_t last_index_kept) {
     // Truncate on a full segment need to rename back to inprogess segment again,
     // because the node may crash before truncate.
     if (!_is_open) {
-        std::string old_path(_path);
-        butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
-                             _first_index, _last_index.load());
-
-        std::string new_path(_path);
-        butil::string_appendf(&new_path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
-                             _first_index);
-        int ret = ::rename(old_path.c_str(), new_path.c_str());
-        LOG_IF(INFO, ret == 0) << "Renamed `" << old_path << "' to `"
-                               << new_path << '\'';
-        LOG_IF(ERROR, ret != 0) << "Fail to rename `" << old_path << "' to `"
-                                << new_path << "', " << berror();
+        scoped_refptr<SegmentMapping> mapping;
+        int ret = _reopen(&mapping);
         if (ret != 0) {
             return ret;
         }
-        _is_open = true;
+        if (mapping && !mapping->HasOneRef()) {
+            // Accessing the truncated pages referenced by IOBufs would raise
+            // SIGBUS, keep them in the old file and write the kept bytes into
+            // a new one
+            butil::IOBuf kept;
+            kept.append(mapping->data(), truncate_size);
+            ret = _rewrite(_open_path(), kept);
+            if (ret != 0) {
+                return ret;
+            }
+        }
     }
 
     // truncate fd
@@ -651,6 +2181,18 @@ int Segment::truncate(const int64_t last_index_kept) {
     if (ret < 0) {
         return ret;
     }
+    _preallocated = false;
+    if (_direct_io) {
+        {
+            // Cached chunks may cover the truncated entries
+            BAIDU_SCOPED_LOCK(_mutex);
+            _cache_id = s_next_cache_id.fetch_add(1, butil::memory_order_relaxed);
+        }
+        ret = _reset_tail(truncate_size);
+        if (ret != 0) {
+            return ret;
+        }
+    }
 
     // seek fd
     off_t ret_off = ::lseek(_fd, truncate_size, SEEK_SET);
@@ -663,11 +2205,177 @@ int Segment::truncate(const int64_t last_index_kept) {
     lck.lock();
     // update memory var
     _offset_and_term.resize(first_truncate_in_offset);
+    while (!_configuration_indexes.empty() 
+            && _configuration_indexes.back() > last_index_kept) {
+        _configuration_indexes.pop_back();
+    }
     _last_index.store(last_index_kept, butil::memory_order_relaxed);
     _bytes = truncate_size;
+    _frame_cache_offset = -1;
+    return ret;
+}
+
+struct SegmentLogStorage::SpareTask {
+    SegmentLogStorage* storage;
+    int64_t spare_id;
+};
+
+SegmentLogStorage::~SegmentLogStorage() {
+    _stopped.store(true, butil::memory_order_release);
+    _running_spare_tasks.wait();
+    drop_prepared_records();
+}
+
+static int prepare_spare_file(const std::string& path, const int64_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    int ret = 0;
+    do {
+#if defined(__linux__)
+        // Allocate all the extents at once, it's fine to fail as writing
+        // zeros below allocates them as well
+        if (::fallocate(fd, 0, 0, size) != 0) {
+            BRAFT_VLOG << "Fail to fallocate " << path << ", " << berror();
+        }
+#endif
+        // Write zeros rather than leaving unwritten extents, which have to be
+        // converted on the first fdatasync after they are appended to
+        off_t offset = 0;
+        while (offset < size) {
+            const size_t to_write = std::min((int64_t)sizeof(s_zero_buf),
+                                             size - offset);
+            const ssize_t n = ::pwrite(fd, s_zero_buf, to_write, offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(WARNING) << "Fail to write " << path;
+                ret = -1;
+                break;
+            }
+            offset += n;
+        }
+        if (ret != 0) {
+            break;
+        }
+        // The recycled file may be larger than |size|
+        ret = ftruncate_uninterrupted(fd, size);
+        if (ret != 0) {
+            PLOG(WARNING) << "Fail to truncate " << path << " to size=" << size;
+            break;
+        }
+        if (FLAGS_raft_sync) {
+            ret = raft_fsync(fd);
+            PLOG_IF(WARNING, ret != 0) << "Fail to sync " << path;
+        }
+    } while (0);
+    ::close(fd);
     return ret;
 }
 
+void* SegmentLogStorage::run_spare_task(void* arg) {
+    SpareTask* task = (SpareTask*)arg;
+    SegmentLogStorage* storage = task->storage;
+    std::string path(storage->_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_SPARE_PATTERN, task->spare_id);
+    std::string tmp_path(path);
+    tmp_path.append(".tmp");
+
+    butil::Timer timer;
+    timer.start();
+    bool ok = false;
+    if (!storage->_stopped.load(butil::memory_order_acquire)
+            && prepare_spare_file(tmp_path, FLAGS_raft_max_segment_size) == 0) {
+        ok = (::rename(tmp_path.c_str(), path.c_str()) == 0);
+        PLOG_IF(WARNING, !ok) << "Fail to rename " << tmp_path << " to " << path;
+    }
+    if (!ok) {
+        ::unlink(tmp_path.c_str());
+    }
+    timer.stop();
+    BRAFT_VLOG << "prepare spare segment file " << path << " ok " << ok
+               << " time: " << timer.u_elapsed();
+    {
+        BAIDU_SCOPED_LOCK(storage->_mutex);
+        --storage->_preparing_spares;
+        if (ok) {
+            storage->_spare_files.push_back(path);
+        }
+    }
+    // |storage| may be destroyed after signaled
+    storage->_running_spare_tasks.signal();
+    delete task;
+    return NULL;
+}
+
+void SegmentLogStorage::start_spare_task(SpareTask* task) {
+    _running_spare_tasks.add_count(1);
+    spawn_spare_task(task);
+}
+
+void SegmentLogStorage::spawn_spare_task(void* arg) {
+    bthread_t tid;
+    if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL, 
+                                 run_spare_task, arg) != 0) {
+        PLOG(WARNING) << "Fail to start bthread, prepare spare file in place";
+        run_spare_task(arg);
+    }
+}
+
+void SegmentLogStorage::fill_spare_files() {
+    if (FLAGS_raft_max_preallocated_segments <= 0) {
+        return;
+    }
+    std::vector<SpareTask*> tasks;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        while ((int)_spare_files.size() + _preparing_spares
+                < FLAGS_raft_max_preallocated_segments) {
+            SpareTask* task = new SpareTask;
+            task->storage = this;
+            task->spare_id = _next_spare_id++;
+            ++_preparing_spares;
+            tasks.push_back(task);
+        }
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        start_spare_task(tasks[i]);
+    }
+}
+
+void SegmentLogStorage::discard_segment(const scoped_refptr<Segment>& segment) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if ((int)_spare_files.size() + _preparing_spares
+            >= FLAGS_raft_max_preallocated_segments) {
+        lck.unlock();
+        segment->unlink();
+        return;
+    }
+    SpareTask* task = new SpareTask;
+    task->storage = this;
+    task->spare_id = _next_spare_id++;
+    ++_preparing_spares;
+    lck.unlock();
+
+    std::string tmp_path(_path);
+    butil::string_appendf(&tmp_path, "/" BRAFT_SEGMENT_SPARE_PATTERN ".tmp",
+                          task->spare_id);
+    if (segment->recycle(tmp_path) == 0) {
+        // Readers may still be reading the recycled segment by its fd, the
+        // file is overwritten after they are all gone
+        _running_spare_tasks.add_count(1);
+        segment->set_destroy_hook(spawn_spare_task, task);
+        return;
+    }
+    // Create a new spare file instead
+    segment->unlink();
+    start_spare_task(task);
+}
+
 int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
     if (FLAGS_raft_max_segment_size < 0) {
         LOG(FATAL) << "FLAGS_raft_max_segment_size " << FLAGS_raft_max_segment_size  
@@ -690,6 +2398,16 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         LOG_ONCE(INFO) << "Use murmurhash32 as the checksum type of appending entries";
     }
 
+    if (FLAGS_raft_segment_direct_io) {
+#if defined(O_DIRECT)
+        _direct_read_cache.reset(
+                new DirectReadCache(FLAGS_raft_direct_io_read_cache_size));
+#else
+        LOG(WARNING) << "O_DIRECT is not supported, write segments through "
+                        "the page cache, path: " << _path;
+#endif
+    }
+
     int ret = 0;
     bool is_empty = false;
     do {
@@ -717,6 +2435,9 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         _last_log_index.store(0);
         ret = save_meta(1);
     }
+    if (ret == 0) {
+        fill_spare_files();
+    }
     return ret;
 }
 
@@ -724,7 +2445,9 @@ int64_t SegmentLogStorage::last_log_index() {
     return _last_log_index.load(butil::memory_order_acquire);
 }
 
-int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) {
+int SegmentLogStorage::write_entries(
+        const std::vector<LogEntry*>& entries, IOMetric* metric,
+        std::vector<scoped_refptr<Segment> >* written_segments) {
     if (entries.empty()) {
         return 0;
     }
@@ -734,12 +2457,21 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOM
                    << " path: " << _path;
         return -1;
     }
-    scoped_refptr<Segment> last_segment = NULL;
     int64_t now = 0;
     int64_t delta_time_us = 0;
-    for (size_t i = 0; i < entries.size(); i++) {
+    size_t nappended = 0;
+    const bool batch_frame = FLAGS_raft_segment_batch_frame;
+    while (nappended < entries.size()) {
         now = butil::cpuwide_time_us();
-        LogEntry* entry = entries[i];
+        // Encoded by prepare_entries() or encoded here
+        scoped_ptr<SegmentRecord> record(
+                take_prepared_record(entries, nappended));
+        size_t batch = 1;
+        if (record) {
+            batch = record->entries().size();
+        } else if (batch_frame) {
+            batch = frame_size(entries, nappended);
+        }
         
         scoped_refptr<Segment> segment = open_segment();
         if (FLAGS_raft_trace_append_entry_latency && metric) {
@@ -748,28 +2480,155 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOM
             g_open_segment_latency << delta_time_us;
         }
         if (NULL == segment) {
-            return i;
+            break;
         }
-        int ret = segment->append(entry);
+        int ret = record ? segment->append(*record)
+                         : segment->append(&entries[nappended], batch);
         if (0 != ret) {
-            return i;
+            break;
         }
         if (FLAGS_raft_trace_append_entry_latency && metric) {
             delta_time_us = butil::cpuwide_time_us() - now;
             metric->append_entry_time_us += delta_time_us;
             g_segment_append_entry_latency << delta_time_us;
         }
-        _last_log_index.fetch_add(1, butil::memory_order_release);
-        last_segment = segment;
+        _last_log_index.fetch_add(batch, butil::memory_order_release);
+        nappended += batch;
+        if (written_segments->empty() || written_segments->back() != segment) {
+            written_segments->push_back(segment);
+        }
+    }
+    // Entries are staged in memory in O_DIRECT mode, closed segments were
+    // flushed when closing
+    if (!written_segments->empty() && written_segments->back()->flush() != 0) {
+        return -1;
+    }
+    return nappended;
+}
+
+void SegmentLogStorage::prepare_entries(const std::vector<LogEntry*>& entries) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_prepared_bytes >= FLAGS_raft_max_prepared_log_bytes) {
+            // Leave them to the appending thread
+            return;
+        }
+    }
+    const bool batch_frame = FLAGS_raft_segment_batch_frame;
+    std::vector<SegmentRecord*> records;
+    int64_t bytes = 0;
+    size_t nprepared = 0;
+    while (nprepared < entries.size()) {
+        const size_t batch = batch_frame ? frame_size(entries, nprepared) : 1;
+        SegmentRecord* record = new SegmentRecord;
+        if (record->encode(&entries[nprepared], batch, 
+                           _checksum_type, _compress_type) != 0) {
+            delete record;
+            break;
+        }
+        bytes += record->bytes();
+        records.push_back(record);
+        nprepared += batch;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    _prepared_records.insert(_prepared_records.end(), 
+                             records.begin(), records.end());
+    _prepared_bytes += bytes;
+}
+
+SegmentRecord* SegmentLogStorage::take_prepared_record(
+        const std::vector<LogEntry*>& entries, size_t begin) {
+    std::vector<SegmentRecord*> stale_records;
+    SegmentRecord* record = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (!_prepared_records.empty()) {
+            SegmentRecord* front = _prepared_records.front();
+            const std::vector<const LogEntry*>& prepared = front->entries();
+            if (prepared[0]->id.index > entries[begin]->id.index) {
+                // Prepared for the following entries
+                break;
+            }
+            _prepared_records.pop_front();
+            _prepared_bytes -= front->bytes();
+            if (prepared.size() <= entries.size() - begin
+                    && std::equal(prepared.begin(), prepared.end(),
+                                  entries.begin() + begin)) {
+                record = front;
+                break;
+            }
+            // The entries were not appended
+            stale_records.push_back(front);
+        }
+    }
+    for (size_t i = 0; i < stale_records.size(); ++i) {
+        delete stale_records[i];
+    }
+    return record;
+}
+
+void SegmentLogStorage::drop_prepared_records() {
+    std::deque<SegmentRecord*> records;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        records.swap(_prepared_records);
+        _prepared_bytes = 0;
+    }
+    for (size_t i = 0; i < records.size(); ++i) {
+        delete records[i];
+    }
+}
+
+int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) {
+    std::vector<scoped_refptr<Segment> > written_segments;
+    const int nappended = write_entries(entries, metric, &written_segments);
+    if (nappended != (int)entries.size() || written_segments.empty()) {
+        return nappended;
     }
-    now = butil::cpuwide_time_us();
-    last_segment->sync(_enable_sync);
+    const int64_t now = butil::cpuwide_time_us();
+    written_segments.back()->sync(_enable_sync);
     if (FLAGS_raft_trace_append_entry_latency && metric) {
-        delta_time_us = butil::cpuwide_time_us() - now;
+        const int64_t delta_time_us = butil::cpuwide_time_us() - now;
         metric->sync_segment_time_us += delta_time_us;
         g_sync_segment_latency << delta_time_us; 
     }
-    return entries.size();
+    return nappended;
+}
+
+int SegmentLogStorage::append_entries_nosync(
+        const std::vector<LogEntry*>& entries, IOMetric* metric) {
+    std::vector<scoped_refptr<Segment> > written_segments;
+    const int nappended = write_entries(entries, metric, &written_segments);
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < written_segments.size(); ++i) {
+        if (_unsynced_segments.empty()
+                || _unsynced_segments.back() != written_segments[i]) {
+            _unsynced_segments.push_back(written_segments[i]);
+        }
+    }
+    return nappended;
+}
+
+int SegmentLogStorage::sync_entries() {
+    std::vector<scoped_refptr<Segment> > segments;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        segments.swap(_unsynced_segments);
+    }
+    // Entries may span several segments when the open segment was rolled, sync
+    // all of them as the caller takes every written entry as durable then
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const int64_t start_time_us = butil::cpuwide_time_us();
+        if (segments[i]->sync(_enable_sync) != 0) {
+            PLOG(ERROR) << "Fail to sync segment, path: " << _path
+                        << " first_index: " << segments[i]->first_index();
+            return -1;
+        }
+        if (FLAGS_raft_trace_append_entry_latency) {
+            g_sync_segment_latency << butil::cpuwide_time_us() - start_time_us;
+        }
+    }
+    return 0;
 }
 
 int SegmentLogStorage::append_entry(const LogEntry* entry) {
@@ -786,6 +2645,9 @@ int SegmentLogStorage::append_entry(const LogEntry* entry) {
     }
     _last_log_index.fetch_add(1, butil::memory_order_release);
 
+    if (segment->flush() != 0) {
+        return EIO;
+    }
     return segment->sync(_enable_sync);
 }
 
@@ -797,6 +2659,26 @@ LogEntry* SegmentLogStorage::get_entry(const int64_t index) {
     return ptr->get(index);
 }
 
+int SegmentLogStorage::get_entries(const int64_t first_index, 
+                                   const int64_t last_index, size_t max_bytes,
+                                   std::vector<LogEntry*>* entries) {
+    size_t bytes = 0;
+    int64_t index = first_index;
+    while (index <= last_index && (index == first_index || bytes < max_bytes)) {
+        scoped_refptr<Segment> ptr;
+        if (get_segment(index, &ptr) != 0) {
+            break;
+        }
+        const int n = ptr->get_entries(index, last_index, 
+                max_bytes > bytes ? max_bytes - bytes : 0, entries, &bytes);
+        if (n <= 0) {
+            break;
+        }
+        index += n;
+    }
+    return index - first_index;
+}
+
 int64_t SegmentLogStorage::get_term(const int64_t index) {
     scoped_refptr<Segment> ptr;
     if (get_segment(index, &ptr) != 0) {
@@ -856,7 +2738,7 @@ int SegmentLogStorage::truncate_prefix(const int64_t first_index_kept) {
     std::vector<scoped_refptr<Segment> > popped;
     pop_segments(first_index_kept, &popped);
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        discard_segment(popped[i]);
         popped[i] = NULL;
     }
     return 0;
@@ -902,6 +2784,8 @@ void SegmentLogStorage::pop_segments_from_back(
 }
 
 int SegmentLogStorage::truncate_suffix(const int64_t last_index_kept) {
+    // The records prepared before might be of the truncated entries
+    drop_prepared_records();
     // segment files
     std::vector<scoped_refptr<Segment> > popped;
     scoped_refptr<Segment> last_segment;
@@ -954,6 +2838,7 @@ int SegmentLogStorage::reset(const int64_t next_log_index) {
                    << " path: " << _path;
         return EINVAL;
     }
+    drop_prepared_records();
     std::vector<scoped_refptr<Segment> > popped;
     std::unique_lock<raft_mutex_t> lck(_mutex);
     popped.reserve(_segments.size());
@@ -975,7 +2860,7 @@ int SegmentLogStorage::reset(const int64_t next_log_index) {
         return -1;
     }
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        discard_segment(popped[i]);
         popped[i] = NULL;
     }
     return 0;
@@ -990,6 +2875,7 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     }
 
     // restore segment meta
+    std::vector<std::pair<int64_t, int64_t> > index_files;
     while (dir_reader.Next()) {
         // unlink unneed segments and unfinished unlinked segments
         if ((is_empty && 0 == strncmp(dir_reader.name(), "log_", strlen("log_"))) ||
@@ -1006,8 +2892,33 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         }
 
         int match = 0;
+        int64_t spare_id = 0;
+        match = sscanf(dir_reader.name(), BRAFT_SEGMENT_SPARE_PATTERN, &spare_id);
+        if (match == 1) {
+            std::string spare_path(_path);
+            spare_path.append("/");
+            spare_path.append(dir_reader.name());
+            if ((int)_spare_files.size() < FLAGS_raft_max_preallocated_segments) {
+                BRAFT_VLOG << "restore spare segment file, path: " << spare_path;
+                _spare_files.push_back(spare_path);
+            } else {
+                ::unlink(spare_path.c_str());
+                LOG(WARNING) << "unlink unused spare segment file, path: " 
+                             << spare_path;
+            }
+            _next_spare_id = std::max(_next_spare_id, spare_id + 1);
+            continue;
+        }
+
         int64_t first_index = 0;
         int64_t last_index = 0;
+        match = sscanf(dir_reader.name(), BRAFT_SEGMENT_INDEX_PATTERN,
+                       &first_index, &last_index);
+        if (match == 2) {
+            index_files.push_back(std::make_pair(first_index, last_index));
+            continue;
+        }
+
         match = sscanf(dir_reader.name(), BRAFT_SEGMENT_CLOSED_PATTERN, 
                        &first_index, &last_index);
         if (match == 2) {
@@ -1015,6 +2926,10 @@ int SegmentLogStorage::list_segments(bool is_empty) {
                       << " first_index: " << first_index
                       << " last_index: " << last_index;
             Segment* segment = new Segment(_path, first_index, last_index, _checksum_type);
+            if (_direct_read_cache) {
+                segment->set_direct_io(_direct_read_cache.get());
+            }
+            segment->set_compress_type(_compress_type);
             _segments[first_index] = segment;
             continue;
         }
@@ -1026,6 +2941,10 @@ int SegmentLogStorage::list_segments(bool is_empty) {
                 << " first_index: " << first_index;
             if (!_open_segment) {
                 _open_segment = new Segment(_path, first_index, _checksum_type);
+                if (_direct_read_cache) {
+                    _open_segment->set_direct_io(_direct_read_cache.get());
+                }
+                _open_segment->set_compress_type(_compress_type);
                 continue;
             } else {
                 LOG(WARNING) << "open segment conflict, path: " << _path
@@ -1035,6 +2954,20 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         }
     }
 
+    // unlink index files of which the segments are gone
+    for (size_t i = 0; i < index_files.size(); ++i) {
+        SegmentMap::iterator it = _segments.find(index_files[i].first);
+        if (it != _segments.end() 
+                && it->second->last_index() == index_files[i].second) {
+            continue;
+        }
+        std::string index_path(_path);
+        butil::string_appendf(&index_path, "/" BRAFT_SEGMENT_INDEX_PATTERN,
+                              index_files[i].first, index_files[i].second);
+        ::unlink(index_path.c_str());
+        LOG(WARNING) << "unlink unused segment index, path: " << index_path;
+    }
+
     // check segment
     int64_t last_log_index = -1;
     SegmentMap::iterator it;
@@ -1090,20 +3023,76 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     return 0;
 }
 
+// Closed segments are loaded by several bthreads, each of which registers
+// configurations into the private ConfigurationManager of the segment.
+struct LoadSegmentsArg {
+    std::string path;
+    std::vector<Segment*> segments;
+    std::vector<ConfigurationManager> configuration_managers;
+    std::vector<int> rets;
+    butil::atomic<size_t> next;
+    butil::atomic<bool> failed;
+};
+
+static void* run_load_segments(void* arg) {
+    LoadSegmentsArg* a = (LoadSegmentsArg*)arg;
+    while (!a->failed.load(butil::memory_order_relaxed)) {
+        const size_t i = a->next.fetch_add(1, butil::memory_order_relaxed);
+        if (i >= a->segments.size()) {
+            break;
+        }
+        Segment* segment = a->segments[i];
+        LOG(INFO) << "load closed segment, path: " << a->path
+            << " first_index: " << segment->first_index()
+            << " last_index: " << segment->last_index();
+        a->rets[i] = segment->load(&a->configuration_managers[i]);
+        if (a->rets[i] != 0) {
+            a->failed.store(true, butil::memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
 int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
     int ret = 0;
 
     // closed segments
-    SegmentMap::iterator it;
-    for (it = _segments.begin(); it != _segments.end(); ++it) {
-        Segment* segment = it->second.get();
-        LOG(INFO) << "load closed segment, path: " << _path
-            << " first_index: " << segment->first_index()
-            << " last_index: " << segment->last_index();
-        ret = segment->load(configuration_manager);
+    LoadSegmentsArg arg;
+    arg.path = _path;
+    for (SegmentMap::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        arg.segments.push_back(it->second.get());
+    }
+    arg.configuration_managers.resize(arg.segments.size());
+    arg.rets.resize(arg.segments.size(), 0);
+    arg.next.store(0, butil::memory_order_relaxed);
+    arg.failed.store(false, butil::memory_order_relaxed);
+    const size_t nworkers = std::min(arg.segments.size(),
+                        (size_t)FLAGS_raft_max_load_segment_concurrency);
+    std::vector<bthread_t> tids;
+    for (size_t i = 1; i < nworkers; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_load_segments, &arg) != 0) {
+            PLOG(WARNING) << "Fail to start bthread, load segments with "
+                          << tids.size() + 1 << " workers";
+            break;
+        }
+        tids.push_back(tid);
+    }
+    run_load_segments(&arg);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    // Register configurations in the order of index as if the segments were
+    // loaded one by one
+    for (size_t i = 0; i < arg.segments.size(); ++i) {
+        Segment* segment = arg.segments[i];
+        ret = arg.rets[i];
         if (ret != 0) {
             return ret;
-        } 
+        }
+        if (configuration_manager->add(arg.configuration_managers[i]) != 0) {
+            return -1;
+        }
         _last_log_index.store(segment->last_index(), butil::memory_order_release);
     }
 
@@ -1174,42 +3163,64 @@ int SegmentLogStorage::load_meta() {
     return 0;
 }
 
+scoped_refptr<Segment> SegmentLogStorage::create_open_segment() {
+    std::string spare_path;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (!_spare_files.empty()) {
+            spare_path = _spare_files.front();
+            _spare_files.pop_front();
+        }
+    }
+    scoped_refptr<Segment> segment = 
+            new Segment(_path, last_log_index() + 1, _checksum_type);
+    if (_direct_read_cache) {
+        segment->set_direct_io(_direct_read_cache.get());
+    }
+    segment->set_compress_type(_compress_type);
+    const int ret = spare_path.empty() ? segment->create()
+                                       : segment->create(spare_path);
+    return ret == 0 ? segment : NULL;
+}
+
 scoped_refptr<Segment> SegmentLogStorage::open_segment() {
     scoped_refptr<Segment> prev_open_segment;
     {
         BAIDU_SCOPED_LOCK(_mutex);
-        if (!_open_segment) {
-            _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-            if (_open_segment->create() != 0) {
-                _open_segment = NULL;
-                return NULL;
-            }
+        if (_open_segment
+                && _open_segment->bytes() <= FLAGS_raft_max_segment_size) {
+            return _open_segment;
         }
-        if (_open_segment->bytes() > FLAGS_raft_max_segment_size) {
+        if (_open_segment) {
             _segments[_open_segment->first_index()] = _open_segment;
             prev_open_segment.swap(_open_segment);
         }
     }
-    do {
-        if (prev_open_segment) {
-            if (prev_open_segment->close(_enable_sync) == 0) {
-                BAIDU_SCOPED_LOCK(_mutex);
-                _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                if (_open_segment->create() == 0) {
-                    // success
-                    break;
-                }
-            }
-            PLOG(ERROR) << "Fail to close old open_segment or create new open_segment"
-                        << " path: " << _path;
-            // Failed, revert former changes
-            BAIDU_SCOPED_LOCK(_mutex);
-            _segments.erase(prev_open_segment->first_index());
-            _open_segment.swap(prev_open_segment);
+    // Renaming the spare file and syncing the directory may take long, so
+    // the new segment is created out of _mutex which blocks the readers, and
+    // only published under it
+    scoped_refptr<Segment> segment;
+    if (!prev_open_segment || prev_open_segment->close(_enable_sync) == 0) {
+        segment = create_open_segment();
+    }
+    if (!segment) {
+        if (!prev_open_segment) {
             return NULL;
         }
-    } while (0);
-    return _open_segment;
+        PLOG(ERROR) << "Fail to close old open_segment or create new open_segment"
+                    << " path: " << _path;
+        // Failed, revert former changes
+        BAIDU_SCOPED_LOCK(_mutex);
+        _segments.erase(prev_open_segment->first_index());
+        _open_segment.swap(prev_open_segment);
+        return NULL;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _open_segment = segment;
+    }
+    fill_spare_files();
+    return segment;
 }
 
 int SegmentLogStorage::get_segment(int64_t index, scoped_refptr<Segment>* ptr) {
@@ -1268,13 +3279,62 @@ void SegmentLogStorage::sync() {
     }
 }
 
+// Parse `${path}?compress=${type}' into the path and the compress type
+static int parse_segment_uri(const std::string& uri, std::string* path,
+                             int* compress_type) {
+    *compress_type = SEGMENT_COMPRESS_NONE;
+    const size_t pos = uri.find('?');
+    path->assign(uri, 0, pos);
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    for (butil::StringSplitter sp(uri.c_str() + pos + 1, '&'); sp; ++sp) {
+        const butil::StringPiece param(sp.field(), sp.length());
+        const size_t eq = param.find('=');
+        const butil::StringPiece key = param.substr(0, eq);
+        const butil::StringPiece value = eq == butil::StringPiece::npos
+                                         ? butil::StringPiece() 
+                                         : param.substr(eq + 1);
+        if (key != "compress") {
+            LOG(ERROR) << "Unknown parameter `" << param << "' in uri=`" 
+                       << uri << '\'';
+            return -1;
+        }
+        if (value == "none") {
+            *compress_type = SEGMENT_COMPRESS_NONE;
+        } else if (value == "snappy") {
+            *compress_type = SEGMENT_COMPRESS_SNAPPY;
+        } else if (value == "zlib") {
+            *compress_type = SEGMENT_COMPRESS_ZLIB;
+        } else {
+            LOG(ERROR) << "Unknown compress type `" << value << "' in uri=`" 
+                       << uri << '\'';
+            return -1;
+        }
+    }
+    return 0;
+}
+
 LogStorage* SegmentLogStorage::new_instance(const std::string& uri) const {
-    return new SegmentLogStorage(uri);
+    std::string path;
+    int compress_type = SEGMENT_COMPRESS_NONE;
+    if (parse_segment_uri(uri, &path, &compress_type) != 0) {
+        return NULL;
+    }
+    SegmentLogStorage* storage = new SegmentLogStorage(path);
+    storage->_compress_type = compress_type;
+    return storage;
 }
 
 butil::Status SegmentLogStorage::gc_instance(const std::string& uri) const {
     butil::Status status;
-    if (gc_dir(uri) != 0) {
+    std::string path;
+    int compress_type = SEGMENT_COMPRESS_NONE;
+    if (parse_segment_uri(uri, &path, &compress_type) != 0) {
+        status.set_error(EINVAL, "Invalid log storage uri %s", uri.c_str());
+        return status;
+    }
+    if (gc_dir(path) != 0) {
         LOG(WARNING) << "Failed to gc log storage from path " << _path;
         status.set_error(EINVAL, "Failed to gc log storage from path %s", 
                          uri.c_str());
@@ -21,31 +21,119 @@
 
 #include <vector>
 #include <map>
+#include <deque>
 #include <butil/memory/ref_counted.h>
+#include <butil/memory/scoped_ptr.h>
 #include <butil/atomicops.h>
 #include <butil/iobuf.h>
 #include <butil/logging.h>
+#include <bthread/countdown_event.h>
 #include "braft/log_entry.h"
 #include "braft/storage.h"
 #include "braft/util.h"
 
 namespace braft {
 
+// Caches aligned chunks of the segment files opened with O_DIRECT, so that
+// lagging followers could read the logs without the page cache
+class DirectReadCache {
+public:
+    explicit DirectReadCache(size_t capacity);
+
+    // Read [offset, offset + size) of |fd| which is identified by |id| into
+    // |out|, only the chunks ending before |cacheable_end| are cached.
+    // Returns the number of bytes read, which is less than |size| at the end
+    // of file, -1 on error
+    ssize_t read(uint64_t id, int fd, off_t offset, size_t size,
+                 int64_t cacheable_end, butil::IOBuf* out);
+
+private:
+    struct Chunk {
+        uint64_t id;
+        off_t offset;
+        int64_t last_access;
+        butil::IOBuf data;
+    };
+
+    raft_mutex_t _mutex;
+    std::vector<Chunk> _chunks;
+    size_t _capacity;
+    int64_t _clock;
+};
+
+// Read-only mapping of a closed segment. IOBufs read from it reference the
+// mapped pages, which are unmapped after all of them are released
+class SegmentMapping : public butil::RefCountedThreadSafe<SegmentMapping> {
+public:
+    // Map the first |size| bytes of |fd|, NULL on error
+    static SegmentMapping* create(int fd, size_t size);
+
+    // Append [offset, offset + size) to |buf| without copying. Returns the
+    // number of bytes appended, which is less than |size| at the end
+    ssize_t read(off_t offset, size_t size, butil::IOBuf* buf);
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+friend class butil::RefCountedThreadSafe<SegmentMapping>;
+    SegmentMapping(char* data, size_t size) : _data(data), _size(size) {}
+    ~SegmentMapping();
+
+    static void release_data(void* data);
+
+    char* _data;
+    size_t _size;
+};
+
+// Entries encoded into one record of the segment file, which is a single
+// entry or a batch frame of the entries in the same term
+class SegmentRecord {
+public:
+    SegmentRecord() {}
+    ~SegmentRecord();
+
+    // Encode |entries| with |checksum_type| and |compress_type|, which are
+    // referenced by the record then. Returns 0 on success
+    int encode(const LogEntry* const entries[], size_t size,
+               int checksum_type, int compress_type);
+
+    const std::vector<const LogEntry*>& entries() const { return _entries; }
+    const butil::IOBuf& header() const { return _header; }
+    const butil::IOBuf& body() const { return _body; }
+    size_t bytes() const { return _header.length() + _body.length(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SegmentRecord);
+
+    std::vector<const LogEntry*> _entries;
+    butil::IOBuf _header;
+    butil::IOBuf _body;
+};
+
 class BAIDU_CACHELINE_ALIGNMENT Segment 
         : public butil::RefCountedThreadSafe<Segment> {
 public:
     Segment(const std::string& path, const int64_t first_index, int checksum_type)
         : _path(path), _bytes(0), _unsynced_bytes(0),
-        _fd(-1), _is_open(true),
+        _fd(-1), _is_open(true), _preallocated(false),
         _first_index(first_index), _last_index(first_index - 1),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _direct_io(false), _read_cache(NULL),
+        _cache_id(0), _tail_buf(NULL), _tail_cap(0), _tail_offset(0),
+        _flushed_bytes(0), _frame_cache_offset(-1), _frame_cache_term(0),
+        _compress_type(0), _mapped(false), _destroy_hook(NULL),
+        _destroy_arg(NULL)
     {}
     Segment(const std::string& path, const int64_t first_index, const int64_t last_index,
             int checksum_type)
         : _path(path), _bytes(0), _unsynced_bytes(0),
-        _fd(-1), _is_open(false),
+        _fd(-1), _is_open(false), _preallocated(false),
         _first_index(first_index), _last_index(last_index),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _direct_io(false), _read_cache(NULL),
+        _cache_id(0), _tail_buf(NULL), _tail_cap(0), _tail_offset(0),
+        _flushed_bytes(0), _frame_cache_offset(-1), _frame_cache_term(0),
+        _compress_type(0), _mapped(false), _destroy_hook(NULL),
+        _destroy_arg(NULL)
     {}
 
     struct EntryHeader;
@@ -53,16 +141,48 @@ public:
     // create open segment
     int create();
 
+    // create open segment by renaming the zero-filled file at |spare_path|,
+    // fall back to create() if the file can't be reused
+    int create(const std::string& spare_path);
+
     // load open or closed segment
     // open fd, load index, truncate uncompleted entry
     int load(ConfigurationManager* configuration_manager);
 
+    // open the file with O_DIRECT, reads go through |read_cache| then.
+    // Must be called before create() or load()
+    void set_direct_io(DirectReadCache* read_cache);
+
+    // compress the data of the entries appended afterwards with
+    // |compress_type|, each entry or batch frame is compressed on its own
+    void set_compress_type(int compress_type) {
+        _compress_type = compress_type;
+    }
+
     // serialize entry, and append to open segment
     int append(const LogEntry* entry);
 
+    // serialize |entries| of the same term into one batch frame, and append
+    // to open segment
+    int append(const LogEntry* const entries[], size_t size);
+
+    // append the record encoded with the checksum and compress type of this
+    // segment to open segment
+    int append(const SegmentRecord& record);
+
+    // write the entries staged by append() in O_DIRECT mode, which must be
+    // called before syncing them
+    int flush();
+
     // get entry by index
     LogEntry* get(const int64_t index) const;
 
+    // get the entries in [first_index, last_index] with one read, until
+    // |max_bytes| are read. Returns the number of entries appended to
+    // |entries|, -1 on error
+    int get_entries(int64_t first_index, int64_t last_index, size_t max_bytes,
+                    std::vector<LogEntry*>* entries, size_t* bytes) const;
+
     // get entry's term by index
     int64_t get_term(const int64_t index) const;
 
@@ -75,6 +195,16 @@ public:
     // unlink segment
     int unlink();
 
+    // rename segment file to |new_path| so that it can be reused later
+    int recycle(const std::string& new_path);
+
+    // Call |fn(arg)| once the segment is destroyed, when nobody is reading
+    // the file by its fd any more
+    void set_destroy_hook(void (*fn)(void*), void* arg) {
+        _destroy_hook = fn;
+        _destroy_arg = arg;
+    }
+
     // truncate segment to last_index_kept
     int truncate(const int64_t last_index_kept);
 
@@ -102,31 +232,120 @@ friend class butil::RefCountedThreadSafe<Segment>;
             ::close(_fd);
             _fd = -1;
         }
+        free(_tail_buf);
+        if (_destroy_hook) {
+            _destroy_hook(_destroy_arg);
+        }
     }
 
     struct LogMeta {
         off_t offset;
         size_t length;
         int64_t term;
+        // position in the batch frame at offset
+        int slot;
     };
 
     int _load_entry(off_t offset, EntryHeader *head, butil::IOBuf *body, 
                     size_t size_hint) const;
 
+    int _parse_header(off_t offset, const butil::IOBuf& buf, 
+                      EntryHeader* head) const;
+
+    // verify and decompress the data of the entry in |buf| into |data|
+    int _parse_data(off_t offset, const EntryHeader& head, 
+                    butil::IOBuf* buf, butil::IOBuf* data) const;
+
+    LogEntry* _build_entry(int64_t index, const EntryHeader& header,
+                           butil::IOBuf* data) const;
+
+    // load the |slot|-th entry of the batch frame at |offset|, or the entry
+    // at |offset| if it's not a frame
+    int _load_slot(off_t offset, int slot, EntryHeader* head, 
+                   butil::IOBuf* body, size_t size_hint) const;
+
+    int _write(butil::IOBuf* header, butil::IOBuf* data);
+
+    void _map();
+
+    // Replace the file at |path| with |data| durably
+    int _rewrite(const std::string& path, const butil::IOBuf& data);
+
+    // Replace the batch frame starting at |frame_first_index| with a frame
+    // of the |kept| entries at the beginning of it
+    int _rewrite_frame(const int64_t frame_first_index,
+                       const std::vector<LogEntry*>& kept);
+
+    int _truncate(const int64_t last_index_kept);
+
+    std::string _open_path() const;
+
+    // Rename the closed segment back to an open one, moving its mapping
+    // into |mapping|
+    int _reopen(scoped_refptr<SegmentMapping>* mapping);
+
+    int _open_flags() const;
+
+    ssize_t _pread(butil::IOPortal* buf, off_t offset, size_t size) const;
+
+    int _reserve_tail(size_t size);
+
+    int _reset_tail(int64_t size);
+
+    void _release_tail();
+
     int _get_meta(int64_t index, LogMeta* meta) const;
 
     int _truncate_meta_and_get_last(int64_t last);
 
+    bool _is_torn_entry(off_t offset, size_t length) const;
+
+    std::string _index_path() const;
+
+    int _save_index();
+
+    int _load_index(ConfigurationManager* configuration_manager,
+                    int64_t file_size);
+
+    void _unlink_index();
+
+    int _drop_torn_entries(ConfigurationManager* configuration_manager,
+                           int64_t* last_index, int64_t* entry_off);
+
     std::string _path;
     int64_t _bytes;
     int64_t _unsynced_bytes;
     mutable raft_mutex_t _mutex;
     int _fd;
     bool _is_open;
+    // whether the file is larger than _bytes and zero-filled after it
+    bool _preallocated;
     const int64_t _first_index;
     butil::atomic<int64_t> _last_index;
     int _checksum_type;
     std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term;
+    std::vector<int64_t> _configuration_indexes;
+    bool _direct_io;
+    DirectReadCache* _read_cache;
+    uint64_t _cache_id;
+    // In O_DIRECT mode the bytes in [_tail_offset, _bytes) of the open
+    // segment are kept in this aligned buffer, of which the ones before
+    // _flushed_bytes are on disk as well
+    char* _tail_buf;
+    size_t _tail_cap;
+    int64_t _tail_offset;
+    int64_t _flushed_bytes;
+    // The last batch frame read
+    mutable off_t _frame_cache_offset;
+    mutable int64_t _frame_cache_term;
+    mutable butil::IOBuf _frame_cache;
+    int _compress_type;
+    // Not NULL if the closed segment is mapped
+    scoped_refptr<SegmentMapping> _mapping;
+    // Whether the file has ever been mapped
+    bool _mapped;
+    void (*_destroy_hook)(void*);
+    void* _destroy_arg;
 };
 
 // LogStorage use segmented append-only file, all data in disk, all index in memory.
@@ -136,6 +355,11 @@ friend class butil::RefCountedThreadSafe<Segment>;
 //      log_meta: record start_log
 //      log_000001-0001000: closed segment
 //      log_inprogress_0001001: open segment
+//      log_index_000001-0001000: offsets and terms of the closed segment
+//      log_spare_0000001: preallocated file to become the next open segment
+//
+// The data of the appended entries is compressed with `${path}?compress=snappy'
+// or `${path}?compress=zlib' as the uri, segments are readable with any of them
 class SegmentLogStorage : public LogStorage {
 public:
     typedef std::map<int64_t, scoped_refptr<Segment> > SegmentMap;
@@ -145,17 +369,29 @@ public:
         , _first_log_index(1)
         , _last_log_index(0)
         , _checksum_type(0)
+        , _compress_type(0)
         , _enable_sync(enable_sync)
+        , _prepared_bytes(0)
+        , _next_spare_id(1)
+        , _preparing_spares(0)
+        , _running_spare_tasks(0)
+        , _stopped(false)
     {} 
 
     SegmentLogStorage()
         : _first_log_index(1)
         , _last_log_index(0)
         , _checksum_type(0)
+        , _compress_type(0)
         , _enable_sync(true)
+        , _prepared_bytes(0)
+        , _next_spare_id(1)
+        , _preparing_spares(0)
+        , _running_spare_tasks(0)
+        , _stopped(false)
     {}
 
-    virtual ~SegmentLogStorage() {}
+    virtual ~SegmentLogStorage();
 
     // init logstorage, check consistency and integrity
     virtual int init(ConfigurationManager* configuration_manager);
@@ -171,15 +407,31 @@ public:
     // get logentry by index
     virtual LogEntry* get_entry(const int64_t index);
 
+    // get logentries in [first_index, last_index] with a sequential read
+    // per segment
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index);
 
     // append entry to log
     int append_entry(const LogEntry* entry);
 
+    // encode |entries| into records in advance, which are appended by the
+    // following append_entries*() of the same entries
+    virtual void prepare_entries(const std::vector<LogEntry*>& entries);
+
     // append entries to log and update IOMetric, return success append number
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric);
 
+    // append entries to log without syncing, return success append number
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric);
+
+    // sync all the segments written by append_entries_nosync()
+    virtual int sync_entries();
+
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept);
 
@@ -201,7 +453,16 @@ public:
 
     void sync();
 private:
+    struct SpareTask;
+
     scoped_refptr<Segment> open_segment();
+    scoped_refptr<Segment> create_open_segment();
+    int write_entries(const std::vector<LogEntry*>& entries, IOMetric* metric,
+                      std::vector<scoped_refptr<Segment> >* written_segments);
+    // Take the prepared record of the entries from |begin|, NULL if absent
+    SegmentRecord* take_prepared_record(const std::vector<LogEntry*>& entries,
+                                        size_t begin);
+    void drop_prepared_records();
     int save_meta(const int64_t log_index);
     int load_meta();
     int list_segments(bool is_empty);
@@ -214,6 +475,14 @@ private:
             const int64_t last_index_kept,
             std::vector<scoped_refptr<Segment> >* popped,
             scoped_refptr<Segment>* last_segment);
+    // Unlink |segment| or recycle it into the spare files
+    void discard_segment(const scoped_refptr<Segment>& segment);
+    // Start preparing new spare files in background until the pool is full
+    void fill_spare_files();
+    void start_spare_task(SpareTask* task);
+    // Run the counted spare task |arg| in background
+    static void spawn_spare_task(void* arg);
+    static void* run_spare_task(void* arg);
 
 
     std::string _path;
@@ -223,7 +492,21 @@ private:
     SegmentMap _segments;
     scoped_refptr<Segment> _open_segment;
     int _checksum_type;
+    int _compress_type;
     bool _enable_sync;
+    // Segments written by append_entries_nosync() and not synced yet
+    std::vector<scoped_refptr<Segment> > _unsynced_segments;
+    // Records encoded by prepare_entries() in the order of appending
+    std::deque<SegmentRecord*> _prepared_records;
+    int64_t _prepared_bytes;
+    // Preallocated zero-filled files ready to become the open segment
+    std::deque<std::string> _spare_files;
+    int64_t _next_spare_id;
+    int _preparing_spares;
+    // Not NULL in O_DIRECT mode
+    scoped_ptr<DirectReadCache> _direct_read_cache;
+    bthread::CountdownEvent _running_spare_tasks;
+    butil::atomic<bool> _stopped;
 };
 
 }  //  namespace braft
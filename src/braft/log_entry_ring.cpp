@@ -0,0 +1,216 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <butil/logging.h>
+#include "braft/log_entry_ring.h"
+
+namespace braft {
+
+LogEntryRing::Buffer::Buffer(size_t capacity)
+    : slots(new butil::atomic<LogEntry*>[capacity])
+    , mask(capacity - 1) {
+    CHECK_EQ(0u, capacity & mask) << "capacity=" << capacity
+                                  << " must be power of 2";
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].store(NULL, butil::memory_order_relaxed);
+    }
+}
+
+LogEntryRing::Buffer::~Buffer() {
+    delete [] slots;
+}
+
+LogEntryRing::LogEntryRing(size_t initial_capacity)
+    : _buffer(NULL)
+    , _first_index(1)
+    , _last_index(0)
+    , _epoch(0)
+    , _bytes(0) {
+    size_t capacity = 1;
+    while (capacity < initial_capacity) {
+        capacity <<= 1;
+    }
+    _buffer.store(new Buffer(capacity), butil::memory_order_relaxed);
+    _readers[0].store(0, butil::memory_order_relaxed);
+    _readers[1].store(0, butil::memory_order_relaxed);
+}
+
+LogEntryRing::~LogEntryRing() {
+    clear();
+    std::vector<LogEntry*> released;
+    for (int i = 0; i < 2; ++i) {
+        released.insert(released.end(), _retired_entries[i].begin(),
+                        _retired_entries[i].end());
+        _retired_entries[i].clear();
+        for (size_t j = 0; j < _retired_buffers[i].size(); ++j) {
+            delete _retired_buffers[i][j];
+        }
+        _retired_buffers[i].clear();
+    }
+    for (size_t i = 0; i < released.size(); ++i) {
+        released[i]->Release();
+    }
+    delete _buffer.load(butil::memory_order_relaxed);
+}
+
+int64_t LogEntryRing::enter() const {
+    while (true) {
+        const int64_t epoch = _epoch.load(butil::memory_order_seq_cst);
+        _readers[epoch & 1].fetch_add(1, butil::memory_order_seq_cst);
+        // Retry if the epoch was advanced before the counter was added, as
+        // the writer may not see this reader then
+        if (_epoch.load(butil::memory_order_seq_cst) == epoch) {
+            return epoch;
+        }
+        _readers[epoch & 1].fetch_sub(1, butil::memory_order_release);
+    }
+}
+
+void LogEntryRing::leave(int64_t epoch) const {
+    _readers[epoch & 1].fetch_sub(1, butil::memory_order_release);
+}
+
+LogEntry* LogEntryRing::get(int64_t index) const {
+    const int64_t epoch = enter();
+    LogEntry* entry = NULL;
+    if (index >= _first_index.load(butil::memory_order_acquire)
+            && index <= _last_index.load(butil::memory_order_acquire)) {
+        const Buffer* buffer = _buffer.load(butil::memory_order_acquire);
+        entry = buffer->slots[index & buffer->mask].load(
+                butil::memory_order_acquire);
+        // The slot may have been reused by another index since the bounds
+        // were read
+        if (entry != NULL && entry->id.index == index) {
+            entry->AddRef();
+        } else {
+            entry = NULL;
+        }
+    }
+    leave(epoch);
+    return entry;
+}
+
+int64_t LogEntryRing::get_term(int64_t index) const {
+    const int64_t epoch = enter();
+    int64_t term = 0;
+    if (index >= _first_index.load(butil::memory_order_acquire)
+            && index <= _last_index.load(butil::memory_order_acquire)) {
+        const Buffer* buffer = _buffer.load(butil::memory_order_acquire);
+        const LogEntry* entry = buffer->slots[index & buffer->mask].load(
+                butil::memory_order_acquire);
+        if (entry != NULL && entry->id.index == index) {
+            term = entry->id.term;
+        }
+    }
+    leave(epoch);
+    return term;
+}
+
+LogEntry* LogEntryRing::at(int64_t index) const {
+    if (index < first_index() || index > last_index()) {
+        return NULL;
+    }
+    const Buffer* buffer = _buffer.load(butil::memory_order_relaxed);
+    return buffer->slots[index & buffer->mask].load(butil::memory_order_relaxed);
+}
+
+void LogEntryRing::grow() {
+    Buffer* old_buffer = _buffer.load(butil::memory_order_relaxed);
+    Buffer* buffer = new Buffer((old_buffer->mask + 1) * 2);
+    for (int64_t index = first_index(); index <= last_index(); ++index) {
+        buffer->slots[index & buffer->mask].store(
+                old_buffer->slots[index & old_buffer->mask].load(
+                        butil::memory_order_relaxed),
+                butil::memory_order_relaxed);
+    }
+    _buffer.store(buffer, butil::memory_order_release);
+    _retired_buffers[_epoch.load(butil::memory_order_relaxed) & 1]
+            .push_back(old_buffer);
+}
+
+void LogEntryRing::push_back(LogEntry* entry) {
+    const int64_t index = entry->id.index;
+    if (empty()) {
+        _first_index.store(index, butil::memory_order_release);
+        _last_index.store(index - 1, butil::memory_order_release);
+    } else {
+        CHECK_EQ(last_index() + 1, index);
+        if (size() > _buffer.load(butil::memory_order_relaxed)->mask) {
+            grow();
+        }
+    }
+    Buffer* buffer = _buffer.load(butil::memory_order_relaxed);
+    buffer->slots[index & buffer->mask].store(entry, butil::memory_order_release);
+    _last_index.store(index, butil::memory_order_release);
+    _bytes += entry->data.length();
+}
+
+void LogEntryRing::retire(LogEntry* entry) {
+    _bytes -= entry->data.length();
+    _retired_entries[_epoch.load(butil::memory_order_relaxed) & 1]
+            .push_back(entry);
+}
+
+void LogEntryRing::pop_front() {
+    const int64_t index = first_index();
+    CHECK_LE(index, last_index());
+    _first_index.store(index + 1, butil::memory_order_release);
+    Buffer* buffer = _buffer.load(butil::memory_order_relaxed);
+    LogEntry* entry = buffer->slots[index & buffer->mask].exchange(
+            NULL, butil::memory_order_seq_cst);
+    retire(entry);
+}
+
+void LogEntryRing::pop_back() {
+    const int64_t index = last_index();
+    CHECK_LE(first_index(), index);
+    _last_index.store(index - 1, butil::memory_order_release);
+    Buffer* buffer = _buffer.load(butil::memory_order_relaxed);
+    LogEntry* entry = buffer->slots[index & buffer->mask].exchange(
+            NULL, butil::memory_order_seq_cst);
+    retire(entry);
+}
+
+void LogEntryRing::clear() {
+    while (!empty()) {
+        pop_back();
+    }
+}
+
+void LogEntryRing::reclaim(std::vector<LogEntry*>* released) {
+    // At most two rounds are needed to reclaim everything retired before
+    for (int i = 0; i < 2; ++i) {
+        const int64_t epoch = _epoch.load(butil::memory_order_relaxed);
+        // The readers of the previous epoch
+        const int prev = (epoch + 1) & 1;
+        if (_readers[prev].load(butil::memory_order_seq_cst) != 0) {
+            return;
+        }
+        released->insert(released->end(), _retired_entries[prev].begin(),
+                         _retired_entries[prev].end());
+        _retired_entries[prev].clear();
+        for (size_t j = 0; j < _retired_buffers[prev].size(); ++j) {
+            delete _retired_buffers[prev][j];
+        }
+        _retired_buffers[prev].clear();
+        if (_retired_entries[epoch & 1].empty()
+                && _retired_buffers[epoch & 1].empty()) {
+            return;
+        }
+        // Readers entering afterwards can't see the ones retired so far
+        _epoch.store(epoch + 1, butil::memory_order_seq_cst);
+    }
+}
+
+}  //  namespace braft
@@ -0,0 +1,112 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_LOG_ENTRY_RING_H
+#define  BRAFT_LOG_ENTRY_RING_H
+
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+#include "braft/log_entry.h"
+
+namespace braft {
+
+// Consecutive log entries in memory indexed by log index, which grows like a
+// deque when it's full.
+//
+// Modifications must be serialized by the caller, while get() and get_term()
+// are wait-free and may run concurrently with them. Entries removed from the
+// ring are kept until no concurrent lookup could be referencing them, and
+// handed back by reclaim() then. The lookups are tracked by a global epoch
+// with two reader counters: a removed entry is safe to release once the
+// readers of the epoch it was removed in and all the epochs before are gone.
+class LogEntryRing {
+public:
+    explicit LogEntryRing(size_t initial_capacity = 1024);
+    ~LogEntryRing();
+
+    // Get the entry at |index| with a reference added for the caller, NULL if
+    // it's not in the ring
+    LogEntry* get(int64_t index) const;
+
+    // Get the term of the entry at |index|, 0 if it's not in the ring
+    int64_t get_term(int64_t index) const;
+
+    // The following methods must not be called concurrently with any
+    // modification.
+
+    bool empty() const { return size() == 0; }
+    size_t size() const {
+        return _last_index.load(butil::memory_order_relaxed)
+                - _first_index.load(butil::memory_order_relaxed) + 1;
+    }
+    int64_t first_index() const {
+        return _first_index.load(butil::memory_order_relaxed);
+    }
+    int64_t last_index() const {
+        return _last_index.load(butil::memory_order_relaxed);
+    }
+    // Total data size of the entries
+    int64_t bytes() const { return _bytes; }
+    LogEntry* front() const { return at(first_index()); }
+    LogEntry* back() const { return at(last_index()); }
+    // Entry at |index| without adding reference, NULL if it's not in the ring
+    LogEntry* at(int64_t index) const;
+
+    // Append |entry| of which the index must follow the last one, the ring
+    // takes over one reference of it
+    void push_back(LogEntry* entry);
+
+    // Remove the first or the last entry
+    void pop_front();
+    void pop_back();
+
+    // Remove all the entries
+    void clear();
+
+    // Append the removed entries which are not referenced by any lookup to
+    // |released|, of which the references are taken over by the caller
+    void reclaim(std::vector<LogEntry*>* released);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntryRing);
+
+    struct Buffer {
+        explicit Buffer(size_t capacity);
+        ~Buffer();
+        butil::atomic<LogEntry*>* slots;
+        size_t mask;
+    };
+
+    // Returns the epoch entered
+    int64_t enter() const;
+    void leave(int64_t epoch) const;
+
+    void retire(LogEntry* entry);
+    void grow();
+
+    butil::atomic<Buffer*> _buffer;
+    butil::atomic<int64_t> _first_index;
+    butil::atomic<int64_t> _last_index;
+    butil::atomic<int64_t> _epoch;
+    mutable butil::atomic<int64_t> _readers[2];
+    int64_t _bytes;
+    // Removed in the epoch of the same parity
+    std::vector<LogEntry*> _retired_entries[2];
+    std::vector<Buffer*> _retired_buffers[2];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_ENTRY_RING_H
@@ -17,6 +17,9 @@
 
 #include "braft/log_manager.h"
 
+#include <atomic>                                // std::atomic_thread_fence
+#include <algorithm>                             // std::sort
+#include <functional>                            // std::greater
 #include <butil/logging.h>                       // LOG
 #include <butil/object_pool.h>                   // butil::get_object
 #include <bthread/unstable.h>                   // bthread_flush
@@ -30,11 +33,63 @@ namespace braft {
 DEFINE_int32(raft_leader_batch, 256, "max leader io batch");
 BRPC_VALIDATE_GFLAG(raft_leader_batch, ::brpc::PositiveInteger);
 
+DEFINE_bool(raft_async_log_sync, false,
+            "Sync the appended logs in a separate queue, so that the disk "
+            "thread could write the next batch while the previous one is being "
+            "synced. Takes effect on LogManagers created afterwards");
+BRPC_VALIDATE_GFLAG(raft_async_log_sync, ::brpc::PassValidate);
+
+DEFINE_bool(raft_log_encode_ahead, false,
+            "Encode the appended logs in a separate queue ahead of the disk "
+            "thread, so that the next batch could be encoded while the previous "
+            "one is being written and synced. Takes effect on LogManagers "
+            "created afterwards");
+BRPC_VALIDATE_GFLAG(raft_log_encode_ahead, ::brpc::PassValidate);
+
+DEFINE_int32(raft_memory_log_budget_mb, 1024,
+             "Max size in MB of the logs in memory of all the LogManagers in "
+             "this process, beyond which the logs on disk of the LogManagers "
+             "holding the most are evicted even if they are not applied yet, "
+             "0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_memory_log_budget_mb, ::brpc::NonNegativeInteger);
+
+static butil::atomic<int64_t> s_memory_log_bytes(0);
+
+static int64_t get_memory_log_bytes(void*) {
+    return s_memory_log_bytes.load(butil::memory_order_relaxed);
+}
+
+static bool memory_log_over_budget() {
+    const int64_t budget = FLAGS_raft_memory_log_budget_mb * 1024L * 1024L;
+    return budget > 0
+        && s_memory_log_bytes.load(butil::memory_order_relaxed) > budget;
+}
+
+static bvar::PassiveStatus<int64_t> g_memory_log_bytes(
+            "raft_memory_log_bytes", get_memory_log_bytes, NULL);
+
+// All the LogManagers in this process, to evict the logs of the largest ones
+// first once the budget is exceeded
+static raft_mutex_t s_log_managers_mutex;
+static std::set<LogManager*> s_log_managers;
+
+static bvar::Adder<int64_t> g_read_entry_from_memory
+            ("raft_read_entry_from_memory_count");
+
 static bvar::Adder<int64_t> g_read_entry_from_storage
             ("raft_read_entry_from_storage_count");
 static bvar::PerSecond<bvar::Adder<int64_t> > g_read_entry_from_storage_second
             ("raft_read_entry_from_storage_second", &g_read_entry_from_storage);
 
+static double get_memory_log_hit_ratio(void*) {
+    const int64_t hit = g_read_entry_from_memory.get_value();
+    const int64_t total = hit + g_read_entry_from_storage.get_value();
+    return total > 0 ? (double)hit / total : 0;
+}
+
+static bvar::PassiveStatus<double> g_memory_log_hit_ratio(
+            "raft_memory_log_hit_ratio", get_memory_log_hit_ratio, NULL);
+
 static bvar::Adder<int64_t> g_read_term_from_storage
             ("raft_read_term_from_storage_count");
 static bvar::PerSecond<bvar::Adder<int64_t> > g_read_term_from_storage_second
@@ -50,6 +105,9 @@ static bvar::Adder<int64_t> g_storage_append_entries_concurrency(
 static bvar::CounterRecorder g_storage_flush_batch_counter(
                                         "raft_storage_flush_batch_counter");
 
+static bvar::LatencyRecorder g_storage_sync_entries_latency(
+                                    "raft_storage_sync_entries");
+
 
 void LogManager::StableClosure::update_metric(IOMetric* m) {
     metric.open_segment_time_us = m->open_segment_time_us;
@@ -71,8 +129,18 @@ LogManager::LogManager()
     , _next_wait_id(0)
     , _first_log_index(0)
     , _last_log_index(0)
+    , _bounds_seq(0)
+    , _memory_log_bytes(0)
+    , _flush_latency_us(0)
+    , _async_log_sync(false)
+    , _encode_ahead(false)
 {
+    for (size_t i = 0; i < ARRAY_SIZE(_bounds_words); ++i) {
+        _bounds_words[i].store(0, butil::memory_order_relaxed);
+    }
     CHECK_EQ(0, start_disk_thread());
+    BAIDU_SCOPED_LOCK(s_log_managers_mutex);
+    s_log_managers.insert(this);
 }
 
 int LogManager::init(const LogManagerOptions &options) {
@@ -96,58 +164,101 @@ int LogManager::init(const LogManagerOptions &options) {
     // Term will be 0 if the node has no logs, and we will correct the value
     // after snapshot load finish.
     _disk_id.term = _log_storage->get_term(_last_log_index);
+    _last_written_id = _disk_id;
     _fsm_caller = options.fsm_caller;
+    publish_bounds();
     return 0;
 }
 
 LogManager::~LogManager() {
-    stop_disk_thread();
-    for (size_t i = 0; i < _logs_in_memory.size(); ++i) {
-        _logs_in_memory[i]->Release();
+    {
+        BAIDU_SCOPED_LOCK(s_log_managers_mutex);
+        s_log_managers.erase(this);
     }
-    _logs_in_memory.clear();
+    stop_disk_thread();
+    // The entries are released by _logs_in_memory itself
+    s_memory_log_bytes.fetch_sub(_memory_log_bytes, butil::memory_order_relaxed);
 }
 
 int LogManager::start_disk_thread() {
+    // The sync and encode queues are only started when enabled
+    _async_log_sync = FLAGS_raft_async_log_sync;
+    _encode_ahead = FLAGS_raft_log_encode_ahead;
     bthread::ExecutionQueueOptions queue_options;
     queue_options.bthread_attr = BTHREAD_ATTR_NORMAL;
-    return bthread::execution_queue_start(&_disk_queue,
+    if (_async_log_sync && bthread::execution_queue_start(&_sync_queue,
+                                   &queue_options,
+                                   sync_thread,
+                                   this) != 0) {
+        return -1;
+    }
+    if (bthread::execution_queue_start(&_disk_queue,
                                    &queue_options,
                                    disk_thread,
-                                   this);
+                                   this) != 0) {
+        return -1;
+    }
+    if (_encode_ahead && bthread::execution_queue_start(&_encode_queue,
+                                   &queue_options,
+                                   encode_thread,
+                                   this) != 0) {
+        return -1;
+    }
+    return 0;
 }
 
 int LogManager::stop_disk_thread() {
+    // Each queue is the only producer of the next one, stop them in order so
+    // that all the pending tasks are done
+    int ret = 0;
+    if (_encode_ahead) {
+        bthread::execution_queue_stop(_encode_queue);
+        ret = bthread::execution_queue_join(_encode_queue);
+    }
     bthread::execution_queue_stop(_disk_queue);
-    return bthread::execution_queue_join(_disk_queue);
+    if (bthread::execution_queue_join(_disk_queue) != 0) {
+        ret = -1;
+    }
+    if (_async_log_sync) {
+        bthread::execution_queue_stop(_sync_queue);
+        if (bthread::execution_queue_join(_sync_queue) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
 }
 
 void LogManager::clear_memory_logs(const LogId& id) {
-    LogEntry* entries_to_clear[256];
+    const size_t max_entries_to_clear = 256;
+    std::vector<LogEntry*> entries_to_clear;
     size_t nentries = 0;
     do {
         nentries = 0;
+        entries_to_clear.clear();
         {
             BAIDU_SCOPED_LOCK(_mutex);
             while (!_logs_in_memory.empty() 
-                    && nentries < ARRAY_SIZE(entries_to_clear)) {
+                    && nentries < max_entries_to_clear) {
                 LogEntry* entry = _logs_in_memory.front();
                 if (entry->id > id) {
                     break;
                 }
-                entries_to_clear[nentries++] = entry;
+                ++nentries;
                 _logs_in_memory.pop_front();
             }
+            _logs_in_memory.reclaim(&entries_to_clear);
+            account_memory_logs();
         }  // out of _mutex
-        for (size_t i = 0; i < nentries; ++i) {
+        for (size_t i = 0; i < entries_to_clear.size(); ++i) {
             entries_to_clear[i]->Release();
         }
-    } while (nentries == ARRAY_SIZE(entries_to_clear));
+    } while (nentries == max_entries_to_clear);
 }
 
 int64_t LogManager::first_log_index() {
-    BAIDU_SCOPED_LOCK(_mutex);
-    return _first_log_index;
+    LogBounds bounds;
+    load_bounds(&bounds);
+    return bounds.first_index;
 }
 
 class LastLogIdClosure : public LogManager::StableClosure {
@@ -172,15 +283,19 @@ private:
 };
 
 int64_t LogManager::last_log_index(bool is_flush) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    LogBounds bounds;
+    load_bounds(&bounds);
     if (!is_flush) {
-        return _last_log_index;
+        return bounds.last_index;
     } else {
-        if (_last_log_index == _last_snapshot_id.index) {
-            return _last_log_index;
+        if (bounds.last_index == bounds.last_snapshot_id.index
+                || bounds.last_log_id == bounds.disk_id) {
+            // Nothing to flush
+            return bounds.last_index;
         }
+        std::unique_lock<raft_mutex_t> lck(_mutex);
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, submit_to_disk(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id().index;
@@ -188,18 +303,20 @@ int64_t LogManager::last_log_index(bool is_flush) {
 }
 
 LogId LogManager::last_log_id(bool is_flush) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    LogBounds bounds;
+    load_bounds(&bounds);
     if (!is_flush) {
-        if (_last_log_index >= _first_log_index) {
-            return LogId(_last_log_index, unsafe_get_term(_last_log_index));
-        }
-        return _last_snapshot_id;
+        return bounds.last_log_id;
     } else {
-        if (_last_log_index == _last_snapshot_id.index) {
-            return _last_snapshot_id;
+        if (bounds.last_index == bounds.last_snapshot_id.index) {
+            return bounds.last_snapshot_id;
         }
+        if (bounds.last_log_id == bounds.disk_id) {
+            return bounds.last_log_id;
+        }
+        std::unique_lock<raft_mutex_t> lck(_mutex);
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, submit_to_disk(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id();
@@ -250,7 +367,7 @@ private:
 
 int LogManager::truncate_prefix(const int64_t first_index_kept,
                                 std::unique_lock<raft_mutex_t>& lck) {
-    std::deque<LogEntry*> saved_logs_in_memory;
+    std::vector<LogEntry*> saved_logs_in_memory;
     // As the duration between two snapshot (which leads to truncate_prefix at
     // last) is likely to be a long period, _logs_in_memory is likely to
     // contain a large amount of logs to release, which holds the mutex so that
@@ -263,7 +380,6 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
     while (!_logs_in_memory.empty()) {
         LogEntry* entry = _logs_in_memory.front();
         if (entry->id.index < first_index_kept) {
-            saved_logs_in_memory.push_back(entry);
             _logs_in_memory.pop_front();
         } else {
             break;
@@ -275,9 +391,12 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
         // The entrie log is dropped
         _last_log_index = first_index_kept - 1;
     }
+    _logs_in_memory.reclaim(&saved_logs_in_memory);
+    account_memory_logs();
+    publish_bounds();
     _config_manager->truncate_prefix(first_index_kept);
     TruncatePrefixClosure* c = new TruncatePrefixClosure(first_index_kept);
-    const int rc = bthread::execution_queue_execute(_disk_queue, c);
+    const int rc = submit_to_disk(c);
     lck.unlock();
     for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
         saved_logs_in_memory[i]->Release();
@@ -288,14 +407,17 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
 int LogManager::reset(const int64_t next_log_index,
                       std::unique_lock<raft_mutex_t>& lck) {
     CHECK(lck.owns_lock());
-    std::deque<LogEntry*> saved_logs_in_memory;
-    saved_logs_in_memory.swap(_logs_in_memory);
+    std::vector<LogEntry*> saved_logs_in_memory;
+    _logs_in_memory.clear();
+    _logs_in_memory.reclaim(&saved_logs_in_memory);
+    account_memory_logs();
     _first_log_index = next_log_index;
     _last_log_index = next_log_index - 1;
+    publish_bounds();
     _config_manager->truncate_prefix(_first_log_index);
     _config_manager->truncate_suffix(_last_log_index);
     ResetClosure* c = new ResetClosure(next_log_index);
-    const int ret = bthread::execution_queue_execute(_disk_queue, c);
+    const int ret = submit_to_disk(c);
     lck.unlock();
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
     for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
@@ -315,12 +437,16 @@ void LogManager::unsafe_truncate_suffix(const int64_t last_index_kept) {
     while (!_logs_in_memory.empty()) {
         LogEntry* entry = _logs_in_memory.back();
         if (entry->id.index > last_index_kept) {
-            entry->Release();
             _logs_in_memory.pop_back();
         } else {
             break;
         }
     }
+    std::vector<LogEntry*> released;
+    _logs_in_memory.reclaim(&released);
+    for (size_t i = 0; i < released.size(); ++i) {
+        released[i]->Release();
+    }
     _last_log_index = last_index_kept;
     const int64_t last_term_kept = unsafe_get_term(last_index_kept);
     CHECK(last_index_kept == 0 || last_term_kept != 0)
@@ -328,7 +454,7 @@ void LogManager::unsafe_truncate_suffix(const int64_t last_index_kept) {
     _config_manager->truncate_suffix(last_index_kept);
     TruncateSuffixClosure* tsc = new
             TruncateSuffixClosure(last_index_kept, last_term_kept);
-    CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, tsc));
+    CHECK_EQ(0, submit_to_disk(tsc));
 }
 
 int LogManager::check_and_resolve_conflict(
@@ -437,13 +563,17 @@ void LogManager::append_entries(
 
     if (!entries->empty()) {
         done->_first_log_index = entries->front()->id.index;
-        _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+        for (size_t i = 0; i < entries->size(); ++i) {
+            _logs_in_memory.push_back((*entries)[i]);
+        }
     }
 
+    account_memory_logs();
+    publish_bounds();
     done->_entries.swap(*entries);
-    int ret = bthread::execution_queue_execute(_disk_queue, done);
+    int ret = submit_to_disk(done);
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
-    wakeup_all_waiter(lck);
+    wakeup_waiters(lck);
 }
 
 void LogManager::append_to_storage(std::vector<LogEntry*>* to_append, 
@@ -456,7 +586,9 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
         butil::Timer timer;
         timer.start();
         g_storage_append_entries_concurrency << 1;
-        int nappent = _log_storage->append_entries(*to_append, metric);
+        int nappent = _async_log_sync
+                ? _log_storage->append_entries_nosync(*to_append, metric)
+                : _log_storage->append_entries(*to_append, metric);
         g_storage_append_entries_concurrency << -1;
         timer.stop();
         if (nappent != (int)to_append->size()) {
@@ -470,6 +602,9 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
             *last_id = (*to_append)[nappent - 1]->id;
         }
         g_storage_append_entries_latency << timer.u_elapsed();
+        if (!_async_log_sync) {
+            record_flush_latency(timer.u_elapsed());
+        }
         if (written_size) {
             g_nomralized_append_entries_latency << timer.u_elapsed() * 1024 / written_size;
         }
@@ -480,6 +615,96 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
     to_append->clear();
 }
 
+void LogManager::run_stable_closures(StableClosure* const closures[],
+                                     size_t size, IOMetric* metric) {
+    for (size_t i = 0; i < size; ++i) {
+        closures[i]->_entries.clear();
+        if (_has_error.load(butil::memory_order_relaxed)) {
+            closures[i]->status().set_error(
+                    EIO, "Corrupted LogStorage");
+        }
+        closures[i]->update_metric(metric);
+        closures[i]->Run();
+    }
+}
+
+void LogManager::record_flush_latency(int64_t latency_us) {
+    // Only written by the disk thread or the sync thread
+    const int64_t avg = _flush_latency_us.load(butil::memory_order_relaxed);
+    _flush_latency_us.store(avg == 0 ? latency_us : (avg * 7 + latency_us) / 8,
+                            butil::memory_order_relaxed);
+}
+
+struct LogManager::SyncTask {
+    SyncTask() : done(NULL) {}
+    std::vector<StableClosure*> closures;
+    LogId last_id;
+    IOMetric metric;
+    // Not NULL for the barrier issued by wait_for_sync()
+    Closure* done;
+};
+
+void LogManager::wait_for_sync() {
+    SynchronizedClosure done;
+    SyncTask* task = new SyncTask;
+    task->done = &done;
+    CHECK_EQ(0, bthread::execution_queue_execute(_sync_queue, task));
+    done.wait();
+}
+
+int LogManager::sync_thread(void* meta,
+                            bthread::TaskIterator<SyncTask*>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    LogManager* log_manager = static_cast<LogManager*>(meta);
+    std::vector<SyncTask*> tasks;
+    bool has_entries = false;
+    for (; iter; ++iter) {
+        tasks.push_back(*iter);
+        has_entries = has_entries || !(*iter)->closures.empty();
+    }
+    // All the tasks in this round were written before, a single sync makes
+    // them durable together
+    int64_t sync_time_us = 0;
+    bool synced = false;
+    if (has_entries && !log_manager->_has_error.load(butil::memory_order_relaxed)) {
+        butil::Timer timer;
+        timer.start();
+        const int ret = log_manager->_log_storage->sync_entries();
+        timer.stop();
+        sync_time_us = timer.u_elapsed();
+        g_storage_sync_entries_latency << sync_time_us;
+        log_manager->record_flush_latency(sync_time_us);
+        if (ret != 0) {
+            log_manager->report_error(EIO, "Fail to sync entries");
+        } else {
+            synced = true;
+        }
+    }
+    LogId last_id;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        SyncTask* task = tasks[i];
+        if (task->closures.empty()) {
+            continue;
+        }
+        last_id = task->last_id;
+        task->metric.sync_segment_time_us += sync_time_us;
+        log_manager->run_stable_closures(
+                &task->closures[0], task->closures.size(), &task->metric);
+    }
+    if (synced) {
+        log_manager->set_disk_id(last_id);
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (tasks[i]->done) {
+            tasks[i]->done->Run();
+        }
+        delete tasks[i];
+    }
+    return 0;
+}
+
 DEFINE_int32(raft_max_append_buffer_size, 256 * 1024, 
              "Flush buffer to LogStorage if the buffer size reaches the limit");
 
@@ -503,14 +728,16 @@ public:
             IOMetric metric;
             _lm->append_to_storage(&_to_append, _last_id, &metric);
             g_storage_flush_batch_counter << _size;
-            for (size_t i = 0; i < _size; ++i) {
-                _storage[i]->_entries.clear();
-                if (_lm->_has_error.load(butil::memory_order_relaxed)) {
-                    _storage[i]->status().set_error(
-                            EIO, "Corrupted LogStorage");
-                }
-                _storage[i]->update_metric(&metric);
-                _storage[i]->Run();
+            if (_lm->_async_log_sync) {
+                // The closures are called after the entries are synced
+                LogManager::SyncTask* task = new LogManager::SyncTask;
+                task->closures.assign(_storage, _storage + _size);
+                task->last_id = *_last_id;
+                task->metric = metric;
+                CHECK_EQ(0, bthread::execution_queue_execute(
+                                    _lm->_sync_queue, task));
+            } else {
+                _lm->run_stable_closures(_storage, _size, &metric);
             }
             _to_append.clear();
         }
@@ -540,6 +767,30 @@ private:
     LogManager* _lm;
 };
 
+int LogManager::submit_to_disk(StableClosure* done) {
+    return bthread::execution_queue_execute(
+            _encode_ahead ? _encode_queue : _disk_queue, done);
+}
+
+int LogManager::encode_thread(void* meta,
+                              bthread::TaskIterator<StableClosure*>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    LogManager* log_manager = static_cast<LogManager*>(meta);
+    for (; iter; ++iter) {
+        StableClosure* done = *iter;
+        if (!done->_entries.empty()
+                && !log_manager->_has_error.load(butil::memory_order_relaxed)) {
+            log_manager->_log_storage->prepare_entries(done->_entries);
+        }
+        // The disk thread writes them in the same order
+        CHECK_EQ(0, bthread::execution_queue_execute(
+                            log_manager->_disk_queue, done));
+    }
+    return 0;
+}
+
 int LogManager::disk_thread(void* meta,
                             bthread::TaskIterator<StableClosure*>& iter) {
     if (iter.is_queue_stopped()) {
@@ -547,8 +798,10 @@ int LogManager::disk_thread(void* meta,
     }
 
     LogManager* log_manager = static_cast<LogManager*>(meta);
+    const bool async_log_sync = log_manager->_async_log_sync;
     // FIXME(chenzhangyi01): it's buggy
-    LogId last_id = log_manager->_disk_id;
+    LogId last_id = async_log_sync ? log_manager->_last_written_id
+                                   : log_manager->_disk_id;
     StableClosure* storage[256];
     AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, log_manager);
     
@@ -562,6 +815,10 @@ int LogManager::disk_thread(void* meta,
             ab.append(done);
         } else {
             ab.flush();
+            if (async_log_sync) {
+                // Operations below must see all the written logs durable
+                log_manager->wait_for_sync();
+            }
             int ret = 0;
             do {
                 LastLogIdClosure* llic =
@@ -615,7 +872,12 @@ int LogManager::disk_thread(void* meta,
     }
     CHECK(!iter) << "Must iterate to the end";
     ab.flush();
-    log_manager->set_disk_id(last_id);
+    if (async_log_sync) {
+        // disk_id is updated by the sync thread
+        log_manager->_last_written_id = last_id;
+    } else {
+        log_manager->set_disk_id(last_id);
+    }
     return 0;
 }
 
@@ -668,6 +930,8 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
             // We have last snapshot index
             _virtual_first_log_id = last_but_one_snapshot_id;
             truncate_prefix(last_but_one_snapshot_id.index + 1, lck);
+        } else {
+            publish_bounds();
         }
         return;
     } else {
@@ -688,16 +952,7 @@ void LogManager::clear_bufferred_logs() {
 }
 
 LogEntry* LogManager::get_entry_from_memory(const int64_t index) {
-    LogEntry* entry = NULL;
-    if (!_logs_in_memory.empty()) {
-        int64_t first_index = _logs_in_memory.front()->id.index;
-        int64_t last_index = _logs_in_memory.back()->id.index;
-        CHECK_EQ(last_index - first_index + 1, static_cast<int64_t>(_logs_in_memory.size()));
-        if (index >= first_index && index <= last_index) {
-            entry = _logs_in_memory[index - first_index];
-        }
-    }
-    return entry;
+    return _logs_in_memory.at(index);
 }
 
 int64_t LogManager::unsafe_get_term(const int64_t index) {
@@ -727,36 +982,130 @@ int64_t LogManager::unsafe_get_term(const int64_t index) {
     return _log_storage->get_term(index);
 }
 
+void LogManager::account_memory_logs() {
+    const int64_t bytes = _logs_in_memory.bytes();
+    s_memory_log_bytes.fetch_add(bytes - _memory_log_bytes,
+                                 butil::memory_order_relaxed);
+    _memory_log_bytes = bytes;
+}
+
+void LogManager::evict_memory_logs() {
+    std::unique_lock<raft_mutex_t> lck(s_log_managers_mutex, std::try_to_lock);
+    if (!lck.owns_lock()) {
+        // Some other thread is evicting
+        return;
+    }
+    std::vector<std::pair<int64_t, LogManager*> > managers;
+    managers.reserve(s_log_managers.size());
+    for (std::set<LogManager*>::iterator
+            it = s_log_managers.begin(); it != s_log_managers.end(); ++it) {
+        BAIDU_SCOPED_LOCK((*it)->_mutex);
+        managers.push_back(std::make_pair((*it)->_memory_log_bytes, *it));
+    }
+    std::sort(managers.begin(), managers.end(),
+              std::greater<std::pair<int64_t, LogManager*> >());
+    for (size_t i = 0; i < managers.size() && memory_log_over_budget(); ++i) {
+        LogManager* lm = managers[i].second;
+        std::unique_lock<raft_mutex_t> lm_lck(lm->_mutex);
+        const LogId disk_id = lm->_disk_id;
+        lm_lck.unlock();
+        // Evict the logs on disk even if they are not applied yet, which
+        // would be read from storage then
+        lm->clear_memory_logs(disk_id);
+    }
+}
+
+void LogManager::publish_bounds() {
+    _bounds.first_index = _first_log_index;
+    _bounds.last_index = _last_log_index;
+    if (_last_log_index >= _first_log_index) {
+        _bounds.last_log_id = LogId(_last_log_index,
+                                    unsafe_get_term(_last_log_index));
+    } else {
+        _bounds.last_log_id = _last_snapshot_id;
+    }
+    _bounds.disk_id = _disk_id;
+    _bounds.last_snapshot_id = _last_snapshot_id;
+    _bounds.virtual_first_log_id = _virtual_first_log_id;
+    store_bounds();
+}
+
+void LogManager::store_bounds() {
+    BAIDU_CASSERT(sizeof(LogBounds) % sizeof(int64_t) == 0,
+                  sizeof_LogBounds_must_be_multiple_of_int64);
+    int64_t words[ARRAY_SIZE(_bounds_words)];
+    memcpy(words, &_bounds, sizeof(words));
+    const int64_t seq = _bounds_seq.load(butil::memory_order_relaxed);
+    _bounds_seq.store(seq + 1, butil::memory_order_relaxed);
+    std::atomic_thread_fence(butil::memory_order_release);
+    for (size_t i = 0; i < ARRAY_SIZE(words); ++i) {
+        _bounds_words[i].store(words[i], butil::memory_order_relaxed);
+    }
+    _bounds_seq.store(seq + 2, butil::memory_order_release);
+}
+
+void LogManager::load_bounds(LogBounds* bounds) const {
+    int64_t words[ARRAY_SIZE(_bounds_words)];
+    while (true) {
+        const int64_t seq = _bounds_seq.load(butil::memory_order_acquire);
+        if (seq & 1) {
+            // Being written, which is done with a few stores
+            continue;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(words); ++i) {
+            words[i] = _bounds_words[i].load(butil::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(butil::memory_order_acquire);
+        if (_bounds_seq.load(butil::memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+    memcpy(bounds, words, sizeof(words));
+}
+
 int64_t LogManager::get_term(const int64_t index) {
     if (index == 0) {
         return 0;
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    // Fast path for the entries in memory
+    int64_t term = _logs_in_memory.get_term(index);
+    if (term != 0) {
+        return term;
+    }
+    LogBounds bounds;
+    load_bounds(&bounds);
     // check virtual first log
-    if (index == _virtual_first_log_id.index) {
-        return _virtual_first_log_id.term;
+    if (index == bounds.virtual_first_log_id.index) {
+        return bounds.virtual_first_log_id.term;
     }
     // check last_snapshot_id
-    if (index == _last_snapshot_id.index) {
-        return _last_snapshot_id.term;
+    if (index == bounds.last_snapshot_id.index) {
+        return bounds.last_snapshot_id.term;
     }
     // out of range, direct return NULL
     // check this after check last_snapshot_id, because it is likely that
     // last_snapshot_id < first_log_index
-    if (index > _last_log_index || index < _first_log_index) {
+    if (index > bounds.last_index || index < bounds.first_index) {
         return 0;
     }
-
-    LogEntry* entry = get_entry_from_memory(index);
-    if (entry) {
-        return entry->id.term;
+    // The entry might be appended after the first lookup, as the bounds are
+    // published after the entries. Or it's evicted from memory and must be
+    // in storage then
+    term = _logs_in_memory.get_term(index);
+    if (term != 0) {
+        return term;
     }
-    lck.unlock();
     g_read_term_from_storage << 1;
     return _log_storage->get_term(index);
 }
 
 LogEntry* LogManager::get_entry(const int64_t index) {
+    // Fast path without _mutex for the entries in memory
+    LogEntry* entry = _logs_in_memory.get(index);
+    if (entry) {
+        g_read_entry_from_memory << 1;
+        return entry;
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
 
     // out of range, direct return NULL
@@ -764,9 +1113,10 @@ LogEntry* LogManager::get_entry(const int64_t index) {
         return NULL;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    entry = get_entry_from_memory(index);
     if (entry) {
         entry->AddRef();
+        g_read_entry_from_memory << 1;
         return entry;
     }
     lck.unlock();
@@ -778,6 +1128,45 @@ LogEntry* LogManager::get_entry(const int64_t index) {
     return entry;
 }
 
+int LogManager::get_entries(const int64_t first_index, int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+
+    // out of range, direct return
+    if (first_index > _last_log_index || first_index < _first_log_index) {
+        return 0;
+    }
+    last_index = std::min(last_index, _last_log_index);
+    if (get_entry_from_memory(first_index) != NULL) {
+        size_t bytes = 0;
+        int64_t index = first_index;
+        for (; index <= last_index && (index == first_index || bytes < max_bytes);
+                ++index) {
+            LogEntry* entry = get_entry_from_memory(index);
+            if (entry == NULL) {
+                break;
+            }
+            entry->AddRef();
+            bytes += entry->data.length();
+            entries->push_back(entry);
+        }
+        g_read_entry_from_memory << (index - first_index);
+        return index - first_index;
+    }
+    // Read the ones evicted from memory
+    if (!_logs_in_memory.empty()) {
+        last_index = std::min(last_index, _logs_in_memory.first_index() - 1);
+    }
+    lck.unlock();
+    const int n = _log_storage->get_entries(first_index, last_index, 
+                                            max_bytes, entries);
+    g_read_entry_from_storage << n;
+    if (n <= 0) {
+        report_error(EIO, "Corrupted entry at index=%" PRId64, first_index);
+    }
+    return n;
+}
+
 void LogManager::get_configuration(const int64_t index, ConfigurationEntry* conf) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _config_manager->get(index, conf);
@@ -804,9 +1193,14 @@ void LogManager::set_disk_id(const LogId& disk_id) {
         return;
     }
     _disk_id = disk_id;
+    _bounds.disk_id = disk_id;
+    store_bounds();
     LogId clear_id = std::min(_disk_id, _applied_id);
     lck.unlock();
-    return clear_memory_logs(clear_id);
+    clear_memory_logs(clear_id);
+    if (memory_log_over_budget()) {
+        evict_memory_logs();
+    }
 }
 
 void LogManager::set_applied_id(const LogId& applied_id) {
@@ -823,13 +1217,17 @@ void LogManager::set_applied_id(const LogId& applied_id) {
 void LogManager::shutdown() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     _stopped = true;
-    wakeup_all_waiter(lck);
+    wakeup_waiters(lck);
 }
 
 void* LogManager::run_on_new_log(void *arg) {
     WaitMeta* wm = (WaitMeta*)arg;
-    wm->on_new_log(wm->arg, wm->error_code);
-    butil::return_object(wm);
+    while (wm) {
+        WaitMeta* next = wm->next;
+        wm->on_new_log(wm->arg, wm->error_code);
+        butil::return_object(wm);
+        wm = next;
+    }
     return NULL;
 }
 
@@ -845,6 +1243,8 @@ LogManager::WaitId LogManager::wait(
     wm->on_new_log = on_new_log;
     wm->arg = arg;
     wm->error_code = 0;
+    wm->expected_last_log_index = expected_last_log_index;
+    wm->next = NULL;
     return notify_on_new_log(expected_last_log_index, wm);
 }
 
@@ -866,6 +1266,7 @@ LogManager::WaitId LogManager::notify_on_new_log(
     }
     const int wait_id = _next_wait_id++;
     _wait_map[wait_id] = wm;
+    _wait_index.insert(std::make_pair(expected_last_log_index, wait_id));
     return wait_id;
 }
 
@@ -877,6 +1278,7 @@ int LogManager::remove_waiter(WaitId id) {
         if (pwm) {
             wm = *pwm;
             _wait_map.erase(id);
+            _wait_index.erase(std::make_pair(wm->expected_last_log_index, id));
         }
     }
     if (wm) {
@@ -885,31 +1287,55 @@ int LogManager::remove_waiter(WaitId id) {
     return wm ? 0 : -1;
 }
 
-void LogManager::wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck) {
-    if (_wait_map.empty()) {
+void LogManager::wakeup_waiters(std::unique_lock<raft_mutex_t>& lck) {
+    if (_wait_index.empty()) {
         return;
     }
-    WaitMeta* wm[_wait_map.size()];
-    size_t nwm = 0;
-    for (butil::FlatMap<int64_t, WaitMeta*>::const_iterator
-            iter = _wait_map.begin(); iter != _wait_map.end(); ++iter) {
-        wm[nwm++] = iter->second;
+    // The waiters of _last_log_index keep waiting, the ones before are
+    // satisfied and the ones after were waiting for the truncated logs
+    WaitMeta* head = NULL;
+    WaitMeta** tail = &head;
+    std::set<std::pair<int64_t, WaitId> >::iterator it = _wait_index.begin();
+    while (it != _wait_index.end()) {
+        if (!_stopped && it->first == _last_log_index) {
+            it = _wait_index.lower_bound(
+                    std::make_pair(_last_log_index + 1, (WaitId)0));
+            continue;
+        }
+        WaitMeta** pwm = _wait_map.seek(it->second);
+        CHECK(pwm);
+        *tail = *pwm;
+        tail = &(*pwm)->next;
+        _wait_map.erase(it->second);
+        _wait_index.erase(it++);
+    }
+    *tail = NULL;
+    if (head == NULL) {
+        return;
     }
-    _wait_map.clear();
     const int error_code = _stopped ? ESTOP : 0;
     lck.unlock();
-    for (size_t i = 0; i < nwm; ++i) {
-        wm[i]->error_code = error_code;
+    // The callbacks may block (e.g. on the lock of a replicator), so the woken
+    // waiters are cut into short chains run in different bthreads, each of
+    // which doesn't delay too many others
+    const int kMaxWaitersPerBthread = 8;
+    while (head) {
+        WaitMeta* chain = head;
+        WaitMeta* last = head;
+        last->error_code = error_code;
+        for (int n = 1; n < kMaxWaitersPerBthread && last->next; ++n) {
+            last = last->next;
+            last->error_code = error_code;
+        }
+        head = last->next;
+        last->next = NULL;
         bthread_t tid;
-        bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
-        if (bthread_start_background(
-                    &tid, &attr,
-                    run_on_new_log, wm[i]) != 0) {
+        bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+        if (bthread_start_background(&tid, &attr, run_on_new_log, chain) != 0) {
             PLOG(ERROR) << "Fail to start bthread";
-            run_on_new_log(wm[i]);
+            run_on_new_log(chain);
         }
     }
-    bthread_flush();
 }
 
 void LogManager::describe(std::ostream& os, bool use_html) {
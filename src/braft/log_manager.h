@@ -20,12 +20,13 @@
 
 #include <butil/macros.h>                        // BAIDU_CACHELINE_ALIGNMENT
 #include <butil/containers/flat_map.h>           // butil::FlatMap
-#include <deque>                                // std::deque
+#include <set>                                  // std::set
 #include <bthread/execution_queue.h>            // bthread::ExecutionQueueId
 
 #include "braft/raft.h"                          // Closure
 #include "braft/util.h"                          // raft_mutex_t
 #include "braft/log_entry.h"                     // LogEntry
+#include "braft/log_entry_ring.h"                // LogEntryRing
 #include "braft/configuration_manager.h"         // ConfigurationManager
 #include "braft/storage.h"                       // Storage
 
@@ -94,6 +95,13 @@ public:
     //  success return ptr, fail return null
     LogEntry* get_entry(const int64_t index);
 
+    // Get the logs in [first_index, last_index] until their data reaches
+    // |max_bytes|, the evicted ones are read from storage in batch. 
+    // Returns the number of logs appended to |entries|, which are referenced
+    // for the caller
+    int get_entries(const int64_t first_index, const int64_t last_index,
+                    size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // Get the log term at |index|
     // Returns:
     //  success return term > 0, fail return 0
@@ -149,18 +157,63 @@ public:
     // Get the internal status of LogManager.
     void get_status(LogManagerStatus* status);
 
+    // Moving average of the time spent on making logs durable, i.e. the
+    // append when logs are synced inline or the sync otherwise, in us
+    int64_t flush_latency_us() const {
+        return _flush_latency_us.load(butil::memory_order_relaxed);
+    }
+
 private:
 friend class AppendBatcher;
     struct WaitMeta {
         int (*on_new_log)(void *arg, int error_code);
         void* arg;
         int error_code;
+        int64_t expected_last_log_index;
+        // Next one woken up in the same batch
+        WaitMeta* next;
+    };
+
+    struct SyncTask;
+
+    // The bounds of the log, which are published through a seqlock so that
+    // they can be read without _mutex
+    struct LogBounds {
+        LogBounds() : first_index(0), last_index(0) {}
+        int64_t first_index;
+        int64_t last_index;
+        LogId last_log_id;
+        LogId disk_id;
+        LogId last_snapshot_id;
+        LogId virtual_first_log_id;
     };
 
     void append_to_storage(std::vector<LogEntry*>* to_append, LogId* last_id, IOMetric* metric);
 
+    void run_stable_closures(StableClosure* const closures[], size_t size,
+                             IOMetric* metric);
+
+    void record_flush_latency(int64_t latency_us);
+
     static int disk_thread(void* meta,
                            bthread::TaskIterator<StableClosure*>& iter);
+
+    // Encode the appended logs with LogStorage::prepare_entries() and pass
+    // everything to the disk thread, used when FLAGS_raft_log_encode_ahead
+    // is on
+    static int encode_thread(void* meta,
+                             bthread::TaskIterator<StableClosure*>& iter);
+
+    // Queue |done| to the disk thread, through the encode thread if it's on
+    int submit_to_disk(StableClosure* done);
+
+    // Sync the entries written by the disk thread and run the corresponding
+    // closures, used when FLAGS_raft_async_log_sync is on
+    static int sync_thread(void* meta,
+                           bthread::TaskIterator<SyncTask*>& iter);
+
+    // Block the disk thread until all the syncs queued before are done
+    void wait_for_sync();
     
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     // Returns:
@@ -171,8 +224,8 @@ friend class AppendBatcher;
     int reset(const int64_t next_log_index,
               std::unique_lock<raft_mutex_t>& lck);
 
-    // Must be called in the disk thread, otherwise the
-    // behavior is undefined
+    // Must be called in the disk thread (or the sync thread when syncing
+    // asynchronously), otherwise the behavior is undefined
     void set_disk_id(const LogId& disk_id);
 
     LogEntry* get_entry_from_memory(const int64_t index);
@@ -189,11 +242,28 @@ friend class AppendBatcher;
 
     int64_t unsafe_get_term(const int64_t index);
 
+    // Account the size of _logs_in_memory to the process, with _mutex held
+    void account_memory_logs();
+
+    // Evict the logs on disk of the LogManagers holding the most logs in
+    // memory until the process is within -raft_memory_log_budget_mb
+    static void evict_memory_logs();
+
+    // Update _bounds from the fields and publish it, with _mutex held
+    void publish_bounds();
+    // Publish _bounds, with _mutex held
+    void store_bounds();
+    void load_bounds(LogBounds* bounds) const;
+
     // Start a independent thread to append log to LogStorage
     int start_disk_thread();
     int stop_disk_thread();
 
-    void wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck);
+    // Wake up the waiters of which the expected last log index is no longer
+    // the last one, or all of them if stopped. Callbacks of the woken waiters
+    // run in one bthread
+    void wakeup_waiters(std::unique_lock<raft_mutex_t>& lck);
+    // Run the callbacks of the waiters linked from |arg|
     static void *run_on_new_log(void* arg);
 
     void report_error(int error_code, const char* fmt, ...);
@@ -206,14 +276,19 @@ friend class AppendBatcher;
 
     raft_mutex_t _mutex;
     butil::FlatMap<int64_t, WaitMeta*> _wait_map;
+    // The waiters in _wait_map ordered by the expected last log index
+    std::set<std::pair<int64_t, WaitId> > _wait_index;
     bool _stopped;
     butil::atomic<bool> _has_error;
     WaitId _next_wait_id;
 
     LogId _disk_id;
+    // The last log written to storage which might not be synced yet, only
+    // accessed in the disk thread
+    LogId _last_written_id;
     LogId _applied_id;
-    // TODO(chenzhangyi01): replace deque with a thread-safe data structure
-    std::deque<LogEntry* /*FIXME*/> _logs_in_memory;
+    // Modified with _mutex held, looked up without it
+    LogEntryRing _logs_in_memory;
     int64_t _first_log_index;
     int64_t _last_log_index;
     // the last snapshot's log_id
@@ -225,7 +300,23 @@ friend class AppendBatcher;
     // or may cause some unexpect cases
     LogId _virtual_first_log_id;
 
+    // Copy of the fields above published to _bounds_words, written with
+    // _mutex held. _bounds_seq is odd while the words are being written
+    LogBounds _bounds;
+    butil::atomic<int64_t> _bounds_seq;
+    butil::atomic<int64_t> _bounds_words[sizeof(LogBounds) / sizeof(int64_t)];
+
+    // Size of _logs_in_memory accounted to the process
+    int64_t _memory_log_bytes;
+
+    butil::atomic<int64_t> _flush_latency_us;
+
+    bool _async_log_sync;
+    bool _encode_ahead;
+
+    bthread::ExecutionQueueId<StableClosure*> _encode_queue;
     bthread::ExecutionQueueId<StableClosure*> _disk_queue;
+    bthread::ExecutionQueueId<SyncTask*> _sync_queue;
 };
 
 }  //  namespace braft
@@ -32,6 +32,7 @@
 #include "braft/builtin_service_impl.h"
 #include "braft/node_manager.h"
 #include "braft/snapshot_executor.h"
+#include "braft/peer_failure_detector.h"
 #include "braft/errno.pb.h"
 
 namespace braft {
@@ -46,7 +47,8 @@ BRPC_VALIDATE_GFLAG(raft_step_down_when_vote_timedout, brpc::PassValidate);
 
 DEFINE_bool(raft_enable_append_entries_cache, false,
             "enable cache for out-of-order append entries requests, should used when "
-            "pipeline replication is enabled (raft_max_parallel_append_entries_rpc_num > 1).");
+            "pipeline replication is enabled (raft_max_parallel_append_entries_rpc_num > 1 "
+            "or raft_adaptive_pipeline_window).");
 BRPC_VALIDATE_GFLAG(raft_enable_append_entries_cache, ::brpc::PassValidate);
 
 DEFINE_int32(raft_max_append_entries_cache_size, 8,
@@ -61,6 +63,12 @@ DEFINE_bool(raft_trace_append_entry_latency, false,
             "trace append entry latency");
 BRPC_VALIDATE_GFLAG(raft_trace_append_entry_latency, brpc::PassValidate);
 
+DEFINE_int32(raft_quiescent_idle_ms, 0,
+             "A leader without any new log for this long, of which all the "
+             "followers have caught up, stops the heartbeats until the next "
+             "apply or wake_up, 0 to disable. All the peers must support it");
+BRPC_VALIDATE_GFLAG(raft_quiescent_idle_ms, brpc::NonNegativeInteger);
+
 DECLARE_bool(raft_enable_leader_lease);
 
 #ifndef UNIT_TEST
@@ -72,6 +80,10 @@ bvar::Adder<int64_t> g_num_nodes("raft_node_count");
 
 static bvar::CounterRecorder g_apply_tasks_batch_counter(
         "raft_apply_tasks_batch_counter");
+static bvar::CounterRecorder g_apply_tasks_batch_bytes(
+        "raft_apply_tasks_batch_bytes");
+static bvar::Adder<int64_t> g_apply_rejected_count(
+        "raft_apply_rejected_count");
 
 int SnapshotTimer::adjust_timeout_ms(int timeout_ms) {
     if (!_first_schedule) {
@@ -150,10 +162,19 @@ NodeImpl::NodeImpl(const GroupId& group_id, const PeerId& peer_id)
     , _stop_transfer_arg(NULL)
     , _vote_triggered(false)
     , _waking_candidate(0)
+    , _apply_batch_size(0)
+    , _apply_batch_base_latency_us(0)
+    , _apply_queue_tasks(0)
+    , _apply_queue_bytes(0)
+    , _apply_rejected_count(0)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
     , _node_readonly(false)
-    , _majority_nodes_readonly(false) {
+    , _majority_nodes_readonly(false)
+    , _quiescent(false)
+    , _idle_check_index(0)
+    , _idle_since_ms(0)
+    , _wake_up_time_ms(0) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
     AddRef();
     g_num_nodes << 1;
@@ -176,10 +197,19 @@ NodeImpl::NodeImpl()
     , _stop_transfer_arg(NULL)
     , _vote_triggered(false)
     , _waking_candidate(0)
+    , _apply_batch_size(0)
+    , _apply_batch_base_latency_us(0)
+    , _apply_queue_tasks(0)
+    , _apply_queue_bytes(0)
+    , _apply_rejected_count(0)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
     , _node_readonly(false)
-    , _majority_nodes_readonly(false) {
+    , _majority_nodes_readonly(false)
+    , _quiescent(false)
+    , _idle_check_index(0)
+    , _idle_since_ms(0)
+    , _wake_up_time_ms(0) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
     AddRef();
     g_num_nodes << 1;
@@ -495,6 +525,13 @@ int NodeImpl::init(const NodeOptions& options) {
         return -1;
     }
 
+    if (options.initial_conf.size() > BallotVoters::MAX_PEERS) {
+        LOG(ERROR) << "Group " << _group_id << " initial_conf="
+                   << options.initial_conf << " has more than "
+                   << BallotVoters::MAX_PEERS << " peers";
+        return -1;
+    }
+
     CHECK_EQ(0, _vote_timer.init(this, options.election_timeout_ms + options.max_clock_drift_ms));
     CHECK_EQ(0, _election_timer.init(this, options.election_timeout_ms));
     CHECK_EQ(0, _stepdown_timer.init(this, options.election_timeout_ms));
@@ -642,31 +679,153 @@ DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
                                    " in a single batch");
 BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
 
+DEFINE_int32(raft_max_apply_batch, 256,
+             "Max number of tasks in a single batch that the batches grow to "
+             "from -raft_apply_batch while tasks pile up in the apply queue");
+BRPC_VALIDATE_GFLAG(raft_max_apply_batch, ::brpc::PositiveInteger);
+
+DEFINE_int64(raft_apply_batch_bytes, 4 * 1024 * 1024,
+             "Max total data size of the tasks applied in a single batch, "
+             "a larger task is applied alone");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_bytes, ::brpc::PositiveInteger);
+
+DEFINE_int64(raft_apply_batch_flush_latency_us, 0,
+             "Shrink the batches of applied tasks while the disk takes longer "
+             "than this to make logs durable, 0 to shrink them back toward "
+             "-raft_apply_batch while the disk takes twice as long as it does "
+             "with batches of that size");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_flush_latency_us,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_pending_apply_tasks, 0,
+             "Max number of tasks applied to a node but not committed yet, "
+             "beyond which new tasks fail with EBUSY, 0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_pending_apply_tasks, ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_pending_apply_bytes, 0,
+             "Max total data size of the tasks applied to a node but not "
+             "committed yet, beyond which new tasks fail with EBUSY, "
+             "0 for unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_pending_apply_bytes, ::brpc::NonNegativeInteger);
+
+bool NodeImpl::reserve_apply_quota(int64_t ntasks, int64_t nbytes) {
+    // The tasks are pending in the apply queue first, and then in the ballot
+    // box until committed. The limits are soft as they are checked without
+    // any lock
+    const int64_t max_tasks = FLAGS_raft_max_pending_apply_tasks;
+    const int64_t max_bytes = FLAGS_raft_max_pending_apply_bytes;
+    if (max_tasks > 0 || max_bytes > 0) {
+        const int64_t pending_tasks =
+                _apply_queue_tasks.load(butil::memory_order_relaxed)
+                + _ballot_box->pending_tasks();
+        const int64_t pending_bytes =
+                _apply_queue_bytes.load(butil::memory_order_relaxed)
+                + _ballot_box->pending_bytes();
+        // Let anything in when nothing is pending, or an oversized task would
+        // never get in
+        if ((max_tasks > 0 && pending_tasks > 0
+                    && pending_tasks + ntasks > max_tasks)
+                || (max_bytes > 0 && pending_bytes > 0
+                    && pending_bytes + nbytes > max_bytes)) {
+            _apply_rejected_count.fetch_add(ntasks, butil::memory_order_relaxed);
+            g_apply_rejected_count << ntasks;
+            return false;
+        }
+    }
+    _apply_queue_tasks.fetch_add(ntasks, butil::memory_order_relaxed);
+    _apply_queue_bytes.fetch_add(nbytes, butil::memory_order_relaxed);
+    return true;
+}
+
+void NodeImpl::release_apply_quota(int64_t ntasks, int64_t nbytes) {
+    _apply_queue_tasks.fetch_sub(ntasks, butil::memory_order_relaxed);
+    _apply_queue_bytes.fetch_sub(nbytes, butil::memory_order_relaxed);
+}
+
 int NodeImpl::execute_applying_tasks(
         void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter) {
     if (iter.is_queue_stopped()) {
         return 0;
     }
-    // TODO: the batch size should limited by both task size and the total log
-    // size
-    const size_t batch_size = FLAGS_raft_apply_batch;
+    NodeImpl* m = (NodeImpl*)meta;
+    // The batch is limited by both the number of tasks and the total size,
+    // which are scaled together by the limit adjusted in the last round
+    const size_t base_batch_size = FLAGS_raft_apply_batch;
+    const size_t max_batch_size = std::max<size_t>(
+            FLAGS_raft_max_apply_batch, base_batch_size);
+    size_t batch_size = m->_apply_batch_size;
+    if (batch_size == 0) {
+        batch_size = base_batch_size;
+    }
+    batch_size = std::min(batch_size, max_batch_size);
+    const int64_t max_batch_bytes = FLAGS_raft_apply_batch_bytes;
+    const size_t batch_bytes = std::max<int64_t>(std::min<int64_t>(
+            max_batch_bytes, max_batch_bytes * batch_size / base_batch_size), 1);
     DEFINE_SMALL_ARRAY(LogEntryAndClosure, tasks, batch_size, 256);
     size_t cur_size = 0;
-    NodeImpl* m = (NodeImpl*)meta;
+    size_t cur_bytes = 0;
+    size_t ntasks = 0;
     for (; iter; ++iter) {
-        if (cur_size == batch_size) {
+        if (iter->group != NULL) {
+            // Tasks queued together are applied in one batch whatever the
+            // limits are
+            if (cur_size > 0) {
+                m->apply(tasks, cur_size);
+                cur_size = 0;
+                cur_bytes = 0;
+            }
+            m->apply(iter->group, iter->group_size);
+            ntasks += iter->group_size;
+            delete [] iter->group;
+            continue;
+        }
+        ++ntasks;
+        const size_t task_bytes = iter->entry->data.size();
+        if (cur_size == batch_size
+                || (cur_size > 0 && cur_bytes + task_bytes > batch_bytes)) {
             m->apply(tasks, cur_size);
             cur_size = 0;
+            cur_bytes = 0;
         }
         tasks[cur_size++] = *iter;
+        cur_bytes += task_bytes;
     }
     if (cur_size > 0) {
         m->apply(tasks, cur_size);
     }
+    // Halve the batches while the disk is slow so that the tasks behind don't
+    // wait for a large write, and double them while the tasks pile up
+    const int64_t flush_latency_us = m->_log_manager->flush_latency_us();
+    int64_t target_latency_us = FLAGS_raft_apply_batch_flush_latency_us;
+    size_t min_batch_size = 1;
+    if (target_latency_us <= 0) {
+        // Larger batches may not double the latency observed with the base
+        // ones
+        if (batch_size <= base_batch_size) {
+            m->_apply_batch_base_latency_us = flush_latency_us;
+        }
+        target_latency_us = 2 * m->_apply_batch_base_latency_us;
+        min_batch_size = base_batch_size;
+    }
+    if (target_latency_us > 0 && flush_latency_us > target_latency_us
+            && batch_size > min_batch_size) {
+        batch_size = std::max(batch_size / 2, min_batch_size);
+    } else if (ntasks > batch_size) {
+        batch_size = std::min(batch_size * 2, max_batch_size);
+    }
+    m->_apply_batch_size = batch_size;
     return 0;
 }
 
 void NodeImpl::apply(const Task& task) {
+    const int64_t nbytes = task.data->size();
+    if (!reserve_apply_quota(1, nbytes)) {
+        if (task.done) {
+            task.done->status().set_error(EBUSY, "Too many pending tasks");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
     LogEntry* entry = new LogEntry;
     entry->AddRef();
     entry->data.swap(*task.data);
@@ -675,9 +834,55 @@ void NodeImpl::apply(const Task& task) {
     m.done = task.done;
     m.expected_term = task.expected_term;
     if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
-        task.done->status().set_error(EPERM, "Node is down");
+        release_apply_quota(1, nbytes);
         entry->Release();
-        return run_closure_in_bthread(task.done);
+        if (task.done) {
+            task.done->status().set_error(EPERM, "Node is down");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
+}
+
+void NodeImpl::apply(const Task* tasks, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    int64_t nbytes = 0;
+    for (size_t i = 0; i < size; ++i) {
+        nbytes += tasks[i].data->size();
+    }
+    if (!reserve_apply_quota(size, nbytes)) {
+        for (size_t i = 0; i < size; ++i) {
+            if (tasks[i].done) {
+                tasks[i].done->status().set_error(EBUSY, "Too many pending tasks");
+                run_closure_in_bthread(tasks[i].done);
+            }
+        }
+        return;
+    }
+    LogEntryAndClosure* group = new LogEntryAndClosure[size];
+    for (size_t i = 0; i < size; ++i) {
+        LogEntry* entry = new LogEntry;
+        entry->AddRef();
+        entry->data.swap(*tasks[i].data);
+        group[i].entry = entry;
+        group[i].done = tasks[i].done;
+        group[i].expected_term = tasks[i].expected_term;
+    }
+    LogEntryAndClosure m;
+    m.group = group;
+    m.group_size = size;
+    if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
+        release_apply_quota(size, nbytes);
+        for (size_t i = 0; i < size; ++i) {
+            group[i].entry->Release();
+            if (group[i].done) {
+                group[i].done->status().set_error(EPERM, "Node is down");
+                run_closure_in_bthread(group[i].done);
+            }
+        }
+        delete [] group;
     }
 }
 
@@ -814,6 +1019,117 @@ void NodeImpl::handle_stepdown_timeout() {
     if (!_conf.old_conf.empty()) {
         check_dead_nodes(_conf.old_conf, now);
     }
+    check_quiescence(now);
+}
+
+// in lock
+void NodeImpl::check_quiescence(int64_t now_ms) {
+    if (FLAGS_raft_quiescent_idle_ms <= 0 || _state != STATE_LEADER
+            || _quiescent) {
+        return;
+    }
+    const int64_t last_log_index = _log_manager->last_log_index();
+    if (last_log_index != _idle_check_index) {
+        _idle_check_index = last_log_index;
+        _idle_since_ms = now_ms;
+        return;
+    }
+    if (now_ms - _idle_since_ms < FLAGS_raft_quiescent_idle_ms
+            || _conf_ctx.is_busy() || !_conf.stable()
+            || _ballot_box->last_committed_index() != last_log_index
+            || !_replicator_group.all_caught_up(last_log_index + 1)) {
+        return;
+    }
+    std::vector<PeerId> peers;
+    _conf.conf.list_peers(&peers);
+    std::vector<PeerId> watched;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (peers[i] != _server_id) {
+            watched.push_back(peers[i]);
+        }
+    }
+    // A follower that restarts votes for itself, which wakes the leader up
+    if (!enter_quiescent_state(watched, 0)) {
+        return;
+    }
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " term " << _current_term << " becomes quiescent after idle "
+              << now_ms - _idle_since_ms << "ms at log_index=" << last_log_index;
+    _stepdown_timer.stop();
+    // The followers stop their election timers on the next heartbeat
+    _replicator_group.set_quiescent(true);
+}
+
+// in lock
+bool NodeImpl::enter_quiescent_state(const std::vector<PeerId>& watched,
+                                     int64_t leader_term) {
+    const NodeId id = node_id();
+    for (size_t i = 0; i < watched.size(); ++i) {
+        if (PeerFailureDetector::GetInstance()->watch(
+                    watched[i], leader_term, id) != 0) {
+            for (size_t j = 0; j < i; ++j) {
+                PeerFailureDetector::GetInstance()->unwatch(watched[j], id);
+            }
+            return false;
+        }
+    }
+    _quiescent_watched = watched;
+    _quiescent = true;
+    return true;
+}
+
+// in lock
+void NodeImpl::leave_quiescent_state() {
+    const NodeId id = node_id();
+    for (size_t i = 0; i < _quiescent_watched.size(); ++i) {
+        PeerFailureDetector::GetInstance()->unwatch(_quiescent_watched[i], id);
+    }
+    _quiescent_watched.clear();
+    _quiescent = false;
+}
+
+// in lock
+void NodeImpl::check_quiescence_on_vote(const PeerId& candidate_id) {
+    if (!_quiescent) {
+        return;
+    }
+    if (_state == STATE_LEADER) {
+        // Some follower has lost the leader, resume the heartbeats
+        unsafe_wake_up();
+    } else if (candidate_id == _leader_id) {
+        // The leader has restarted and lost its leadership
+        unsafe_wake_up();
+        _follower_lease.expire();
+    } else {
+        // The leader is alive as far as PeerFailureDetector knows
+        _follower_lease.renew(_leader_id);
+    }
+}
+
+void NodeImpl::wake_up() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    unsafe_wake_up();
+}
+
+// in lock
+void NodeImpl::unsafe_wake_up() {
+    if (!_quiescent) {
+        return;
+    }
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " term " << _current_term << " wakes up from quiescence"
+              << " state " << state2str(_state);
+    leave_quiescent_state();
+    if (_state == STATE_LEADER) {
+        _idle_since_ms = butil::monotonic_time_ms();
+        _wake_up_time_ms = _idle_since_ms;
+        _stepdown_timer.start();
+        _replicator_group.set_quiescent(false);
+    } else if (_state == STATE_FOLLOWER) {
+        // Wait a whole election timeout for the leader before voting
+        _follower_lease.renew(_leader_id);
+        _election_timer.start();
+    }
 }
 
 void NodeImpl::unsafe_register_conf_change(const Configuration& old_conf,
@@ -851,6 +1167,19 @@ void NodeImpl::unsafe_register_conf_change(const Configuration& old_conf,
         return;
     }
 
+    if (new_conf.size() > BallotVoters::MAX_PEERS) {
+        LOG(WARNING) << "[" << node_id() << "] Refusing configuration "
+                     << new_conf << " with more than " 
+                     << BallotVoters::MAX_PEERS << " peers";
+        if (done) {
+            done->status().set_error(EINVAL, "More than %d peers",
+                                     (int)BallotVoters::MAX_PEERS);
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+
+    unsafe_wake_up();
     return _conf_ctx.start(old_conf, new_conf, done);
 }
 
@@ -889,6 +1218,13 @@ butil::Status NodeImpl::reset_peers(const Configuration& new_peers) {
         LOG(WARNING) << "node " << _group_id << ":" << _server_id << " set empty peers";
         return butil::Status(EINVAL, "new_peers is empty");
     }
+    if (new_peers.size() > BallotVoters::MAX_PEERS) {
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id 
+                     << " set " << new_peers << " with more than " 
+                     << BallotVoters::MAX_PEERS << " peers";
+        return butil::Status(EINVAL, "More than %d peers",
+                             (int)BallotVoters::MAX_PEERS);
+    }
     // check state
     if (!is_active_state(_state)) {
         LOG(WARNING) << "node " << _group_id << ":" << _server_id
@@ -1175,6 +1511,7 @@ int NodeImpl::transfer_leadership_to(const PeerId& peer) {
         return EBUSY;
     }
 
+    unsafe_wake_up();
     PeerId peer_id = peer;
     // if peer_id is ANY_PEER(0.0.0.0:0:0), the peer with the largest
     // last_log_id will be selected. 
@@ -1599,7 +1936,11 @@ void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck, bool triggered) {
         return;
     }
 
-    _pre_vote_ctx.init(this, triggered);
+    if (_pre_vote_ctx.init(this, triggered) != 0) {
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " can't do pre_vote in " << _conf.conf;
+        return;
+    }
     std::set<PeerId> peers;
     _conf.list_peers(&peers);
 
@@ -1644,11 +1985,19 @@ void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck,
                      << " can't do elect_self as it is not in " << _conf.conf;
         return;
     }
+    if (_vote_ctx.init(this, false) != 0) {
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " can't do elect_self in " << _conf.conf;
+        return;
+    }
     // cancel follower election timer
     if (_state == STATE_FOLLOWER) {
         BRAFT_VLOG << "node " << _group_id << ":" << _server_id
                    << " term " << _current_term << " stop election_timer";
         _election_timer.stop();
+        if (_quiescent) {
+            leave_quiescent_state();
+        }
     }
     // reset leader_id before vote
     const PeerId old_leader = _leader_id;
@@ -1667,7 +2016,6 @@ void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck,
                << " term " << _current_term << " start vote_timer";
     _vote_timer.start();
     _pre_vote_ctx.reset(this);
-    _vote_ctx.init(this, false);
     if (old_leader_stepped_down) {
         _vote_ctx.set_disrupted_leader(DisruptedLeader(old_leader, leader_term));
         _follower_lease.expire();
@@ -1757,6 +2105,10 @@ void NodeImpl::step_down(const int64_t term, bool wakeup_a_candidate,
     if (!is_active_state(_state)) {
         return;
     }
+    // The timers are reset below
+    if (_quiescent) {
+        leave_quiescent_state();
+    }
     // delete timer and something else
     if (_state == STATE_CANDIDATE) {
         _vote_timer.stop();
@@ -1979,6 +2331,12 @@ void LeaderStableClosure::Run() {
 
 void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
     g_apply_tasks_batch_counter << size;
+    int64_t batch_bytes = 0;
+    for (size_t i = 0; i < size; ++i) {
+        batch_bytes += tasks[i].entry->data.size();
+    }
+    g_apply_tasks_batch_bytes << batch_bytes;
+    release_apply_quota(size, batch_bytes);
 
     std::vector<LogEntry*> entries;
     entries.reserve(size);
@@ -2004,6 +2362,9 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
         }
         return;
     }
+    unsafe_wake_up();
+    DEFINE_SMALL_ARRAY(Closure*, dones, size, 256);
+    DEFINE_SMALL_ARRAY(int64_t, data_sizes, size, 256);
     for (size_t i = 0; i < size; ++i) {
         if (tasks[i].expected_term != -1 && tasks[i].expected_term != _current_term) {
             BRAFT_VLOG << "node " << _group_id << ":" << _server_id
@@ -2018,12 +2379,24 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
             tasks[i].entry->Release();
             continue;
         }
+        dones[entries.size()] = tasks[i].done;
+        data_sizes[entries.size()] = tasks[i].entry->data.size();
         entries.push_back(tasks[i].entry);
         entries.back()->id.term = _current_term;
         entries.back()->type = ENTRY_TYPE_DATA;
-        _ballot_box->append_pending_task(_conf.conf,
-                                         _conf.stable() ? NULL : &_conf.old_conf,
-                                         tasks[i].done);
+    }
+    if (_ballot_box->append_pending_tasks(
+                _conf.conf, _conf.stable() ? NULL : &_conf.old_conf,
+                dones, data_sizes, entries.size()) != 0) {
+        lck.unlock();
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+            if (dones[i]) {
+                dones[i]->status().set_error(EINVAL, "Fail to append task");
+                run_closure_in_bthread(dones[i]);
+            }
+        }
+        return;
     }
     _log_manager->append_entries(&entries,
                                new LeaderStableClosure(
@@ -2103,6 +2476,7 @@ int NodeImpl::handle_pre_vote_request(const RequestVoteRequest* request,
         lck.lock();
         // pre_vote not need ABA check after unlock&lock
 
+        check_quiescence_on_vote(candidate_id);
         int64_t votable_time = _follower_lease.votable_time_from_now();
         bool grantable = (LogId(request->last_log_index(), request->last_log_term())
                         >= last_log_id);
@@ -2160,6 +2534,7 @@ int NodeImpl::handle_request_vote_request(const RequestVoteRequest* request,
             _leader_id == disrupted_leader_id) {
         // The candidate has already disrupted the old leader, we
         // can expire the lease safely.
+        unsafe_wake_up();
         _follower_lease.expire();
     }
 
@@ -2191,6 +2566,7 @@ int NodeImpl::handle_request_vote_request(const RequestVoteRequest* request,
 
         bool log_is_ok = (LogId(request->last_log_index(), request->last_log_term())
                           >= last_log_id);
+        check_quiescence_on_vote(candidate_id);
         int64_t votable_time = _follower_lease.votable_time_from_now();
 
         LOG(INFO) << "node " << _group_id << ":" << _server_id
@@ -2412,6 +2788,11 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         _follower_lease.renew(_leader_id);
     }
 
+    if (_quiescent && !request->quiescent()) {
+        // Woken up by the leader
+        unsafe_wake_up();
+    }
+
     if (request->entries_size() > 0 &&
             (_snapshot_executor
                 && _snapshot_executor->is_installing_snapshot())) {
@@ -2472,6 +2853,14 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         response->set_term(_current_term);
         response->set_last_log_index(_log_manager->last_log_index());
         response->set_readonly(_node_readonly);
+        if (request->quiescent() && !_quiescent) {
+            // Watch the leader instead of waiting for its heartbeats, which
+            // must stay the leader of this term
+            const std::vector<PeerId> watched(1, _leader_id);
+            if (enter_quiescent_state(watched, _current_term)) {
+                _election_timer.stop();
+            }
+        }
         lck.unlock();
         // see the comments at FollowerStableClosure::run()
         _ballot_box->set_last_committed_index(
@@ -2695,11 +3084,15 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     _replicator_group.list_replicators(&replicators);
     const int64_t leader_timestamp = _follower_lease.last_leader_timestamp();
     const bool readonly = (_node_readonly || _majority_nodes_readonly);
+    const bool quiescent = _quiescent;
     lck.unlock();
     const char *newline = use_html ? "<br>" : "\r\n";
     os << "peer_id: " << _server_id << newline;
     os << "state: " << state2str(st) << newline;
     os << "readonly: " << readonly << newline;
+    if (quiescent) {
+        os << "quiescent: " << quiescent << newline;
+    }
     os << "term: " << term << newline;
     os << "conf_index: " << conf_index << newline;
     os << "peers:";
@@ -2780,6 +3173,13 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     _snapshot_timer.describe(os, use_html);
     os << newline;
 
+    os << "apply_queue_size: "
+       << _apply_queue_tasks.load(butil::memory_order_relaxed) << newline;
+    os << "apply_queue_bytes: "
+       << _apply_queue_bytes.load(butil::memory_order_relaxed) << newline;
+    os << "apply_rejected_count: "
+       << _apply_rejected_count.load(butil::memory_order_relaxed) << newline;
+
     _log_manager->describe(os, use_html);
     _fsm_caller->describe(os, use_html);
     _ballot_box->describe(os, use_html);
@@ -2829,6 +3229,12 @@ void NodeImpl::get_status(NodeStatus* status) {
     status->pending_queue_size = ballot_box_status.pending_queue_size;
 
     status->applying_index = _fsm_caller->applying_index();
+    status->apply_queue_size =
+            _apply_queue_tasks.load(butil::memory_order_relaxed);
+    status->apply_queue_bytes =
+            _apply_queue_bytes.load(butil::memory_order_relaxed);
+    status->apply_rejected_count =
+            _apply_rejected_count.load(butil::memory_order_relaxed);
     
     if (replicators.size() == 0) {
         return;
@@ -3415,7 +3821,19 @@ void NodeImpl::get_leader_lease_status(LeaderLeaseStatus* lease_status) {
         lease_status->state = LEASE_EXPIRED;
         return;
     }
+    if (_quiescent) {
+        // The lease is renewed by the heartbeats resumed on waking up
+        unsafe_wake_up();
+        lease_status->state = LEASE_NOT_READY;
+        return;
+    }
     int64_t last_active_timestamp = last_leader_active_timestamp();
+    if (last_active_timestamp < _wake_up_time_ms) {
+        // No quorum has acked the heartbeats resumed on waking up yet, which
+        // doesn't mean the lease has been lost
+        lease_status->state = LEASE_NOT_READY;
+        return;
+    }
     _leader_lease.renew(last_active_timestamp);
     _leader_lease.get_lease_info(&internal_info);
     if (internal_info.state != LeaderLease::VALID && internal_info.state != LeaderLease::DISABLED) {
@@ -3432,10 +3850,16 @@ void NodeImpl::get_leader_lease_status(LeaderLeaseStatus* lease_status) {
     }
 }
 
-void NodeImpl::VoteBallotCtx::init(NodeImpl* node, bool triggered) {
+int NodeImpl::VoteBallotCtx::init(NodeImpl* node, bool triggered) {
     reset(node);
-    _ballot.init(node->_conf.conf, node->_conf.stable() ? NULL : &(node->_conf.old_conf));
     _triggered = triggered;
+    const int rc = _voters.init(node->_conf.conf, 
+            node->_conf.stable() ? NULL : &(node->_conf.old_conf));
+    if (rc != 0) {
+        return rc;
+    }
+    _ballot.init(&_voters);
+    return 0;
 }
 
 void NodeImpl::VoteBallotCtx::start_grant_self_timer(int64_t wait_ms, NodeImpl* node) {
@@ -109,6 +109,11 @@ public:
         return _state == STATE_LEADER;
     }
 
+    bool is_leader_of(int64_t term) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _state == STATE_LEADER && _current_term == term;
+    }
+
     // public user api
     //
     // init node
@@ -133,6 +138,10 @@ public:
     //
     void apply(const Task& task);
 
+    // apply |size| tasks which are queued together and appended to the log
+    // consecutively, with the same ownership as above
+    void apply(const Task* tasks, size_t size);
+
     butil::Status list_peers(std::vector<PeerId>* peers);
 
     // @Node configuration change
@@ -226,6 +235,9 @@ public:
     bool is_leader_lease_valid();
     void get_leader_lease_status(LeaderLeaseStatus* status);
 
+    // Leave the quiescent state if it's in, see Node::wake_up
+    void wake_up();
+
     // Call on_error when some error happens, after this is called.
     // After this point:
     //  - This node is to step down immediately if it was the leader.
@@ -304,6 +316,10 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
     static int execute_applying_tasks(
                 void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter);
     void apply(LogEntryAndClosure tasks[], size_t size);
+    // Account |ntasks| tasks of |nbytes| to the apply queue, false if the
+    // tasks waiting to be committed would exceed the limits
+    bool reserve_apply_quota(int64_t ntasks, int64_t nbytes);
+    void release_apply_quota(int64_t ntasks, int64_t nbytes);
     void check_dead_nodes(const Configuration& conf, int64_t now_ms);
 
     bool handle_out_of_order_append_entries(brpc::Controller* cntl,
@@ -319,6 +335,12 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
 
     int64_t last_leader_active_timestamp();
     int64_t last_leader_active_timestamp(const Configuration& conf);
+    void check_quiescence(int64_t now_ms);
+    bool enter_quiescent_state(const std::vector<PeerId>& watched,
+                               int64_t leader_term);
+    void leave_quiescent_state();
+    void check_quiescence_on_vote(const PeerId& candidate_id);
+    void unsafe_wake_up();
     void unsafe_reset_election_timeout_ms(int election_timeout_ms,
                                           int max_clock_drift_ms);
     void retry_vote_on_reserved_peers();
@@ -388,9 +410,16 @@ private:
     };
 
     struct LogEntryAndClosure {
+        LogEntryAndClosure()
+            : entry(NULL), done(NULL), expected_term(-1)
+            , group(NULL), group_size(0) {}
         LogEntry* entry;
         Closure* done;
         int64_t expected_term;
+        // Not NULL if this is a group of tasks queued together, in which case
+        // the fields above are unused
+        LogEntryAndClosure* group;
+        size_t group_size;
     };
 
     struct AppendEntriesRpc : public butil::LinkNode<AppendEntriesRpc> {
@@ -450,7 +479,8 @@ private:
         VoteBallotCtx() : _timer(bthread_timer_t()), _version(0)
                         , _grant_self_arg(NULL), _triggered(false) {
         }
-        void init(NodeImpl* node, bool triggered);
+        // Returns EINVAL if the configuration has too many peers
+        int init(NodeImpl* node, bool triggered);
         void grant(const PeerId& peer) {
             _ballot.grant(peer);
         }
@@ -472,6 +502,7 @@ private:
         const LogId& last_log_id() const;
     private:
         bthread_timer_t _timer;
+        BallotVoters _voters;
         Ballot _ballot;
         // Each time the vote ctx restarted, increase the version to avoid
         // ABA problem.
@@ -524,6 +555,14 @@ private:
     ReplicatorId _waking_candidate;
     bthread::ExecutionQueueId<LogEntryAndClosure> _apply_queue_id;
     bthread::ExecutionQueue<LogEntryAndClosure>::scoped_ptr_t _apply_queue;
+    // Max number of tasks applied in a batch, only used by the apply queue
+    size_t _apply_batch_size;
+    // Flush latency observed with batches of -raft_apply_batch tasks
+    int64_t _apply_batch_base_latency_us;
+    // Tasks in the apply queue
+    butil::atomic<int64_t> _apply_queue_tasks;
+    butil::atomic<int64_t> _apply_queue_bytes;
+    butil::atomic<int64_t> _apply_rejected_count;
     AppendEntriesCache* _append_entries_cache;
     int64_t _append_entries_cache_version;
 
@@ -533,6 +572,19 @@ private:
 
     LeaderLease _leader_lease;
     FollowerLease _follower_lease;
+
+    // for quiescence, in which the liveness of the peers in
+    // |_quiescent_watched| is checked by PeerFailureDetector instead of
+    // heartbeats and timers
+    bool _quiescent;
+    std::vector<PeerId> _quiescent_watched;
+    // The leader is idle since |_idle_since_ms| if the last log index is still
+    // |_idle_check_index|
+    int64_t _idle_check_index;
+    int64_t _idle_since_ms;
+    // The lease of the leader is not ready until a quorum acks the heartbeats
+    // sent after |_wake_up_time_ms|
+    int64_t _wake_up_time_ms;
 };
 
 }
@@ -22,6 +22,57 @@
 
 namespace braft {
 
+// Handles a request of AppendEntriesBatchRequest or HeartbeatBatchRequest as
+// if it were received by append_entries, and runs |done| of the batch after
+// the last one
+class AppendEntriesBatchClosure {
+public:
+    AppendEntriesBatchClosure(
+            int size,
+            google::protobuf::RepeatedPtrField<AppendEntriesResult>* results,
+            google::protobuf::Closure* done)
+        : _requests(new Request[size]), _nleft(size), _done(done) {
+        for (int i = 0; i < size; ++i) {
+            _requests[i].batch = this;
+            _requests[i].result = results->Add();
+        }
+    }
+
+    ~AppendEntriesBatchClosure() { delete [] _requests; }
+
+    brpc::Controller* cntl(int i) { return &_requests[i].cntl; }
+    AppendEntriesResponse* response(int i) {
+        return _requests[i].result->mutable_response();
+    }
+    google::protobuf::Closure* done(int i) { return &_requests[i]; }
+
+private:
+    struct Request : public google::protobuf::Closure {
+        void Run() {
+            if (cntl.Failed()) {
+                result->clear_response();
+                result->set_error_code(cntl.ErrorCode());
+                result->set_error_text(cntl.ErrorText());
+            }
+            batch->on_request_done();
+        }
+        brpc::Controller cntl;
+        AppendEntriesResult* result;
+        AppendEntriesBatchClosure* batch;
+    };
+
+    void on_request_done() {
+        if (_nleft.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            _done->Run();
+            delete this;
+        }
+    }
+
+    Request* _requests;
+    butil::atomic<int> _nleft;
+    google::protobuf::Closure* _done;
+};
+
 NodeManager::NodeManager() {}
 
 NodeManager::~NodeManager() {}
@@ -137,6 +188,118 @@ scoped_refptr<NodeImpl> NodeManager::get(const GroupId& group_id, const PeerId&
     return NULL;
 }
 
+void NodeManager::handle_heartbeat_batch(brpc::Controller* cntl,
+                                         const HeartbeatBatchRequest* request,
+                                         HeartbeatBatchResponse* response,
+                                         google::protobuf::Closure* done) {
+    const int size = request->heartbeats_size();
+    if (size == 0) {
+        done->Run();
+        return;
+    }
+    AppendEntriesBatchClosure* batch = new AppendEntriesBatchClosure(
+            size, response->mutable_results(), done);
+    // |batch| is deleted once the last heartbeat is done
+    for (int i = 0; i < size; ++i) {
+        const AppendEntriesRequest& heartbeat = request->heartbeats(i);
+        brpc::ClosureGuard done_guard(batch->done(i));
+        PeerId peer_id;
+        if (0 != peer_id.parse(heartbeat.peer_id())) {
+            batch->cntl(i)->SetFailed(EINVAL, "peer_id invalid");
+            continue;
+        }
+        if (heartbeat.entries_size() != 0) {
+            batch->cntl(i)->SetFailed(EINVAL, "Not a heartbeat");
+            continue;
+        }
+        scoped_refptr<NodeImpl> node = get(heartbeat.group_id(), peer_id);
+        if (!node) {
+            batch->cntl(i)->SetFailed(ENOENT, "peer_id not exist");
+            continue;
+        }
+        node->handle_append_entries_request(batch->cntl(i), &heartbeat,
+                                            batch->response(i),
+                                            done_guard.release());
+    }
+}
+
+void NodeManager::handle_append_entries_batch(
+        brpc::Controller* cntl, const AppendEntriesBatchRequest* request,
+        AppendEntriesBatchResponse* response, google::protobuf::Closure* done) {
+    const int size = request->requests_size();
+    if (size == 0) {
+        done->Run();
+        return;
+    }
+    // The data of the requests are cut from the attachment one by one, any
+    // invalid size would misalign all the following ones
+    if (request->data_sizes_size() != size) {
+        cntl->SetFailed(EINVAL, "%d data_sizes for %d requests",
+                        request->data_sizes_size(), size);
+        done->Run();
+        return;
+    }
+    int64_t remaining = cntl->request_attachment().size();
+    for (int i = 0; i < size; ++i) {
+        const int64_t data_size = request->data_sizes(i);
+        if (data_size < 0 || data_size > remaining) {
+            cntl->SetFailed(EINVAL, "Invalid data_size=%" PRId64, data_size);
+            done->Run();
+            return;
+        }
+        remaining -= data_size;
+    }
+    if (remaining != 0) {
+        cntl->SetFailed(EINVAL, "%" PRId64 " bytes of the attachment are not "
+                        "covered by data_sizes", remaining);
+        done->Run();
+        return;
+    }
+    AppendEntriesBatchClosure* batch = new AppendEntriesBatchClosure(
+            size, response->mutable_results(), done);
+    // |batch| is deleted once the last request is done, the requests may
+    // finish asynchronously when they carry entries
+    for (int i = 0; i < size; ++i) {
+        const AppendEntriesRequest& sub_request = request->requests(i);
+        brpc::ClosureGuard done_guard(batch->done(i));
+        cntl->request_attachment().cutn(
+                &batch->cntl(i)->request_attachment(), request->data_sizes(i));
+        PeerId peer_id;
+        if (0 != peer_id.parse(sub_request.peer_id())) {
+            batch->cntl(i)->SetFailed(EINVAL, "peer_id invalid");
+            continue;
+        }
+        scoped_refptr<NodeImpl> node = get(sub_request.group_id(), peer_id);
+        if (!node) {
+            batch->cntl(i)->SetFailed(ENOENT, "peer_id not exist");
+            continue;
+        }
+        node->handle_append_entries_request(batch->cntl(i), &sub_request,
+                                            batch->response(i),
+                                            done_guard.release());
+    }
+}
+
+void NodeManager::handle_probe(brpc::Controller* cntl,
+                               const ProbeRequest* request,
+                               ProbeResponse* response,
+                               google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    for (int i = 0; i < request->targets_size(); ++i) {
+        const ProbeTarget& target = request->targets(i);
+        PeerId peer_id;
+        scoped_refptr<NodeImpl> node;
+        if (0 == peer_id.parse(target.peer_id())) {
+            node = get(target.group_id(), peer_id);
+        }
+        bool alive = (node != NULL);
+        if (alive && target.has_leader_term()) {
+            alive = node->is_leader_of(target.leader_term());
+        }
+        response->add_alive(alive);
+    }
+}
+
 void NodeManager::get_nodes_by_group_id(
         const GroupId& group_id, std::vector<scoped_refptr<NodeImpl> >* nodes) {
 
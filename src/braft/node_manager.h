@@ -20,6 +20,7 @@
 #include <butil/memory/singleton.h>
 #include <butil/containers/doubly_buffered_data.h>
 #include "braft/raft.h"
+#include "braft/raft.pb.h"
 #include "braft/util.h"
 
 namespace braft {
@@ -57,6 +58,25 @@ public:
     // Remove the addr from _addr_set when the backing service is destroyed
     void remove_address(butil::EndPoint addr);
 
+    // Dispatch the heartbeats in |request| to the nodes, |done| is run after
+    // all of them are handled
+    void handle_heartbeat_batch(brpc::Controller* cntl,
+                                const HeartbeatBatchRequest* request,
+                                HeartbeatBatchResponse* response,
+                                google::protobuf::Closure* done);
+
+    // Dispatch the AppendEntries requests in |request| to the nodes, |done|
+    // is run after all of them are handled
+    void handle_append_entries_batch(brpc::Controller* cntl,
+                                     const AppendEntriesBatchRequest* request,
+                                     AppendEntriesBatchResponse* response,
+                                     google::protobuf::Closure* done);
+
+    // Tell whether each target node in |request| exists, and is the leader of
+    // the given term if any
+    void handle_probe(brpc::Controller* cntl, const ProbeRequest* request,
+                      ProbeResponse* response, google::protobuf::Closure* done);
+
 private:
     NodeManager();
     ~NodeManager();
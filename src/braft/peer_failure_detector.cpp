@@ -0,0 +1,206 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <set>
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>
+#include <brpc/controller.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/raft.pb.h"
+#include "braft/node.h"
+#include "braft/node_manager.h"
+#include "braft/peer_failure_detector.h"
+
+namespace braft {
+
+DEFINE_int32(raft_quiescent_probe_interval_ms, 1000,
+             "Interval between the probes to a process which the quiescent "
+             "nodes depend on, also the timeout of each probe");
+BRPC_VALIDATE_GFLAG(raft_quiescent_probe_interval_ms, brpc::PositiveInteger);
+
+static bvar::Adder<int64_t> g_quiescent_probe_failures(
+             "raft_quiescent_probe_failure_count");
+
+class PeerFailureDetector::ProbeClosure : public google::protobuf::Closure {
+public:
+    explicit ProbeClosure(Peer* peer) : _peer(peer) {}
+    void Run() {
+        if (cntl.Failed()) {
+            g_quiescent_probe_failures << 1;
+            LOG(WARNING) << "Fail to probe " << _peer->addr
+                         << ", " << cntl.ErrorText();
+        }
+        PeerFailureDetector::GetInstance()->on_probe_returned(
+                _peer, probed, cntl, response);
+        delete this;
+    }
+
+    brpc::Controller cntl;
+    ProbeRequest request;
+    ProbeResponse response;
+    // In the order of the targets in |request|
+    std::vector<Watch> probed;
+private:
+    Peer* _peer;
+};
+
+PeerFailureDetector::PeerFailureDetector() {}
+
+PeerFailureDetector::~PeerFailureDetector() {
+    for (std::map<butil::EndPoint, Peer*>::iterator
+            it = _peers.begin(); it != _peers.end(); ++it) {
+        delete it->second;
+    }
+    _peers.clear();
+}
+
+int PeerFailureDetector::watch(const PeerId& target, int64_t leader_term,
+                               const NodeId& watcher) {
+    Peer* peer = NULL;
+    bool start_probing = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<butil::EndPoint, Peer*>::iterator 
+                it = _peers.find(target.addr);
+        if (it != _peers.end()) {
+            peer = it->second;
+        } else {
+            peer = new Peer;
+            peer->addr = target.addr;
+            peer->probing = false;
+            if (peer->channel.Init(target.addr, NULL) != 0) {
+                delete peer;
+                LOG(ERROR) << "Fail to init channel to " << target.addr;
+                return -1;
+            }
+            _peers[target.addr] = peer;
+        }
+        peer->watches[Watch(watcher, target)] = leader_term;
+        if (!peer->probing) {
+            peer->probing = true;
+            start_probing = true;
+        }
+    }
+    if (start_probing) {
+        schedule(peer);
+    }
+    return 0;
+}
+
+void PeerFailureDetector::unwatch(const PeerId& target, const NodeId& watcher) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<butil::EndPoint, Peer*>::iterator it = _peers.find(target.addr);
+    if (it != _peers.end()) {
+        // The probe in progress stops once it finds no watch
+        it->second->watches.erase(Watch(watcher, target));
+    }
+}
+
+void PeerFailureDetector::schedule(Peer* peer) {
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer,
+                butil::milliseconds_from_now(
+                        FLAGS_raft_quiescent_probe_interval_ms),
+                on_timer, peer) != 0) {
+        LOG(ERROR) << "Fail to add timer";
+        on_timer(peer);
+    }
+}
+
+void PeerFailureDetector::on_timer(void* arg) {
+    // Don't block the TimerThread
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_probe, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_probe(arg);
+    }
+}
+
+void* PeerFailureDetector::run_probe(void* arg) {
+    Peer* peer = (Peer*)arg;
+    ProbeClosure* probe = new ProbeClosure(peer);
+    {
+        BAIDU_SCOPED_LOCK(GetInstance()->_mutex);
+        for (std::map<Watch, int64_t>::const_iterator
+                it = peer->watches.begin(); it != peer->watches.end(); ++it) {
+            ProbeTarget* target = probe->request.add_targets();
+            target->set_group_id(it->first.first.group_id);
+            target->set_peer_id(it->first.second.to_string());
+            if (it->second > 0) {
+                target->set_leader_term(it->second);
+            }
+            probe->probed.push_back(it->first);
+        }
+    }
+    probe->cntl.set_timeout_ms(FLAGS_raft_quiescent_probe_interval_ms);
+    RaftService_Stub stub(&peer->channel);
+    stub.probe(&probe->cntl, &probe->request, &probe->response, probe);
+    return NULL;
+}
+
+void PeerFailureDetector::on_probe_returned(Peer* peer,
+                                            const std::vector<Watch>& probed,
+                                            const brpc::Controller& cntl,
+                                            const ProbeResponse& response) {
+    std::set<NodeId> woken;
+    bool keep_probing = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (cntl.Failed()) {
+            for (std::map<Watch, int64_t>::const_iterator
+                    it = peer->watches.begin(); it != peer->watches.end(); ++it) {
+                woken.insert(it->first.first);
+            }
+            peer->watches.clear();
+        } else {
+            // A target missing in the response is taken as dead
+            for (size_t i = 0; i < probed.size(); ++i) {
+                if ((int)i < response.alive_size() && response.alive(i)) {
+                    continue;
+                }
+                LOG(WARNING) << "node " << probed[i].first << " wakes up as "
+                             << probed[i].second << " on " << peer->addr
+                             << " is gone or not the leader any more";
+                if (peer->watches.erase(probed[i]) != 0) {
+                    woken.insert(probed[i].first);
+                }
+            }
+        }
+        if (peer->watches.empty()) {
+            peer->probing = false;
+        } else {
+            keep_probing = true;
+        }
+    }
+    if (keep_probing) {
+        schedule(peer);
+    }
+    // Woken up out of the lock, which is acquired in the lock of the nodes
+    for (std::set<NodeId>::const_iterator
+            it = woken.begin(); it != woken.end(); ++it) {
+        scoped_refptr<NodeImpl> node =
+                global_node_manager->get(it->group_id, it->peer_id);
+        if (node) {
+            LOG_IF(WARNING, cntl.Failed()) 
+                    << "node " << *it << " wakes up as " << peer->addr
+                    << " seems to be down";
+            node->wake_up();
+        }
+    }
+}
+
+}  //  namespace braft
@@ -0,0 +1,88 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_PEER_FAILURE_DETECTOR_H
+#define  BRAFT_PEER_FAILURE_DETECTOR_H
+
+#include <map>
+#include <vector>
+#include <butil/memory/singleton.h>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include "braft/configuration.h"
+#include "braft/raft.pb.h"
+#include "braft/util.h"
+
+namespace braft {
+
+// Watches the liveness of the nodes that the quiescent nodes depend on, so
+// that the nodes don't need any heartbeat or timer of their own. The nodes
+// watched in the same process are checked by a single probe RPC every
+// -raft_quiescent_probe_interval_ms no matter how many nodes are watching
+// them. A watcher is woken up once its target is gone or is no longer the
+// leader it was, and all the watchers of the process are once the probe
+// fails.
+class PeerFailureDetector {
+public:
+    // Leaky as the pending probes may still reference it at exit
+    static PeerFailureDetector* GetInstance() {
+        return Singleton<PeerFailureDetector,
+                         LeakySingletonTraits<PeerFailureDetector> >::get();
+    }
+
+    // Wake up the node of |watcher| by NodeImpl::wake_up once the node of
+    // |target| in the same group seems to be down, or is not the leader of
+    // |leader_term| if it's positive. Returns 0 on success, -1 otherwise.
+    int watch(const PeerId& target, int64_t leader_term,
+              const NodeId& watcher);
+
+    // Stop watching |target| for the node of |watcher|
+    void unwatch(const PeerId& target, const NodeId& watcher);
+
+private:
+    PeerFailureDetector();
+    ~PeerFailureDetector();
+    DISALLOW_COPY_AND_ASSIGN(PeerFailureDetector);
+    friend struct DefaultSingletonTraits<PeerFailureDetector>;
+
+    class ProbeClosure;
+
+    // The watcher and the watched peer in its group
+    typedef std::pair<NodeId, PeerId> Watch;
+
+    // The nodes watched in the same process, never destroyed until the
+    // detector is
+    struct Peer {
+        butil::EndPoint addr;
+        brpc::Channel channel;
+        // The leader term each watch requires, 0 if none
+        std::map<Watch, int64_t> watches;
+        // Whether a probe or the timer of the next one is in progress
+        bool probing;
+    };
+
+    void schedule(Peer* peer);
+    void on_probe_returned(Peer* peer, const std::vector<Watch>& probed,
+                           const brpc::Controller& cntl,
+                           const ProbeResponse& response);
+    static void on_timer(void* arg);
+    static void* run_probe(void* arg);
+
+    raft_mutex_t _mutex;
+    std::map<butil::EndPoint, Peer*> _peers;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_PEER_FAILURE_DETECTOR_H
@@ -0,0 +1,150 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <limits>
+#include <gflags/gflags.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/pipeline_window.h"
+
+namespace braft {
+
+DEFINE_bool(raft_adaptive_pipeline_window, false,
+            "Size the in-flight AppendEntries requests to each follower from "
+            "the measured RTT and ack bandwidth, bounded by "
+            "raft_max_pipeline_window_rpcs and raft_max_body_size instead of "
+            "the fixed raft_max_parallel_append_entries_rpc_num");
+BRPC_VALIDATE_GFLAG(raft_adaptive_pipeline_window, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_pipeline_window_rpcs, 32,
+             "Max number of in-flight AppendEntries requests to a follower "
+             "that the adaptive pipeline window grows to. Followers receiving "
+             "more than one should enable raft_enable_append_entries_cache");
+BRPC_VALIDATE_GFLAG(raft_max_pipeline_window_rpcs, ::brpc::PositiveInteger);
+
+DECLARE_int32(raft_max_parallel_append_entries_rpc_num);
+DECLARE_int32(raft_max_body_size);
+
+// The min RTT expires after this long without a lower sample so that the
+// window follows a path getting slower
+static const int64_t MIN_RTT_EXPIRE_US = 10 * 1000 * 1000L;
+// Vegas thresholds of the requests queued on the way
+static const double QUEUED_RPCS_LOW = 1;
+static const double QUEUED_RPCS_HIGH = 3;
+static const int64_t BDP_GAIN = 2;
+
+PipelineWindow::PipelineWindow()
+    : _startup(true)
+    , _rpcs(1)
+    , _min_rtt_us(0)
+    , _min_rtt_stamp_us(0)
+    , _round_rtt_us(0)
+    , _rounds(0) {
+    for (int i = 0; i < BANDWIDTH_FILTER_ROUNDS; ++i) {
+        _bandwidth[i] = 0;
+    }
+    start_round(0);
+}
+
+void PipelineWindow::start_round(int64_t now_us) {
+    _round_start_us = now_us;
+    _round_bytes = 0;
+    _round_rtt_sum_us = 0;
+    _round_acks = 0;
+    _round_max_in_flight = 0;
+}
+
+void PipelineWindow::on_acked(int64_t now_us, int64_t rtt_us,
+                              int64_t bytes, int in_flight) {
+    rtt_us = std::max(rtt_us, (int64_t)1);
+    if (_min_rtt_us == 0 || rtt_us <= _min_rtt_us
+            || now_us - _min_rtt_stamp_us > MIN_RTT_EXPIRE_US) {
+        _min_rtt_us = rtt_us;
+        _min_rtt_stamp_us = now_us;
+    }
+    if (_round_start_us == 0) {
+        // The first round began when this request was sent
+        _round_start_us = now_us - rtt_us;
+    }
+    _round_bytes += bytes;
+    _round_rtt_sum_us += rtt_us;
+    ++_round_acks;
+    _round_max_in_flight = std::max(_round_max_in_flight, in_flight);
+    const int64_t elapsed_us = now_us - _round_start_us;
+    if (elapsed_us < _min_rtt_us) {
+        return;
+    }
+    _round_rtt_us = _round_rtt_sum_us / _round_acks;
+    _bandwidth[_rounds % BANDWIDTH_FILTER_ROUNDS] =
+            _round_bytes * 1000000 / std::max(elapsed_us, (int64_t)1);
+    ++_rounds;
+    const double queued = _rpcs * (1.0 - (double)_min_rtt_us / _round_rtt_us);
+    if (queued > QUEUED_RPCS_HIGH) {
+        _startup = false;
+        --_rpcs;
+    } else if (queued >= QUEUED_RPCS_LOW) {
+        _startup = false;
+    } else if (_round_max_in_flight >= _rpcs) {
+        // Only grow a window that is used up, otherwise an idle follower
+        // would end up with an unbounded window
+        _rpcs = _startup ? _rpcs * 2 : _rpcs + 1;
+    }
+    _rpcs = std::max(1, std::min(_rpcs, FLAGS_raft_max_pipeline_window_rpcs));
+    start_round(now_us);
+}
+
+void PipelineWindow::on_error() {
+    _startup = false;
+    _rpcs = std::max(1, _rpcs / 2);
+    for (int i = 0; i < BANDWIDTH_FILTER_ROUNDS; ++i) {
+        _bandwidth[i] /= 2;
+    }
+    start_round(0);
+}
+
+int PipelineWindow::max_rpcs() const {
+    if (!FLAGS_raft_adaptive_pipeline_window) {
+        return FLAGS_raft_max_parallel_append_entries_rpc_num;
+    }
+    return std::min(_rpcs, FLAGS_raft_max_pipeline_window_rpcs);
+}
+
+int64_t PipelineWindow::bandwidth() const {
+    return *std::max_element(_bandwidth, _bandwidth + BANDWIDTH_FILTER_ROUNDS);
+}
+
+int64_t PipelineWindow::max_bytes() const {
+    if (!FLAGS_raft_adaptive_pipeline_window) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    const int64_t max_rpc_bytes = (int64_t)max_rpcs() * FLAGS_raft_max_body_size;
+    const int64_t bdp = bandwidth() * _min_rtt_us / 1000000;
+    if (bdp == 0) {
+        return max_rpc_bytes;
+    }
+    return std::max((int64_t)FLAGS_raft_max_body_size,
+                    std::min(bdp * BDP_GAIN, max_rpc_bytes));
+}
+
+void PipelineWindow::describe(std::ostream& os) const {
+    if (!FLAGS_raft_adaptive_pipeline_window) {
+        return;
+    }
+    os << " window={" << (_startup ? "startup" : "steady")
+       << " rpcs=" << max_rpcs() << " bytes=" << max_bytes()
+       << " min_rtt_us=" << _min_rtt_us << " rtt_us=" << _round_rtt_us
+       << " bandwidth=" << bandwidth() << "B/s}";
+}
+
+}  //  namespace braft
@@ -0,0 +1,83 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_PIPELINE_WINDOW_H
+#define  BRAFT_PIPELINE_WINDOW_H
+
+#include <stdint.h>
+#include <ostream>
+
+namespace braft {
+
+// Window of the in-flight AppendEntries requests to a follower, sized from
+// the measured round-trip time and ack bandwidth when
+// -raft_adaptive_pipeline_window is on.
+//
+// The number of requests grows like TCP Vegas: it doubles every round trip
+// at startup and then grows by one as long as less than one request is
+// queued on the way (estimated by the gap between the RTT of the round and
+// the minimum RTT), and shrinks by one when more than three are. The bytes
+// in flight are bounded by twice the bandwidth-delay product, where the
+// bandwidth is the max ack rate of the recent rounds like BBR. Both are
+// halved on errors and capped by -raft_max_pipeline_window_rpcs and
+// -raft_max_body_size. Otherwise the window is the fixed
+// -raft_max_parallel_append_entries_rpc_num.
+//
+// Not thread-safe, it's guarded by the lock of the Replicator.
+class PipelineWindow {
+public:
+    PipelineWindow();
+
+    // An AppendEntries request carrying |bytes| of data is acked at |now_us|
+    // after |rtt_us|, while |in_flight| requests including it were pending
+    void on_acked(int64_t now_us, int64_t rtt_us, int64_t bytes, int in_flight);
+
+    // An AppendEntries request failed or timed out
+    void on_error();
+
+    // Max number of requests in flight
+    int max_rpcs() const;
+
+    // Max bytes of data in flight, unlimited unless the window is adaptive
+    int64_t max_bytes() const;
+
+    int64_t min_rtt_us() const { return _min_rtt_us; }
+    // Max ack bandwidth of the recent rounds in bytes per second
+    int64_t bandwidth() const;
+
+    void describe(std::ostream& os) const;
+
+private:
+    static const int BANDWIDTH_FILTER_ROUNDS = 8;
+
+    void start_round(int64_t now_us);
+
+    bool _startup;
+    int _rpcs;
+    int64_t _min_rtt_us;
+    int64_t _min_rtt_stamp_us;
+    // Average RTT of the last round
+    int64_t _round_rtt_us;
+    int64_t _round_start_us;
+    int64_t _round_bytes;
+    int64_t _round_rtt_sum_us;
+    int64_t _round_acks;
+    int _round_max_in_flight;
+    int64_t _rounds;
+    int64_t _bandwidth[BANDWIDTH_FILTER_ROUNDS];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_PIPELINE_WINDOW_H
@@ -182,6 +182,10 @@ void Node::apply(const Task& task) {
     _impl->apply(task);
 }
 
+void Node::apply(const Task* tasks, size_t size) {
+    _impl->apply(tasks, size);
+}
+
 butil::Status Node::list_peers(std::vector<PeerId>* peers) {
     return _impl->list_peers(peers);
 }
@@ -242,6 +246,10 @@ bool Node::readonly() {
     return _impl->readonly();
 }
 
+void Node::wake_up() {
+    return _impl->wake_up();
+}
+
 // ------------- Iterator
 void Iterator::next() {
     if (valid()) {
@@ -379,7 +379,8 @@ struct NodeStatus {
     NodeStatus()
         : state(STATE_END), readonly(false), term(0), committed_index(0), known_applied_index(0)
         , pending_index(0), pending_queue_size(0), applying_index(0), first_index(0)
-        , last_index(-1), disk_index(0)
+        , last_index(-1), disk_index(0), apply_queue_size(0)
+        , apply_queue_bytes(0), apply_rejected_count(0)
     {}
 
     State state;
@@ -422,6 +423,16 @@ struct NodeStatus {
     // The max log in disk.
     int64_t disk_index;
 
+    // Number and total data size of the tasks applied but not appended to
+    // the log yet.
+    int64_t apply_queue_size;
+    int64_t apply_queue_bytes;
+
+    // How many tasks were rejected with EBUSY as there were too many tasks
+    // waiting to be committed, see FLAGS_raft_max_pending_apply_tasks and
+    // FLAGS_raft_max_pending_apply_bytes.
+    int64_t apply_rejected_count;
+
     // Stable followers are peers in current configuration.
     // If the node is not leader, this map is empty.
     PeerStatusMap stable_followers;
@@ -664,8 +675,18 @@ public:
     //              will pass the ownership to StateMachine::on_apply.
     //              Otherwise we will specify the error and call it.
     //
+    // The task fails with EBUSY immediately if too many tasks are waiting to
+    // be committed, see FLAGS_raft_max_pending_apply_tasks and
+    // FLAGS_raft_max_pending_apply_bytes.
+    //
     void apply(const Task& task);
 
+    // [Thread-safe and wait-free]
+    // apply |size| tasks at a time, which costs a single enqueue and are
+    // appended to the log consecutively in order. Each task is handled the
+    // same as apply(const Task&), including the ownership of data and done.
+    void apply(const Task* tasks, size_t size);
+
     // list peers of this raft group, only leader retruns ok
     // [NOTE] when list_peers concurrency with add_peer/remove_peer, maybe return peers is staled.
     // because add_peer/remove_peer immediately modify configuration in memory
@@ -774,6 +795,14 @@ public:
     //        is less than the majority.
     bool readonly();
 
+    // Wake up this node if it's quiescent, see -raft_quiescent_idle_ms.
+    // A quiescent leader resumes the heartbeats, which wake up the followers
+    // as well. A quiescent follower restarts its election timer, which is
+    // useful if the leader is suspected to be down by the user.
+    // Applying tasks and checking the leader lease wake up the leader
+    // automatically.
+    void wake_up();
+
 private:
     NodeImpl* _impl;
 };
@@ -168,4 +168,33 @@ void RaftServiceImpl::timeout_now(::google::protobuf::RpcController* controller,
     node->handle_timeout_now_request(cntl, request, response, done);
 }
 
+void RaftServiceImpl::heartbeat_batch(::google::protobuf::RpcController* controller,
+                                      const ::braft::HeartbeatBatchRequest* request,
+                                      ::braft::HeartbeatBatchResponse* response,
+                                      ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(controller);
+    global_node_manager->handle_heartbeat_batch(cntl, request, response, done);
+}
+
+void RaftServiceImpl::append_entries_batch(
+        ::google::protobuf::RpcController* controller,
+        const ::braft::AppendEntriesBatchRequest* request,
+        ::braft::AppendEntriesBatchResponse* response,
+        ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(controller);
+    global_node_manager->handle_append_entries_batch(
+            cntl, request, response, done);
+}
+
+void RaftServiceImpl::probe(::google::protobuf::RpcController* controller,
+                            const ::braft::ProbeRequest* request,
+                            ::braft::ProbeResponse* response,
+                            ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(controller);
+    global_node_manager->handle_probe(cntl, request, response, done);
+}
+
 }
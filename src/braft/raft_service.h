@@ -50,6 +50,21 @@ public:
                      const ::braft::TimeoutNowRequest* request,
                      ::braft::TimeoutNowResponse* response,
                      ::google::protobuf::Closure* done);
+
+    void heartbeat_batch(::google::protobuf::RpcController* controller,
+                         const ::braft::HeartbeatBatchRequest* request,
+                         ::braft::HeartbeatBatchResponse* response,
+                         ::google::protobuf::Closure* done);
+
+    void append_entries_batch(::google::protobuf::RpcController* controller,
+                              const ::braft::AppendEntriesBatchRequest* request,
+                              ::braft::AppendEntriesBatchResponse* response,
+                              ::google::protobuf::Closure* done);
+
+    void probe(::google::protobuf::RpcController* controller,
+               const ::braft::ProbeRequest* request,
+               ::braft::ProbeResponse* response,
+               ::google::protobuf::Closure* done);
 private:
     butil::EndPoint _addr;
 };
@@ -26,6 +26,7 @@
 #include "braft/ballot_box.h"                    // BallotBox 
 #include "braft/log_entry.h"                     // LogEntry
 #include "braft/snapshot_throttle.h"             // SnapshotThrottle
+#include "braft/append_entries_batcher.h"        // AppendEntriesBatcher
 
 namespace braft {
 
@@ -42,6 +43,11 @@ DEFINE_int32(raft_max_body_size, 512 * 1024,
              "The max byte size of AppendEntriesRequest");
 BRPC_VALIDATE_GFLAG(raft_max_body_size, ::brpc::PositiveInteger);
 
+DEFINE_bool(raft_share_encoded_entries, true,
+            "Encode the logs replicated to the followers once and share the "
+            "AppendEntries payload among the replicators of a group");
+BRPC_VALIDATE_GFLAG(raft_share_encoded_entries, ::brpc::PassValidate);
+
 DEFINE_int32(raft_retry_replicate_interval_ms, 1000,
              "Interval of retry to append entries or install snapshot");
 BRPC_VALIDATE_GFLAG(raft_retry_replicate_interval_ms,
@@ -49,6 +55,9 @@ BRPC_VALIDATE_GFLAG(raft_retry_replicate_interval_ms,
 
 DECLARE_int64(raft_append_entry_high_lat_us);
 DECLARE_bool(raft_trace_append_entry_latency);
+DECLARE_bool(raft_adaptive_pipeline_window);
+DECLARE_bool(raft_heartbeat_batch);
+DECLARE_bool(raft_append_entries_batch);
 
 static bvar::LatencyRecorder g_send_entries_latency("raft_send_entries");
 static bvar::LatencyRecorder g_normalized_send_entries_latency(
@@ -64,12 +73,14 @@ ReplicatorOptions::ReplicatorOptions()
     , term(0)
     , snapshot_storage(NULL)
     , replicator_status(NULL)
+    , entries_cache(NULL)
 {
 }
 
 Replicator::Replicator() 
     : _next_index(0)
     , _flying_append_entries_size(0)
+    , _flying_append_entries_bytes(0)
     , _consecutive_error_times(0)
     , _has_succeeded(false)
     , _timeout_now_index(0)
@@ -77,6 +88,8 @@ Replicator::Replicator()
     , _append_entries_counter(0)
     , _install_snapshot_counter(0)
     , _readonly_index(0)
+    , _quiescent(false)
+    , _heartbeat_stopped(false)
     , _wait_id(0)
     , _is_waiter_canceled(false)
     , _reader(NULL)
@@ -326,7 +339,12 @@ void Replicator::_on_heartbeat_returned(
     bool readonly = response->has_readonly() && response->readonly();
     BRAFT_VLOG << ss.str() << " readonly " << readonly;
     r->_update_last_rpc_send_timestamp(rpc_send_time);
-    r->_start_heartbeat_timer(start_time_us);
+    if (request->quiescent() && r->_quiescent && response->success()) {
+        // The follower has stopped its election timer
+        r->_heartbeat_stopped = true;
+    } else {
+        r->_start_heartbeat_timer(start_time_us);
+    }
     NodeImpl* node_impl = NULL;
     // Check if readonly config changed
     if ((readonly && r->_readonly_index == 0) ||
@@ -369,6 +387,7 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
     bool valid_rpc = false;
     int64_t rpc_first_index = request->prev_log_index() + 1;
     int64_t min_flying_index = r->_min_flying_index();
+    int64_t rpc_send_time_us = 0;
     CHECK_GT(min_flying_index, 0);
 
     for (std::deque<FlyingAppendEntriesRpc>::iterator rpc_it = r->_append_entries_in_fly.begin();
@@ -378,6 +397,7 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
         }
         if (rpc_it->call_id == cntl->call_id()) {
             valid_rpc = true;
+            rpc_send_time_us = rpc_it->send_time_us;
         }
     }
     if (!valid_rpc) {
@@ -401,6 +421,7 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
         // so we need to block the follower for a while instead of looping until
         // it comes back or be removed
         // dummy_id is unlock in block
+        r->_window.on_error();
         r->_reset_next_index();
         return r->_block(start_time_us, cntl->ErrorCode());
     }
@@ -480,6 +501,10 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                 min_flying_index, rpc_last_log_index,
                 r->_options.peer_id);
         int64_t rpc_latency_us = cntl->latency_us();
+        if (rpc_latency_us == 0) {
+            // Sent in a batch by AppendEntriesBatcher instead of |cntl|
+            rpc_latency_us = butil::monotonic_time_us() - rpc_send_time_us;
+        }
         if (FLAGS_raft_trace_append_entry_latency && 
             rpc_latency_us > FLAGS_raft_append_entry_high_lat_us) {
             LOG(WARNING) << "append entry rpc latency us " << rpc_latency_us
@@ -491,17 +516,21 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                          << " request data size " 
                          <<  cntl->request_attachment().size();
         }
-        g_send_entries_latency << cntl->latency_us();
+        g_send_entries_latency << rpc_latency_us;
         if (cntl->request_attachment().size() > 0) {
             g_normalized_send_entries_latency << 
-                cntl->latency_us() * 1024 / cntl->request_attachment().size();
+                rpc_latency_us * 1024 / cntl->request_attachment().size();
         }
+        r->_window.on_acked(butil::monotonic_time_us(), rpc_latency_us,
+                            cntl->request_attachment().size(),
+                            r->_append_entries_in_fly.size());
     }
     // A rpc is marked as success, means all request before it are success,
     // erase them sequentially.
     while (!r->_append_entries_in_fly.empty() &&
            r->_append_entries_in_fly.front().log_index <= rpc_first_index) {
         r->_flying_append_entries_size -= r->_append_entries_in_fly.front().entries_size;
+        r->_flying_append_entries_bytes -= r->_append_entries_in_fly.front().data_size;
         r->_append_entries_in_fly.pop_front();
     }
     r->_has_succeeded = true;
@@ -553,9 +582,17 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         // _id is unlock in _install_snapshot
         return _install_snapshot();
     }
+    // The batched heartbeats are not issued by |cntl|, which are left to be
+    // ignored by the replicator once it's stopped
+    const bool batch_heartbeat = is_heartbeat && FLAGS_raft_heartbeat_batch;
     if (is_heartbeat) {
-        _heartbeat_in_fly = cntl->call_id();
+        if (!batch_heartbeat) {
+            _heartbeat_in_fly = cntl->call_id();
+        }
         _heartbeat_counter++;
+        if (_quiescent) {
+            request->set_quiescent(true);
+        }
         // set RPC timeout for heartbeat, how long should timeout be is waiting to be optimized.
         cntl->set_timeout_ms(*_options.election_timeout_ms / 2);
     } else {
@@ -564,7 +601,7 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         _st.last_log_index = _next_index - 1;
         CHECK(_append_entries_in_fly.empty());
         CHECK_EQ(_flying_append_entries_size, 0);
-        _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index, 0, cntl->call_id()));
+        _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index, 0, 0, cntl->call_id()));
         _append_entries_counter++;
     }
 
@@ -579,18 +616,32 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
                 _id.value, cntl.get(), request.get(), response.get(),
                 butil::monotonic_time_ms());
 
+    if (batch_heartbeat) {
+        AppendEntriesBatcher::GetInstance()->send_heartbeat(
+                _options.peer_id.addr, cntl.release(), request.release(),
+                response.release(), done);
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
     RaftService_Stub stub(&_sending_channel);
     stub.append_entries(cntl.release(), request.release(), 
                         response.release(), done);
     CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
 }
 
-int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
-    if (data->length() >= (size_t)FLAGS_raft_max_body_size) {
+int Replicator::_prepare_entry(int offset, LogEntry* prefetched, 
+                               EntryMeta* em, butil::IOBuf *data,
+                               size_t max_body_size) {
+    if (data->length() >= max_body_size) {
         return ERANGE;
     }
     const int64_t log_index = _next_index + offset;
-    LogEntry *entry = _options.log_manager->get_entry(log_index);
+    LogEntry *entry = prefetched;
+    if (entry != NULL) {
+        entry->AddRef();
+    } else {
+        entry = _options.log_manager->get_entry(log_index);
+    }
     if (entry == NULL) {
         return ENOENT;
     }
@@ -600,6 +651,7 @@ int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
     // until the replicator leave readonly mode.
     if (_readonly_index != 0 && log_index >= _readonly_index) {
         if (entry->type != ENTRY_TYPE_CONFIGURATION) {
+            entry->Release();
             return EREADONLY;
         }
         _readonly_index = log_index + 1;
@@ -625,10 +677,44 @@ int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
     return 0;
 }
 
+bool Replicator::_has_room_in_window() {
+    // Stick to one request at a time until the follower recovers from errors
+    const size_t max_rpcs = (FLAGS_raft_adaptive_pipeline_window &&
+                             _consecutive_error_times > 0)
+                            ? 1 : _window.max_rpcs();
+    return _flying_append_entries_size < FLAGS_raft_max_entries_size &&
+           _append_entries_in_fly.size() < max_rpcs &&
+           _flying_append_entries_bytes < _window.max_bytes();
+}
+
+int Replicator::_prepare_entries(int max_entries_size, size_t max_body_size,
+                                 AppendEntriesRequest* request,
+                                 butil::IOBuf* data) {
+    EntryMeta em;
+    int prepare_entry_rc = 0;
+    // Lagging followers need the entries evicted from memory, which are read
+    // from storage in batch
+    std::vector<LogEntry*> entries;
+    _options.log_manager->get_entries(_next_index, 
+                                      _next_index + max_entries_size - 1,
+                                      max_body_size, &entries);
+    for (int i = 0; i < max_entries_size; ++i) {
+        LogEntry* prefetched = i < (int)entries.size() ? entries[i] : NULL;
+        prepare_entry_rc = _prepare_entry(i, prefetched, &em, data,
+                                          max_body_size);
+        if (prepare_entry_rc != 0) {
+            break;
+        }
+        request->add_entries()->Swap(&em);
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    return prepare_entry_rc;
+}
+
 void Replicator::_send_entries() {
-    if (_flying_append_entries_size >= FLAGS_raft_max_entries_size ||
-        _append_entries_in_fly.size() >= (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num ||
-        _st.st == BLOCKING) {
+    if (!_has_room_in_window() || _st.st == BLOCKING) {
         BRAFT_VLOG << "node " << _options.group_id << ":" << _options.server_id
             << " skip sending AppendEntriesRequest to " << _options.peer_id
             << ", too many requests in flying, or the replicator is in block,"
@@ -644,16 +730,38 @@ void Replicator::_send_entries() {
         _reset_next_index();
         return _install_snapshot();
     }
-    EntryMeta em;
     const int max_entries_size = FLAGS_raft_max_entries_size - _flying_append_entries_size;
+    const size_t max_body_size = std::min((int64_t)FLAGS_raft_max_body_size,
+            _window.max_bytes() - _flying_append_entries_bytes);
     int prepare_entry_rc = 0;
     CHECK_GT(max_entries_size, 0);
-    for (int i = 0; i < max_entries_size; ++i) {
-        prepare_entry_rc = _prepare_entry(i, &em, &cntl->request_attachment());
-        if (prepare_entry_rc != 0) {
-            break;
+    // A follower in readonly mode stops at _readonly_index, which is not the
+    // batch of the others
+    const bool share_entries = FLAGS_raft_share_encoded_entries
+                               && _options.entries_cache != NULL
+                               && _readonly_index == 0;
+    scoped_refptr<EncodedEntries> batch;
+    if (share_entries) {
+        batch = _options.entries_cache->get(
+                _options.term, _next_index, max_entries_size, max_body_size,
+                _options.log_manager->last_log_index());
+    }
+    if (batch != NULL) {
+        *request->mutable_entries() = batch->entries;
+        cntl->request_attachment().append(batch->data);
+    } else {
+        prepare_entry_rc = _prepare_entries(max_entries_size, max_body_size,
+                                            request.get(),
+                                            &cntl->request_attachment());
+        if (share_entries && request->entries_size() > 0) {
+            batch = new EncodedEntries;
+            batch->term = _options.term;
+            batch->first_index = _next_index;
+            batch->entries = request->entries();
+            batch->data = cntl->request_attachment();
+            batch->full = (prepare_entry_rc != ENOENT);
+            _options.entries_cache->put(batch.get());
         }
-        request->add_entries()->Swap(&em);
     }
     if (request->entries_size() == 0) {
         // _id is unlock in _wait_more
@@ -674,11 +782,15 @@ void Replicator::_send_entries() {
         return _wait_more_entries();
     }
 
+    const bool batched = FLAGS_raft_append_entries_batch;
     _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index,
-                                     request->entries_size(), cntl->call_id()));
+                                     request->entries_size(),
+                                     cntl->request_attachment().size(),
+                                     cntl->call_id(), batched));
     _append_entries_counter++;
     _next_index += request->entries_size();
     _flying_append_entries_size += request->entries_size();
+    _flying_append_entries_bytes += cntl->request_attachment().size();
     
     g_send_entries_batch_counter << request->entries_size();
 
@@ -694,6 +806,12 @@ void Replicator::_send_entries() {
     google::protobuf::Closure* done = brpc::NewCallback(
                 _on_rpc_returned, _id.value, cntl.get(), 
                 request.get(), response.get(), butil::monotonic_time_ms());
+    if (batched) {
+        AppendEntriesBatcher::GetInstance()->send_append_entries(
+                _options.peer_id.addr, cntl.release(), request.release(),
+                response.release(), done);
+        return _wait_more_entries();
+    }
     RaftService_Stub stub(&_sending_channel);
     stub.append_entries(cntl.release(), request.release(), 
                         response.release(), done);
@@ -741,8 +859,7 @@ int Replicator::_continue_sending(void* arg, int error_code) {
 }
 
 void Replicator::_wait_more_entries() {
-    if (_wait_id == 0 && FLAGS_raft_max_entries_size > _flying_append_entries_size &&
-        (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num > _append_entries_in_fly.size()) {
+    if (_wait_id == 0 && _has_room_in_window()) {
         _wait_id = _options.log_manager->wait(
                 _next_index - 1, _continue_sending, (void*)_id.value);
         _is_waiter_canceled = false;
@@ -1060,7 +1177,10 @@ void Replicator::_cancel_append_entries_rpcs() {
     for (std::deque<FlyingAppendEntriesRpc>::iterator rpc_it =
         _append_entries_in_fly.begin();
         rpc_it != _append_entries_in_fly.end(); ++rpc_it) {
-        brpc::StartCancel(rpc_it->call_id);
+        // The response of a batched one is ignored as it's no longer in fly
+        if (!rpc_it->batched) {
+            brpc::StartCancel(rpc_it->call_id);
+        }
     }
     _append_entries_in_fly.clear();
 }
@@ -1068,6 +1188,7 @@ void Replicator::_cancel_append_entries_rpcs() {
 void Replicator::_reset_next_index() {
     _next_index -= _flying_append_entries_size;
     _flying_append_entries_size = 0;
+    _flying_append_entries_bytes = 0;
     _cancel_append_entries_rpcs();
     _is_waiter_canceled = true;
     if (_wait_id != 0) {
@@ -1206,6 +1327,23 @@ int Replicator::change_readonly_config(ReplicatorId id, bool readonly) {
     return r->_change_readonly_config(readonly);
 }
 
+int Replicator::set_quiescent(ReplicatorId id, bool quiescent) {
+    Replicator *r = NULL;
+    bthread_id_t dummy_id = { id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return -1;
+    }
+    r->_quiescent = quiescent;
+    const bool resume_heartbeat = !quiescent && r->_heartbeat_stopped;
+    r->_heartbeat_stopped = false;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+    if (resume_heartbeat) {
+        // Send a heartbeat now to wake up the follower
+        _on_timedout((void*)id);
+    }
+    return 0;
+}
+
 int Replicator::_change_readonly_config(bool readonly) {
     if ((readonly && _readonly_index != 0) ||
         (!readonly && _readonly_index == 0)) {
@@ -1262,6 +1400,8 @@ void Replicator::_describe(std::ostream& os, bool use_html) {
     const int64_t append_entries_counter = _append_entries_counter;
     const int64_t install_snapshot_counter = _install_snapshot_counter;
     const int64_t readonly_index = _readonly_index;
+    const bool heartbeat_stopped = _heartbeat_stopped;
+    const PipelineWindow window = _window;
     CHECK_EQ(0, bthread_id_unlock(_id));
     // Don't touch *this ever after
     const char* new_line = use_html ? "<br>" : "\r\n";
@@ -1289,6 +1429,10 @@ void Replicator::_describe(std::ostream& os, bool use_html) {
     if (consecutive_error_times != 0) {
         os << " consecutive_error_times=" << consecutive_error_times;
     }
+    if (heartbeat_stopped) {
+        os << " quiescent";
+    }
+    window.describe(os);
     os << " hc=" << heartbeat_counter << " ac=" << append_entries_counter << " ic=" << install_snapshot_counter << new_line;
 }
 
@@ -1370,6 +1514,7 @@ int ReplicatorGroup::init(const NodeId& node_id, const ReplicatorGroupOptions& o
     _common_options.snapshot_storage = options.snapshot_storage;
     _common_options.snapshot_throttle = options.snapshot_throttle;
     _common_options.replicator_status = NULL;
+    _common_options.entries_cache = &_entries_cache;
     return 0;
 }
 
@@ -1435,6 +1580,7 @@ int ReplicatorGroup::stop_all() {
     for (size_t i = 0; i < rids.size(); ++i) {
         Replicator::stop(rids[i]);
     }
+    _entries_cache.clear();
     return 0;
 }
 
@@ -1442,6 +1588,25 @@ bool ReplicatorGroup::contains(const PeerId& peer) const {
     return _rmap.find(peer) != _rmap.end();
 }
 
+bool ReplicatorGroup::all_caught_up(int64_t next_index) const {
+    for (std::map<PeerId, ReplicatorIdAndStatus>::const_iterator
+            iter = _rmap.begin(); iter != _rmap.end(); ++iter) {
+        if (Replicator::get_next_index(iter->second.id) != next_index
+                || Replicator::get_consecutive_error_times(
+                        iter->second.id) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ReplicatorGroup::set_quiescent(bool quiescent) {
+    for (std::map<PeerId, ReplicatorIdAndStatus>::const_iterator
+            iter = _rmap.begin(); iter != _rmap.end(); ++iter) {
+        Replicator::set_quiescent(iter->second.id, quiescent);
+    }
+}
+
 int ReplicatorGroup::reset_term(int64_t new_term) {
     if (new_term <= _common_options.term) {
         CHECK_GT(new_term, _common_options.term) << "term cannot be decreased";
@@ -27,6 +27,8 @@
 #include "braft/configuration.h"                 // Configuration
 #include "braft/raft.pb.h"                       // AppendEntriesRequest
 #include "braft/log_manager.h"                   // LogManager
+#include "braft/pipeline_window.h"               // PipelineWindow
+#include "braft/encoded_entries_cache.h"         // EncodedEntriesCache
 
 namespace braft {
 
@@ -57,6 +59,7 @@ struct ReplicatorOptions {
     SnapshotStorage* snapshot_storage;
     SnapshotThrottle* snapshot_throttle;
     ReplicatorStatus* replicator_status;
+    EncodedEntriesCache* entries_cache;
 };
 
 typedef uint64_t ReplicatorId;
@@ -127,6 +130,11 @@ public:
 
     // Check if a replicator is readonly
     static bool readonly(ReplicatorId id);
+
+    // Stop sending heartbeats once the follower has acknowledged a quiescent
+    // one, or resume them right away.
+    // Return 0 on success, -1 otherwise.
+    static int set_quiescent(ReplicatorId id, bool quiescent);
     
 private:
     enum St {
@@ -150,7 +158,14 @@ private:
     Replicator();
     ~Replicator();
 
-    int _prepare_entry(int offset, EntryMeta* em, butil::IOBuf* data);
+    int _prepare_entry(int offset, LogEntry* prefetched, EntryMeta* em,
+                       butil::IOBuf* data, size_t max_body_size);
+    // Whether another AppendEntries request fits in the pipeline window
+    bool _has_room_in_window();
+    // Fill |request| and |data| with the logs from _next_index, returns the
+    // error of _prepare_entry which stopped the batch
+    int _prepare_entries(int max_entries_size, size_t max_body_size,
+                         AppendEntriesRequest* request, butil::IOBuf* data);
     void _wait_more_entries();
     void _send_empty_entries(bool is_heartbeat);
     void _send_entries();
@@ -231,14 +246,23 @@ private:
     struct FlyingAppendEntriesRpc {
         int64_t log_index;
         int entries_size;
+        int64_t data_size;
         brpc::CallId call_id;
-        FlyingAppendEntriesRpc(int64_t index, int size, brpc::CallId id)
-            : log_index(index), entries_size(size), call_id(id) {}
+        int64_t send_time_us;
+        // Sent by AppendEntriesBatcher, of which |call_id| doesn't belong to
+        // any RPC and must not be canceled
+        bool batched;
+        FlyingAppendEntriesRpc(int64_t index, int size, int64_t bytes,
+                               brpc::CallId id, bool in_batch = false)
+            : log_index(index), entries_size(size), data_size(bytes)
+            , call_id(id), send_time_us(butil::monotonic_time_us())
+            , batched(in_batch) {}
     };
     
     brpc::Channel _sending_channel;
     int64_t _next_index;
     int64_t _flying_append_entries_size;
+    int64_t _flying_append_entries_bytes;
     int _consecutive_error_times;
     bool _has_succeeded;
     int64_t _timeout_now_index;
@@ -246,8 +270,12 @@ private:
     int64_t _append_entries_counter;
     int64_t _install_snapshot_counter;
     int64_t _readonly_index;
+    bool _quiescent;
+    // No heartbeat timer is running as the follower is quiescent
+    bool _heartbeat_stopped;
     Stat _st;
     std::deque<FlyingAppendEntriesRpc> _append_entries_in_fly;
+    PipelineWindow _window;
     brpc::CallId _install_snapshot_in_fly;
     brpc::CallId _heartbeat_in_fly;
     brpc::CallId _timeout_now_in_fly;
@@ -323,6 +351,14 @@ public:
     // Returns true if the there's a replicator attached to the given |peer|
     bool contains(const PeerId& peer) const;
 
+    // Returns true if all the logs before |next_index| have been replicated
+    // to every follower, and none of them is failing
+    bool all_caught_up(int64_t next_index) const;
+
+    // Stop or resume the heartbeats of all the replicators, see
+    // Replicator::set_quiescent
+    void set_quiescent(bool quiescent);
+
     // Transfer leadership to the given |peer|
     int transfer_leadership_to(const PeerId& peer, int64_t log_index);
 
@@ -368,6 +404,7 @@ private:
     };
 
     std::map<PeerId, ReplicatorIdAndStatus> _rmap;
+    EncodedEntriesCache _entries_cache;
     ReplicatorOptions _common_options;
     int _dynamic_timeout_ms;
     int _election_timeout_ms;
@@ -0,0 +1,118 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_RING_QUEUE_H
+#define  BRAFT_RING_QUEUE_H
+
+#include <algorithm>
+#include <butil/logging.h>
+#include <butil/macros.h>
+
+namespace braft {
+
+// FIFO queue on a ring of which the capacity is doubled when it's full, and
+// halved (down to the initial capacity) when it's less than a quarter full,
+// so that pushing and popping don't allocate in the steady state while an
+// idle queue doesn't hold the memory of a past burst. Popped elements are not
+// destroyed but left in the ring to be reused by the following appends.
+// Not thread-safe.
+template <typename T>
+class RingQueue {
+public:
+    explicit RingQueue(size_t initial_capacity = 16)
+        : _items(NULL), _mask(0), _begin(0), _size(0), _min_capacity(1) {
+        while (_min_capacity < initial_capacity) {
+            _min_capacity <<= 1;
+        }
+        _items = new T[_min_capacity];
+        _mask = _min_capacity - 1;
+    }
+    ~RingQueue() { delete [] _items; }
+
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _mask + 1; }
+
+    // The |i|-th element from the front
+    T& operator[](size_t i) { return _items[(_begin + i) & _mask]; }
+    const T& operator[](size_t i) const { return _items[(_begin + i) & _mask]; }
+    T& front() { return (*this)[0]; }
+    T& back() { return (*this)[_size - 1]; }
+
+    // Append |n| elements which are left by the previous pops or default
+    // constructed, the caller should reset them with operator[]
+    void append(size_t n) {
+        if (_size + n > capacity()) {
+            size_t new_capacity = capacity() * 2;
+            while (new_capacity < _size + n) {
+                new_capacity <<= 1;
+            }
+            resize(new_capacity);
+        }
+        _size += n;
+    }
+
+    void push_back(const T& item) {
+        append(1);
+        back() = item;
+    }
+
+    // Remove the first |n| elements
+    void pop_front(size_t n = 1) {
+        CHECK_LE(n, _size);
+        _begin = (_begin + n) & _mask;
+        _size -= n;
+        if (_size < capacity() / 4 && capacity() > _min_capacity) {
+            size_t new_capacity = capacity() / 2;
+            while (_size < new_capacity / 4 && new_capacity > _min_capacity) {
+                new_capacity >>= 1;
+            }
+            resize(new_capacity);
+        }
+    }
+
+    void clear() { pop_front(_size); }
+
+    void swap(RingQueue& rhs) {
+        std::swap(_items, rhs._items);
+        std::swap(_mask, rhs._mask);
+        std::swap(_begin, rhs._begin);
+        std::swap(_size, rhs._size);
+        std::swap(_min_capacity, rhs._min_capacity);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RingQueue);
+
+    void resize(size_t capacity) {
+        T* items = new T[capacity];
+        for (size_t i = 0; i < _size; ++i) {
+            std::swap(items[i], (*this)[i]);
+        }
+        delete [] _items;
+        _items = items;
+        _mask = capacity - 1;
+        _begin = 0;
+    }
+
+    T* _items;
+    size_t _mask;
+    size_t _begin;
+    size_t _size;
+    size_t _min_capacity;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_RING_QUEUE_H
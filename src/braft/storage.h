@@ -137,15 +137,57 @@ public:
     // get logentry by index
     virtual LogEntry* get_entry(const int64_t index) = 0;
 
+    // get logentries in [first_index, last_index] and append them to
+    // |entries|, stopping once their data reaches |max_bytes| with one entry
+    // at least. Returns the number of entries got, which are referenced for
+    // the caller
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+        size_t bytes = 0;
+        int64_t index = first_index;
+        for (; index <= last_index && (index == first_index || bytes < max_bytes);
+                ++index) {
+            LogEntry* entry = get_entry(index);
+            if (entry == NULL) {
+                break;
+            }
+            bytes += entry->data.length();
+            entries->push_back(entry);
+        }
+        return index - first_index;
+    }
+
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index) = 0;
 
     // append entries to log
     virtual int append_entry(const LogEntry* entry) = 0;
 
+    // encode |entries| ahead of appending them, which is called in the order
+    // of appending but in another thread, so that encoding the following
+    // entries overlaps writing the former ones. Appending works without it,
+    // and storages which don't encode entries need not implement it.
+    virtual void prepare_entries(const std::vector<LogEntry*>& entries) {}
+
     // append entries to log and update IOMetric, return append success number 
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) = 0;
 
+    // append entries to log without waiting for them to be durable, return
+    // append success number. sync_entries() is called later from another
+    // thread, possibly while the following entries are being appended by
+    // this function, so the two must be safe to run concurrently. Truncating
+    // or resetting the storage waits for all the pending sync_entries() to
+    // finish. Storages which can't separate writing from syncing just append
+    // the entries synchronously.
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric) {
+        return append_entries(entries, metric);
+    }
+
+    // make all the entries appended by append_entries_nosync() before this
+    // call durable, return 0 on success
+    virtual int sync_entries() { return 0; }
+
     // delete logs from storage's head, [first_log_index, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept) = 0;
 
@@ -15,6 +15,7 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include <gtest/gtest.h>
+#include <butil/endpoint.h>
 #include "braft/ballot.h"
 
 class BallotTest : public testing::Test {};
@@ -28,8 +29,10 @@ TEST(BallotTest, sanity) {
     conf.add_peer(peer1);
     conf.add_peer(peer2);
     conf.add_peer(peer3);
+    braft::BallotVoters voters;
+    ASSERT_EQ(0, voters.init(conf, NULL));
     braft::Ballot bl;
-    ASSERT_EQ(0, bl.init(conf, NULL));
+    bl.init(&voters);
     ASSERT_EQ(2, bl._quorum);
     ASSERT_EQ(0, bl._old_quorum);
     bl.grant(peer1);
@@ -53,8 +56,10 @@ TEST(BallotTest, joint_consensus_same_conf) {
     conf.add_peer(peer1);
     conf.add_peer(peer2);
     conf.add_peer(peer3);
+    braft::BallotVoters voters;
+    ASSERT_EQ(0, voters.init(conf, &conf));
     braft::Ballot bl;
-    ASSERT_EQ(0, bl.init(conf, &conf));
+    bl.init(&voters);
     ASSERT_EQ(2, bl._quorum);
     ASSERT_EQ(2, bl._old_quorum);
     bl.grant(peer1);
@@ -91,8 +96,10 @@ TEST(BallotTest, joint_consensus_different_conf) {
     conf2.add_peer(peer2);
     conf2.add_peer(peer3);
     conf2.add_peer(peer4);
+    braft::BallotVoters voters;
+    ASSERT_EQ(0, voters.init(conf, &conf2));
     braft::Ballot bl;
-    ASSERT_EQ(0, bl.init(conf, &conf2));
+    bl.init(&voters);
     bl.grant(peer1);
     bl.grant(peer2);
     ASSERT_FALSE(bl.granted());
@@ -101,3 +108,77 @@ TEST(BallotTest, joint_consensus_different_conf) {
     bl.grant(peer4);
     ASSERT_TRUE(bl.granted());
 }
+
+TEST(BallotTest, voters) {
+    braft::Configuration conf;
+    for (size_t i = 0; i < braft::BallotVoters::MAX_PEERS; ++i) {
+        conf.add_peer(braft::PeerId(butil::EndPoint(butil::my_ip(), 1000 + i)));
+    }
+    braft::BallotVoters voters;
+    ASSERT_EQ(0, voters.init(conf, NULL));
+    ASSERT_TRUE(voters.equals(conf, NULL));
+    ASSERT_FALSE(voters.equals(conf, &conf));
+    braft::Ballot bl;
+    bl.init(&voters);
+    braft::Ballot::PosHint hint;
+    for (braft::Configuration::const_iterator
+            iter = conf.begin(); iter != conf.end(); ++iter) {
+        hint = bl.grant(*iter, hint);
+        ASSERT_GE(hint.pos0, 0);
+        ASSERT_EQ(-1, hint.pos1);
+    }
+    ASSERT_TRUE(bl.granted());
+    // Granted only once by each peer
+    ASSERT_EQ((int)braft::BallotVoters::MAX_PEERS / 2 + 1
+                    - (int)braft::BallotVoters::MAX_PEERS, bl._quorum);
+    // Reused without allocation
+    bl.init(&voters);
+    ASSERT_FALSE(bl.granted());
+
+    conf.add_peer(braft::PeerId(butil::EndPoint(butil::my_ip(), 999)));
+    ASSERT_EQ(EINVAL, voters.init(conf, NULL));
+}
+
+TEST(BallotTest, quorum_tracker) {
+    braft::PeerId peer1("127.0.0.1:1");
+    braft::PeerId peer2("127.0.0.1:2");
+    braft::PeerId peer3("127.0.0.1:3");
+    braft::PeerId peer4("127.0.0.1:4");
+    braft::Configuration conf;
+    conf.add_peer(peer1);
+    conf.add_peer(peer2);
+    conf.add_peer(peer3);
+    braft::QuorumTracker tracker;
+    tracker.set_configuration(1, conf, NULL);
+    tracker.set_last_index(100);
+    ASSERT_EQ(0, tracker.grant(peer1, 50));
+    ASSERT_EQ(0, tracker.grant(peer4, 80));
+    ASSERT_EQ(30, tracker.grant(peer2, 30));
+    // Never goes back
+    ASSERT_EQ(30, tracker.grant(peer2, 10));
+    ASSERT_EQ(50, tracker.grant(peer3, 60));
+    ASSERT_EQ(60, tracker.grant(peer1, 200));
+
+    // Replace peer3 with peer4 from 101 on
+    braft::Configuration conf2;
+    conf2.add_peer(peer1);
+    conf2.add_peer(peer2);
+    conf2.add_peer(peer4);
+    tracker.set_configuration(101, conf2, &conf);
+    tracker.set_configuration(101, conf2, &conf);
+    ASSERT_EQ(2u, tracker._current.segments.size());
+    tracker.set_last_index(200);
+    // Makes the quorum of the new configuration only
+    ASSERT_EQ(60, tracker.grant(peer4, 150));
+    ASSERT_EQ(150, tracker.grant(peer3, 150));
+    tracker.trim(101);
+    ASSERT_EQ(1u, tracker._current.segments.size());
+    ASSERT_EQ(150, tracker.grant(peer1, 200));
+
+    tracker.reset();
+    ASSERT_EQ(0, tracker.grant(peer1, 200));
+    tracker.set_configuration(201, conf, NULL);
+    tracker.set_last_index(300);
+    ASSERT_EQ(0, tracker.grant(peer1, 250));
+    ASSERT_EQ(250, tracker.grant(peer2, 250));
+}
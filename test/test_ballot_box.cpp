@@ -4,12 +4,19 @@
 // Date: 2016/02/03 15:59:18
 
 #include <algorithm>
+#include <pthread.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <butil/string_printf.h>
+#include <butil/time.h>
 #include "braft/ballot_box.h"
 #include "braft/configuration.h"
 #include "braft/fsm_caller.h"
 
+namespace braft {
+DECLARE_bool(raft_commit_by_quorum_tracker);
+}
+
 class BallotBoxTest : public testing::Test {
 protected:
     void SetUp() {}
@@ -122,6 +129,81 @@ TEST_F(BallotBoxTest, odd_cluster) {
                         num_tasks + 100, num_tasks + 100, peers[0]));
 }
 
+TEST_F(BallotBoxTest, pending_tasks) {
+    DummyCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox cm;
+    ASSERT_EQ(0, cm.init(opt));
+    ASSERT_EQ(0, cm.reset_pending_index(1));
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= 3; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    braft::Configuration conf(peers);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, cm.append_pending_task(conf, NULL, NULL, 10));
+    }
+    ASSERT_EQ(100, cm.pending_tasks());
+    ASSERT_EQ(1000, cm.pending_bytes());
+    ASSERT_EQ(0, cm.commit_at(1, 40, peers[0]));
+    ASSERT_EQ(0, cm.commit_at(1, 40, peers[1]));
+    ASSERT_EQ(60, cm.pending_tasks());
+    ASSERT_EQ(600, cm.pending_bytes());
+    ASSERT_EQ(0, cm.clear_pending_tasks());
+    ASSERT_EQ(0, cm.pending_tasks());
+    ASSERT_EQ(0, cm.pending_bytes());
+}
+
+TEST_F(BallotBoxTest, share_voters) {
+    DummyCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox cm;
+    ASSERT_EQ(0, cm.init(opt));
+    ASSERT_EQ(0, cm.reset_pending_index(1));
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= 4; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    braft::Configuration old_conf(peers);
+    peers.pop_back();
+    braft::Configuration conf(peers);
+    std::vector<braft::Closure*> closures(10, (braft::Closure*)NULL);
+    ASSERT_EQ(0, cm.append_pending_tasks(old_conf, NULL, &closures[0],
+                                         NULL, closures.size()));
+    ASSERT_EQ(0, cm.append_pending_tasks(conf, &old_conf, &closures[0],
+                                         NULL, closures.size()));
+    ASSERT_EQ(0, cm.append_pending_tasks(conf, NULL, &closures[0],
+                                         NULL, closures.size()));
+    ASSERT_EQ(0, cm.append_pending_tasks(conf, NULL, &closures[0],
+                                         NULL, closures.size()));
+    ASSERT_EQ(3u, cm._voters.size());
+    ASSERT_EQ(40, cm.pending_tasks());
+
+    ASSERT_EQ(0, cm.commit_at(1, 15, peers[0]));
+    ASSERT_EQ(0, cm.commit_at(1, 15, peers[1]));
+    ASSERT_EQ(0, caller.committed_index());
+    // The joint logs need the quorum of the old configuration too
+    ASSERT_EQ(0, cm.commit_at(1, 15, peers[2]));
+    ASSERT_EQ(15, caller.committed_index());
+    ASSERT_EQ(2u, cm._voters.size());
+    ASSERT_EQ(0, cm.commit_at(16, 40, peers[0]));
+    // Logs of the new configuration commit the joint ones before
+    ASSERT_EQ(0, cm.commit_at(16, 40, peers[1]));
+    ASSERT_EQ(40, caller.committed_index());
+    ASSERT_EQ(1u, cm._voters.size());
+    ASSERT_EQ(0, cm.pending_tasks());
+}
+
 TEST_F(BallotBoxTest, even_cluster) {
     DummyCaller caller;
     braft::ClosureQueue cq(false);
@@ -155,3 +237,145 @@ TEST_F(BallotBoxTest, even_cluster) {
     ASSERT_EQ(100, caller.committed_index());
 }
 
+
+TEST_F(BallotBoxTest, quorum_tracker) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_commit_by_quorum_tracker = true;
+    DummyCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox cm;
+    ASSERT_EQ(0, cm.init(opt));
+    ASSERT_EQ(0, cm.reset_pending_index(1));
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= 3; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    braft::Configuration conf(peers);
+    const int num_tasks = 10000;
+    for (int i = 0; i < num_tasks; ++i) {
+        ASSERT_EQ(0, cm.append_pending_task(conf, NULL, NULL, 10));
+    }
+    ASSERT_TRUE(cm._voters.empty());
+
+    ASSERT_EQ(0, cm.commit_at(1, 100, peers[0]));
+    ASSERT_EQ(0, caller.committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 100, peers[0]));
+    ASSERT_EQ(0, caller.committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 50, peers[1]));
+    ASSERT_EQ(50, caller.committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 100, peers[2]));
+    ASSERT_EQ(100, caller.committed_index());
+    ASSERT_EQ(num_tasks - 100, cm.pending_tasks());
+    ASSERT_EQ((num_tasks - 100) * 10, cm.pending_bytes());
+    ASSERT_NE(0, cm.commit_at(
+                        num_tasks + 100, num_tasks + 100, peers[0]));
+
+    // A new leadership starts over
+    ASSERT_EQ(0, cm.clear_pending_tasks());
+    ASSERT_EQ(0, cm.reset_pending_index(num_tasks + 1));
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, cm.append_pending_task(conf, NULL, NULL));
+    }
+    ASSERT_EQ(0, cm.commit_at(num_tasks + 1, num_tasks + 5, peers[1]));
+    ASSERT_EQ(100, caller.committed_index());
+    ASSERT_EQ(0, cm.commit_at(num_tasks + 1, num_tasks + 10, peers[0]));
+    ASSERT_EQ(num_tasks + 5, caller.committed_index());
+}
+
+class AtomicCaller : public braft::FSMCaller {
+public:
+    AtomicCaller() : _committed_index(0) {}
+    virtual int on_committed(int64_t committed_index) { 
+        int64_t prev = _committed_index.load(butil::memory_order_relaxed);
+        while (prev < committed_index && !_committed_index.compare_exchange_weak(
+                    prev, committed_index, butil::memory_order_relaxed)) {
+        }
+        return 0;
+    }
+    int64_t committed_index() const {
+        return _committed_index.load(butil::memory_order_relaxed);
+    }
+private:
+    butil::atomic<int64_t> _committed_index;
+};
+
+struct CommitArg {
+    braft::BallotBox* ballot_box;
+    braft::PeerId peer;
+    int64_t num_tasks;
+    int64_t batch_size;
+};
+
+static void* commit_tasks(void* arg) {
+    CommitArg* ca = (CommitArg*)arg;
+    for (int64_t i = 1; i <= ca->num_tasks; i += ca->batch_size) {
+        const int64_t last_index = std::min(i + ca->batch_size - 1,
+                                            ca->num_tasks);
+        EXPECT_EQ(0, ca->ballot_box->commit_at(i, last_index, ca->peer));
+    }
+    return NULL;
+}
+
+static int64_t benchmark_commit_at(bool use_quorum_tracker, int num_peers,
+                                   int64_t batch_size) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_commit_by_quorum_tracker = use_quorum_tracker;
+    AtomicCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox cm;
+    EXPECT_EQ(0, cm.init(opt));
+    EXPECT_EQ(0, cm.reset_pending_index(1));
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= num_peers; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    braft::Configuration conf(peers);
+    const int64_t num_tasks = 100000;
+    for (int64_t i = 0; i < num_tasks; ++i) {
+        cm.append_pending_task(conf, NULL, NULL);
+    }
+    // Each peer acknowledges the logs in its own thread as Replicators do
+    std::vector<pthread_t> threads(num_peers);
+    std::vector<CommitArg> args(num_peers);
+    butil::Timer timer;
+    timer.start();
+    for (int i = 0; i < num_peers; ++i) {
+        args[i].ballot_box = &cm;
+        args[i].peer = peers[i];
+        args[i].num_tasks = num_tasks;
+        args[i].batch_size = batch_size;
+        EXPECT_EQ(0, pthread_create(&threads[i], NULL, commit_tasks, &args[i]));
+    }
+    for (int i = 0; i < num_peers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    timer.stop();
+    EXPECT_EQ(num_tasks, caller.committed_index());
+    return timer.n_elapsed() / (num_tasks / batch_size * num_peers);
+}
+
+// Takes a while, run it with --gtest_also_run_disabled_tests
+TEST_F(BallotBoxTest, DISABLED_benchmark_commit_at) {
+    for (int num_peers = 3; num_peers <= 9; num_peers += 2) {
+        for (int64_t batch_size = 1; batch_size <= 256; batch_size *= 16) {
+            const int64_t ballot_ns =
+                    benchmark_commit_at(false, num_peers, batch_size);
+            const int64_t tracker_ns =
+                    benchmark_commit_at(true, num_peers, batch_size);
+            LOG(INFO) << "num_peers=" << num_peers
+                      << " batch_size=" << batch_size
+                      << " ballot_commit_at=" << ballot_ns << "ns"
+                      << " quorum_tracker_commit_at=" << tracker_ns << "ns";
+        }
+    }
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include "braft/encoded_entries_cache.h"
+
+class EncodedEntriesCacheTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+// |count| entries of |data_len| bytes each from |first_index|
+static braft::EncodedEntries* new_batch(int64_t term, int64_t first_index,
+                                        int count, int data_len, bool full) {
+    braft::EncodedEntries* batch = new braft::EncodedEntries;
+    batch->term = term;
+    batch->first_index = first_index;
+    batch->full = full;
+    for (int i = 0; i < count; ++i) {
+        braft::EntryMeta* em = batch->entries.Add();
+        em->set_term(term);
+        em->set_type(braft::ENTRY_TYPE_DATA);
+        em->set_data_len(data_len);
+        batch->data.append(std::string(data_len, 'a'));
+    }
+    return batch;
+}
+
+TEST_F(EncodedEntriesCacheTest, sanity) {
+    braft::EncodedEntriesCache cache;
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 10) == NULL);
+
+    scoped_refptr<braft::EncodedEntries> batch = new_batch(1, 10, 4, 100, false);
+    cache.put(batch.get());
+    ASSERT_EQ(13, batch->last_index());
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 13).get() == batch.get());
+    // Another term or index
+    ASSERT_TRUE(cache.get(2, 10, 1024, 1024, 13) == NULL);
+    ASSERT_TRUE(cache.get(1, 11, 1024, 1024, 13) == NULL);
+    // More logs were appended after the batch which is not full
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 14) == NULL);
+    // Too many entries for the request
+    ASSERT_TRUE(cache.get(1, 10, 3, 1024, 13) == NULL);
+    // The last entry may go beyond the body size, but not the others
+    ASSERT_TRUE(cache.get(1, 10, 1024, 301, 13).get() == batch.get());
+    ASSERT_TRUE(cache.get(1, 10, 1024, 300, 13) == NULL);
+
+    // A full batch is shared even if there are more logs
+    scoped_refptr<braft::EncodedEntries> full = new_batch(1, 20, 4, 100, true);
+    cache.put(full.get());
+    ASSERT_TRUE(cache.get(1, 20, 4, 1024, 100).get() == full.get());
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 13).get() == batch.get());
+
+    cache.clear();
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 13) == NULL);
+    ASSERT_TRUE(cache.get(1, 20, 4, 1024, 100) == NULL);
+    ASSERT_TRUE(batch->HasOneRef());
+    ASSERT_TRUE(full->HasOneRef());
+}
+
+TEST_F(EncodedEntriesCacheTest, replace) {
+    braft::EncodedEntriesCache cache;
+    scoped_refptr<braft::EncodedEntries> batch = new_batch(1, 10, 1, 10, false);
+    cache.put(batch.get());
+    // Lands on the same slot
+    scoped_refptr<braft::EncodedEntries> other = new_batch(1, 18, 1, 10, false);
+    cache.put(other.get());
+    ASSERT_TRUE(batch->HasOneRef());
+    ASSERT_TRUE(cache.get(1, 10, 1024, 1024, 10) == NULL);
+    ASSERT_TRUE(cache.get(1, 18, 1024, 1024, 18).get() == other.get());
+    // Replaced by the batch of a new term at the same index
+    scoped_refptr<braft::EncodedEntries> newer = new_batch(2, 18, 2, 10, false);
+    cache.put(newer.get());
+    ASSERT_TRUE(cache.get(1, 18, 1024, 1024, 18) == NULL);
+    ASSERT_TRUE(cache.get(2, 18, 1024, 1024, 19).get() == newer.get());
+}
@@ -4,6 +4,7 @@
 // Author: WangYao (fisherman), wangyao02@baidu.com
 // Date: 2015/10/08 17:00:05
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -1281,3 +1282,896 @@ TEST_F(LogStorageTest, append_close_load_append_with_io_metric) {
     delete storage;
     delete configuration_manager;
 }
+
+namespace braft {
+DECLARE_int32(raft_max_preallocated_segments);
+DECLARE_bool(raft_segment_index);
+DECLARE_int32(raft_max_load_segment_concurrency);
+}
+
+static void wait_spare_files(braft::SegmentLogStorage* storage, size_t num) {
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(storage->_mutex);
+            if (storage->_spare_files.size() == num 
+                    && storage->_preparing_spares == 0) {
+                return;
+            }
+        }
+        usleep(1000);
+    }
+}
+
+static size_t count_spare_files(const std::string& path) {
+    size_t count = 0;
+    butil::DirReaderPosix dir_reader(path.c_str());
+    while (dir_reader.Next()) {
+        if (0 == strncmp(dir_reader.name(), "log_spare_", strlen("log_spare_"))) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+TEST_F(LogStorageTest, preallocated_segments) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_max_preallocated_segments = 2;
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    wait_spare_files(storage, 2);
+    ASSERT_EQ(2u, count_spare_files("./data"));
+
+    for (int i = 0; i < 10000; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = i + 1;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        entry->data.append(data_buf);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    wait_spare_files(storage, 2);
+    ASSERT_LT(3u, storage->_segments.size());
+
+    // Discarded segments are recycled into the pool
+    braft::FLAGS_raft_max_preallocated_segments = 4;
+    const int64_t first_index_kept = 
+            (++(++storage->_segments.begin()))->second->last_index() + 1;
+    ASSERT_EQ(0, storage->truncate_prefix(first_index_kept));
+    wait_spare_files(storage, 4);
+    ASSERT_EQ(4u, count_spare_files("./data"));
+
+    // Restart without closing the preallocated open segment
+    delete storage;
+    delete configuration_manager;
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(first_index_kept, storage->first_log_index());
+    ASSERT_EQ(10000, storage->last_log_index());
+    wait_spare_files(storage, 4);
+    for (int i = first_index_kept; i <= 10000; i++) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+    delete storage;
+    delete configuration_manager;
+}
+
+TEST_F(LogStorageTest, torn_entry_in_preallocated_segment) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_max_preallocated_segments = 1;
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    wait_spare_files(storage, 1);
+
+    const std::string data(2048, 'a');
+    for (int i = 0; i < 5; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = i + 1;
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    ASSERT_TRUE(storage->_open_segment->_preallocated);
+    const std::string path = "./data/" + storage->_open_segment->file_name();
+    delete storage;
+    delete configuration_manager;
+
+    // Entry 3 is at [4144, 6216), leave one of its sectors unwritten
+    int fd = ::open(path.c_str(), O_RDWR);
+    ASSERT_LE(0, fd);
+    char zeros[512] = {};
+    ASSERT_EQ(512, pwrite(fd, zeros, sizeof(zeros), 4608));
+    ::close(fd);
+
+    // Found even if segments are no longer preallocated
+    braft::FLAGS_raft_max_preallocated_segments = 0;
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(2, storage->last_log_index());
+    struct stat st_buf;
+    ASSERT_EQ(0, stat(path.c_str(), &st_buf));
+    ASSERT_EQ(2 * (24 + 2048), st_buf.st_size);
+    delete storage;
+    delete configuration_manager;
+}
+
+static void append_entries_with_configuration(braft::LogStorage* storage,
+                                              int64_t first_index, 
+                                              int64_t last_index) {
+    for (int64_t index = first_index; index <= last_index; ) {
+        std::vector<braft::LogEntry*> entries;
+        for (; index <= last_index && entries.size() < 100; ++index) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->id.term = index / 1000 + 1;
+            entry->id.index = index;
+            if (index % 100000 == 0) {
+                entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+                entry->peers = new std::vector<braft::PeerId>;
+                entry->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+                entry->peers->push_back(braft::PeerId("1.1.1.1:2000:0"));
+            } else {
+                entry->type = braft::ENTRY_TYPE_DATA;
+                char data_buf[128];
+                snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+                entry->data.append(data_buf);
+            }
+            entries.push_back(entry);
+        }
+        ASSERT_EQ((int)entries.size(), storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+}
+
+static void check_entries_with_configuration(braft::LogStorage* storage,
+                                             braft::ConfigurationManager* cm,
+                                             int64_t first_index,
+                                             int64_t last_index) {
+    ASSERT_EQ(first_index, storage->first_log_index());
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        ASSERT_EQ(index / 1000 + 1, storage->get_term(index));
+    }
+    for (int64_t index = first_index; index <= last_index; index += 997) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index, entry->id.index);
+        ASSERT_EQ(index / 1000 + 1, entry->id.term);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+    for (int64_t index = 100000; index <= last_index; index += 100000) {
+        braft::ConfigurationEntry conf;
+        cm->get(index, &conf);
+        ASSERT_EQ(index, conf.id.index);
+        ASSERT_EQ(2u, conf.conf.size());
+    }
+}
+
+TEST_F(LogStorageTest, load_segments_with_index) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    const int64_t N = 2000000;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_entries_with_configuration(storage, 1, N);
+    ASSERT_LT(5u, storage->_segments.size());
+    delete storage;
+    delete configuration_manager;
+
+    butil::Timer timer;
+    timer.start();
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    timer.stop();
+    const long elp_index = timer.u_elapsed();
+    check_entries_with_configuration(storage, configuration_manager, 1, N);
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_segment_index = false;
+    timer.start();
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    timer.stop();
+    const long elp_scan = timer.u_elapsed();
+    check_entries_with_configuration(storage, configuration_manager, 1, N);
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_index = true;
+
+    LOG(INFO) << "load " << N << " entries with index=" << elp_index 
+              << "us scan=" << elp_scan << "us";
+
+    // Broken and missing index files fall back to scanning segments
+    butil::DirReaderPosix dir_reader("./data");
+    ASSERT_TRUE(dir_reader.IsValid());
+    int nindex = 0;
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), "log_index_", strlen("log_index_")) != 0) {
+            continue;
+        }
+        std::string path("./data/");
+        path.append(dir_reader.name());
+        if (nindex++ % 2 == 0) {
+            int fd = ::open(path.c_str(), O_RDWR);
+            ASSERT_LE(0, fd);
+            struct stat st_buf;
+            ASSERT_EQ(0, fstat(fd, &st_buf));
+            char c = 'x';
+            ASSERT_EQ(1, pwrite(fd, &c, 1, st_buf.st_size / 2));
+            ::close(fd);
+        } else {
+            ASSERT_EQ(0, ::unlink(path.c_str()));
+        }
+    }
+    ASSERT_LT(1, nindex);
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_entries_with_configuration(storage, configuration_manager, 1, N);
+
+    // Index is removed along with truncated segments
+    const int64_t last_index_kept = 
+            storage->_segments.rbegin()->second->first_index() + 10;
+    ASSERT_EQ(0, storage->truncate_suffix(last_index_kept));
+    ASSERT_EQ(0, storage->truncate_prefix(
+                    (++storage->_segments.begin())->second->first_index()));
+    delete storage;
+    delete configuration_manager;
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    int nsegments = storage->_segments.size() + (storage->_open_segment ? 1 : 0);
+    int nfiles = 0;
+    nindex = 0;
+    butil::DirReaderPosix dir_reader2("./data");
+    while (dir_reader2.Next()) {
+        nindex += strncmp(dir_reader2.name(), "log_index_", strlen("log_index_")) == 0;
+        nfiles += strncmp(dir_reader2.name(), "log_0", strlen("log_0")) == 0
+               || strncmp(dir_reader2.name(), "log_inprogress_", strlen("log_inprogress_")) == 0;
+    }
+    ASSERT_EQ((int)storage->_segments.size(), nindex);
+    ASSERT_EQ(nsegments, nfiles);
+    delete storage;
+    delete configuration_manager;
+}
+
+TEST_F(LogStorageTest, parallel_load_segments) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    const int64_t N = 2000000;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_entries_with_configuration(storage, 1, N);
+    ASSERT_LT(5u, storage->_segments.size());
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_segment_index = false;
+    const int32_t concurrency[] = { 1, 8 };
+    long elp[ARRAY_SIZE(concurrency)];
+    for (size_t i = 0; i < ARRAY_SIZE(concurrency); ++i) {
+        braft::FLAGS_raft_max_load_segment_concurrency = concurrency[i];
+        butil::Timer timer;
+        timer.start();
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        timer.stop();
+        elp[i] = timer.u_elapsed();
+        check_entries_with_configuration(storage, configuration_manager, 1, N);
+        ASSERT_EQ(N / 100000 * 100000, 
+                  configuration_manager->last_configuration().id.index);
+        delete storage;
+        delete configuration_manager;
+    }
+    braft::FLAGS_raft_segment_index = true;
+    LOG(INFO) << "load " << N << " entries with concurrency=1 in " << elp[0]
+              << "us, concurrency=8 in " << elp[1] << "us";
+
+    // A broken segment in the middle fails the init
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    scoped_refptr<braft::Segment> segment = 
+            (++(++storage->_segments.begin()))->second;
+    std::string path = "./data/" + segment->file_name();
+    segment = NULL;
+    delete storage;
+    delete configuration_manager;
+    ASSERT_EQ(0, truncate_uninterrupted(path.c_str(), file_size(path.c_str()) - 1));
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_NE(0, storage->init(configuration_manager));
+    delete storage;
+    delete configuration_manager;
+}
+
+namespace braft {
+DECLARE_bool(raft_segment_direct_io);
+DECLARE_int32(raft_direct_io_read_cache_size);
+DECLARE_bool(raft_segment_batch_frame);
+}
+
+static void append_direct_io_entries(braft::LogStorage* storage,
+                                     int64_t first_index, int64_t last_index,
+                                     int64_t term) {
+    const int64_t batch = 10;
+    for (int64_t index = first_index; index <= last_index; index += batch) {
+        std::vector<braft::LogEntry*> entries;
+        for (int64_t i = index; i < index + batch && i <= last_index; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = term;
+            entry->id.index = i;
+            // Sizes vary so that entries straddle the aligned blocks
+            entry->data.append(std::string(i % 300, 'a' + i % 26));
+            entries.push_back(entry);
+        }
+        ASSERT_EQ((int)entries.size(), storage->append_entries(entries, NULL));
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+        }
+    }
+}
+
+static void check_direct_io_entries(braft::LogStorage* storage,
+                                    int64_t first_index, int64_t last_index,
+                                    int64_t term) {
+    for (int64_t i = first_index; i <= last_index; ++i) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL) << "index=" << i;
+        ASSERT_EQ(term, entry->id.term);
+        ASSERT_EQ(std::string(i % 300, 'a' + i % 26), entry->data.to_string());
+        entry->Release();
+    }
+}
+
+TEST_F(LogStorageTest, direct_io_segments) {
+    system("rm -rf ./data");
+    ASSERT_EQ(0, mkdir("./data", 0755));
+#if defined(O_DIRECT)
+    int probe_fd = ::open("./data/probe", O_RDWR | O_CREAT | O_DIRECT, 0644);
+#else
+    int probe_fd = -1;
+#endif
+    if (probe_fd < 0) {
+        LOG(WARNING) << "O_DIRECT is not supported here, skip the test";
+        return;
+    }
+    ::close(probe_fd);
+    ::unlink("./data/probe");
+
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    // Two chunks to get evicted frequently
+    braft::FLAGS_raft_direct_io_read_cache_size = 128 * 1024;
+    braft::FLAGS_raft_segment_direct_io = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_direct_io_entries(storage, 1, 5000, 1);
+    check_direct_io_entries(storage, 1, 5000, 1);
+
+    // Padding is dropped when closing segments
+    ASSERT_LT(3u, storage->_segments.size());
+    for (braft::SegmentLogStorage::SegmentMap::iterator 
+            it = storage->_segments.begin(); it != storage->_segments.end(); ++it) {
+        const std::string path = "./data/" + it->second->file_name();
+        ASSERT_EQ(it->second->bytes(), file_size(path.c_str()));
+    }
+    // The last block is rewritten after truncating
+    ASSERT_EQ(0, storage->truncate_suffix(4000));
+    append_direct_io_entries(storage, 4001, 4500, 2);
+    check_direct_io_entries(storage, 1, 4000, 1);
+    check_direct_io_entries(storage, 4001, 4500, 2);
+    // Truncating in the middle of a batch frame rewrites the segment, which
+    // is still written with O_DIRECT
+    braft::FLAGS_raft_segment_batch_frame = true;
+    append_direct_io_entries(storage, 4501, 4600, 2);
+    ASSERT_EQ(0, storage->truncate_suffix(4555));
+#if defined(O_DIRECT)
+    ASSERT_TRUE(fcntl(storage->_open_segment->_fd, F_GETFL) & O_DIRECT);
+#endif
+    append_direct_io_entries(storage, 4556, 4600, 2);
+    check_direct_io_entries(storage, 4001, 4600, 2);
+    // Restart with the padded open segment, in both modes
+    int64_t last_index = 4600;
+    for (int direct_io = 1; direct_io >= 0; --direct_io) {
+        delete storage;
+        delete configuration_manager;
+        braft::FLAGS_raft_segment_direct_io = direct_io;
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        ASSERT_EQ(last_index, storage->last_log_index());
+        check_direct_io_entries(storage, 1, 4000, 1);
+        check_direct_io_entries(storage, 4001, last_index, 2);
+        append_direct_io_entries(storage, last_index + 1, last_index + 100, 2);
+        last_index += 100;
+        check_direct_io_entries(storage, 4001, last_index, 2);
+    }
+    delete storage;
+    delete configuration_manager;
+}
+
+TEST_F(LogStorageTest, batch_frame_segments) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    const int64_t N = 200000;
+    braft::FLAGS_raft_segment_batch_frame = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    butil::Timer timer;
+    timer.start();
+    append_entries_with_configuration(storage, 1, N);
+    timer.stop();
+    LOG(INFO) << "Appended " << N << " entries in batch frames, time: " 
+              << timer.u_elapsed() << "us";
+    check_entries_with_configuration(storage, configuration_manager, 1, N);
+    // Entries appended together share the offset of the frame
+    scoped_refptr<braft::Segment> first = storage->_segments.begin()->second;
+    ASSERT_EQ(first->_offset_and_term[0].first, first->_offset_and_term[99].first);
+    ASSERT_NE(first->_offset_and_term[99].first, first->_offset_and_term[100].first);
+    // Frames are split by term
+    ASSERT_NE(first->_offset_and_term[998].first, first->_offset_and_term[999].first);
+    first = NULL;
+
+    // Truncating in the middle of a frame keeps the entries before
+    ASSERT_EQ(0, storage->truncate_suffix(150050));
+    check_entries_with_configuration(storage, configuration_manager, 1, 150050);
+    ASSERT_TRUE(storage->get_entry(150051) == NULL);
+    append_entries_with_configuration(storage, 150051, N);
+    check_entries_with_configuration(storage, configuration_manager, 1, N);
+
+    // Restart with and without index files, and with frames disabled
+    for (int i = 0; i < 2; ++i) {
+        delete storage;
+        delete configuration_manager;
+        braft::FLAGS_raft_segment_index = (i == 0);
+        braft::FLAGS_raft_segment_batch_frame = (i == 0);
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        check_entries_with_configuration(storage, configuration_manager, 1, N);
+    }
+    // Plain entries are appended after the frames
+    append_entries_with_configuration(storage, N + 1, N + 1000);
+    check_entries_with_configuration(storage, configuration_manager, 1, N + 1000);
+    delete storage;
+    delete configuration_manager;
+
+    // Compare with the plain format
+    system("rm -rf ./data");
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    timer.start();
+    append_entries_with_configuration(storage, 1, N);
+    timer.stop();
+    LOG(INFO) << "Appended " << N << " plain entries, time: " 
+              << timer.u_elapsed() << "us";
+    delete storage;
+    delete configuration_manager;
+}
+
+static int64_t segments_bytes(braft::SegmentLogStorage* storage) {
+    int64_t bytes = 0;
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    for (braft::SegmentLogStorage::SegmentMap::iterator 
+            it = segments.begin(); it != segments.end(); ++it) {
+        bytes += it->second->bytes();
+    }
+    return bytes;
+}
+
+TEST_F(LogStorageTest, compressed_segments) {
+    GFLAGS_NS::FlagSaver saver;
+    const int64_t N = 200000;
+    const char* uris[] = { "./data", "./data?compress=snappy", 
+                           "./data?compress=zlib" };
+    int64_t plain_bytes = 0;
+    for (int batch_frame = 0; batch_frame <= 1; ++batch_frame) {
+        braft::FLAGS_raft_segment_batch_frame = batch_frame;
+        for (size_t i = 0; i < ARRAY_SIZE(uris); ++i) {
+            system("rm -rf ./data");
+            braft::SegmentLogStorage factory;
+            braft::SegmentLogStorage* storage = dynamic_cast<braft::SegmentLogStorage*>(
+                    factory.new_instance(uris[i]));
+            ASSERT_TRUE(storage != NULL);
+            braft::ConfigurationManager* configuration_manager = 
+                    new braft::ConfigurationManager;
+            ASSERT_EQ(0, storage->init(configuration_manager));
+            butil::Timer timer;
+            timer.start();
+            append_entries_with_configuration(storage, 1, N);
+            timer.stop();
+            const int64_t bytes = segments_bytes(storage);
+            LOG(INFO) << "uri=" << uris[i] << " batch_frame=" << batch_frame
+                      << " bytes=" << bytes << " time: " << timer.u_elapsed() << "us";
+            if (i == 0) {
+                plain_bytes = bytes;
+            } else if (batch_frame) {
+                // Repetitive entries in a frame compress well
+                ASSERT_LT(bytes * 2, plain_bytes);
+            }
+            check_entries_with_configuration(storage, configuration_manager, 1, N);
+            delete storage;
+            delete configuration_manager;
+
+            // Readable whatever the uri is
+            storage = new braft::SegmentLogStorage("./data");
+            configuration_manager = new braft::ConfigurationManager;
+            ASSERT_EQ(0, storage->init(configuration_manager));
+            check_entries_with_configuration(storage, configuration_manager, 1, N);
+            delete storage;
+            delete configuration_manager;
+        }
+    }
+
+    braft::SegmentLogStorage factory;
+    ASSERT_TRUE(factory.new_instance("./data?compress=lz4") == NULL);
+    ASSERT_TRUE(factory.new_instance("./data?checksum=crc32") == NULL);
+}
+
+namespace braft {
+DECLARE_bool(raft_segment_mmap);
+}
+
+TEST_F(LogStorageTest, mmap_segments) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_mmap = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_direct_io_entries(storage, 1, 5000, 1);
+    check_direct_io_entries(storage, 1, 5000, 1);
+    // Closed when full and loaded on restart
+    for (int i = 0; i < 2; ++i) {
+        braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+        ASSERT_LT(3u, segments.size());
+        for (braft::SegmentLogStorage::SegmentMap::iterator 
+                it = segments.begin(); it != segments.end(); ++it) {
+            ASSERT_EQ(!it->second->is_open(), it->second->_mapping != NULL);
+        }
+        delete storage;
+        delete configuration_manager;
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        check_direct_io_entries(storage, 1, 5000, 1);
+    }
+
+    // Entries outlive the truncated part of the mapping
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    scoped_refptr<braft::Segment> closed = (++segments.begin())->second;
+    ASSERT_FALSE(closed->is_open());
+    const int64_t held_index = closed->last_index();
+    braft::LogEntry* held = storage->get_entry(held_index);
+    ASSERT_TRUE(held != NULL);
+    const int64_t last_index_kept = closed->first_index() + 10;
+    ASSERT_EQ(0, storage->truncate_suffix(last_index_kept));
+    ASSERT_TRUE(closed->is_open());
+    ASSERT_TRUE(closed->_mapping == NULL);
+    ASSERT_EQ(std::string(held_index % 300, 'a' + held_index % 26),
+              held->data.to_string());
+    held->Release();
+    closed = NULL;
+    segments.clear();
+    check_direct_io_entries(storage, 1, last_index_kept, 1);
+    append_direct_io_entries(storage, last_index_kept + 1, 5000, 2);
+    check_direct_io_entries(storage, last_index_kept + 1, 5000, 2);
+
+    // Truncating the whole closed segment as well
+    held = storage->get_entry(1);
+    ASSERT_TRUE(held != NULL);
+    ASSERT_EQ(0, storage->truncate_prefix(last_index_kept + 1));
+    ASSERT_EQ(0, storage->truncate_suffix(last_index_kept + 100));
+    ASSERT_EQ(std::string(1, 'b'), held->data.to_string());
+    held->Release();
+    check_direct_io_entries(storage, last_index_kept + 1, last_index_kept + 100, 2);
+    delete storage;
+    delete configuration_manager;
+}
+
+TEST_F(LogStorageTest, mapped_segments_are_not_recycled) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_mmap = true;
+    braft::FLAGS_raft_max_preallocated_segments = 2;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_direct_io_entries(storage, 1, 5000, 1);
+    wait_spare_files(storage, 2);
+
+    // The spare files are not prepared from the discarded mapped segments
+    // while their pages are referenced
+    braft::LogEntry* held = storage->get_entry(1);
+    ASSERT_TRUE(held != NULL);
+    const int64_t first_index_kept = 
+            (++storage->_segments.begin())->second->last_index() + 1;
+    ASSERT_EQ(0, storage->truncate_prefix(first_index_kept));
+    wait_spare_files(storage, 2);
+    ASSERT_EQ(std::string(1, 'b'), held->data.to_string());
+    held->Release();
+    check_direct_io_entries(storage, first_index_kept, 5000, 1);
+    delete storage;
+    delete configuration_manager;
+}
+
+TEST_F(LogStorageTest, get_entries) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    for (int batch_frame = 0; batch_frame <= 1; ++batch_frame) {
+        system("rm -rf ./data");
+        braft::FLAGS_raft_segment_batch_frame = batch_frame;
+        braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+        braft::ConfigurationManager* configuration_manager = 
+                new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        append_direct_io_entries(storage, 1, 5000, 1);
+
+        // Across segments and in the middle of batch frames
+        for (int64_t first = 1; first <= 5000; first += 333) {
+            std::vector<braft::LogEntry*> entries;
+            const int n = storage->get_entries(first, first + 999, 
+                                               1024 * 1024, &entries);
+            ASSERT_EQ(std::min<int64_t>(1000, 5001 - first), n);
+            ASSERT_EQ((size_t)n, entries.size());
+            for (int i = 0; i < n; ++i) {
+                const int64_t index = first + i;
+                ASSERT_EQ(index, entries[i]->id.index);
+                ASSERT_EQ(1, entries[i]->id.term);
+                ASSERT_EQ(std::string(index % 300, 'a' + index % 26),
+                          entries[i]->data.to_string());
+                entries[i]->Release();
+            }
+        }
+        // Stops after max_bytes but gets one entry at least
+        std::vector<braft::LogEntry*> entries;
+        const int n = storage->get_entries(1, 5000, 8 * 1024, &entries);
+        ASSERT_LT(0, n);
+        ASSERT_GT(1000, n);
+        for (int i = 0; i < n; ++i) {
+            entries[i]->Release();
+        }
+        entries.clear();
+        ASSERT_EQ(1, storage->get_entries(10, 5000, 0, &entries));
+        ASSERT_EQ(10, entries[0]->id.index);
+        entries[0]->Release();
+        entries.clear();
+        ASSERT_EQ(0, storage->get_entries(5001, 6000, 1024, &entries));
+
+        // Compare with reading one by one
+        butil::Timer timer;
+        timer.start();
+        for (int64_t index = 1; index <= 5000; ++index) {
+            storage->get_entry(index)->Release();
+        }
+        timer.stop();
+        const int64_t get_entry_us = timer.u_elapsed();
+        timer.start();
+        for (int64_t index = 1; index <= 5000; ) {
+            entries.clear();
+            index += storage->get_entries(index, 5000, 1024 * 1024, &entries);
+            for (size_t i = 0; i < entries.size(); ++i) {
+                entries[i]->Release();
+            }
+        }
+        timer.stop();
+        LOG(INFO) << "batch_frame=" << batch_frame << " get_entry: " 
+                  << get_entry_us << "us, get_entries: " << timer.u_elapsed() << "us";
+        delete storage;
+        delete configuration_manager;
+    }
+}
+
+namespace braft {
+DECLARE_int32(raft_segment_reclaim_mb_per_second);
+}
+
+static size_t count_files_with_suffix(const std::string& path, 
+                                      const std::string& suffix) {
+    size_t n = 0;
+    butil::DirReaderPosix dir_reader(path.c_str());
+    while (dir_reader.Next()) {
+        const std::string name = dir_reader.name();
+        n += name.size() > suffix.size() 
+             && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    return n;
+}
+
+TEST_F(LogStorageTest, reclaim_segments_in_background) {
+    GFLAGS_NS::FlagSaver saver;
+    system("rm -rf ./data");
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    // About 0.5s to reclaim 8 segments
+    braft::FLAGS_raft_segment_reclaim_mb_per_second = 1;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_direct_io_entries(storage, 1, 5000, 1);
+    ASSERT_LT(9u, storage->_segments.size());
+    braft::SegmentLogStorage::SegmentMap::iterator it = storage->_segments.begin();
+    for (int i = 0; i < 8; ++i) {
+        ++it;
+    }
+    const int64_t first_index_kept = it->second->first_index();
+    butil::Timer timer;
+    timer.start();
+    ASSERT_EQ(0, storage->truncate_prefix(first_index_kept));
+    timer.stop();
+    LOG(INFO) << "truncate_prefix time: " << timer.u_elapsed() << "us";
+    // Deleted logically at once
+    ASSERT_EQ(first_index_kept, storage->first_log_index());
+    ASSERT_TRUE(storage->get_entry(first_index_kept - 1) == NULL);
+    check_direct_io_entries(storage, first_index_kept, 5000, 1);
+    butil::DirReaderPosix dir_reader("./data");
+    while (dir_reader.Next()) {
+        const std::string name = dir_reader.name();
+        int64_t first_index = 0;
+        int64_t last_index = 0;
+        if (name.find(".tmp") == std::string::npos
+                && sscanf(name.c_str(), "log_%" PRId64 "_%" PRId64, 
+                          &first_index, &last_index) == 2) {
+            ASSERT_LE(first_index_kept, first_index);
+        }
+    }
+    // Unlinked gradually
+    ASSERT_LT(0u, count_files_with_suffix("./data", ".tmp"));
+    timer.start();
+    while (count_files_with_suffix("./data", ".tmp") != 0) {
+        usleep(10 * 1000);
+    }
+    timer.stop();
+    LOG(INFO) << "reclaim time: " << timer.u_elapsed() << "us";
+    ASSERT_LT(200 * 1000, timer.u_elapsed());
+    delete storage;
+    delete configuration_manager;
+}
+
+namespace braft {
+DECLARE_int32(raft_max_prepared_log_bytes);
+}
+
+static void new_entries(int64_t first_index, int64_t last_index, 
+                        const char* prefix,
+                        std::vector<braft::LogEntry*>* entries) {
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id = braft::LogId(index, 1);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "%s: %" PRId64, prefix, index);
+        entry->data.append(data_buf);
+        entries->push_back(entry);
+    }
+}
+
+static void release_entries(std::vector<braft::LogEntry*>* entries) {
+    for (size_t i = 0; i < entries->size(); ++i) {
+        (*entries)[i]->Release();
+    }
+    entries->clear();
+}
+
+static void check_entries(braft::LogStorage* storage, int64_t first_index,
+                          int64_t last_index, const char* prefix) {
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "%s: %" PRId64, prefix, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+}
+
+TEST_F(LogStorageTest, prepare_entries) {
+    GFLAGS_NS::FlagSaver saver;
+    for (int batch_frame = 0; batch_frame <= 1; ++batch_frame) {
+        system("rm -rf ./data");
+        braft::FLAGS_raft_segment_batch_frame = batch_frame;
+        braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+        braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+
+        // Appended with the prepared records
+        std::vector<braft::LogEntry*> entries;
+        new_entries(1, 100, "prepared", &entries);
+        storage->prepare_entries(entries);
+        ASSERT_FALSE(storage->_prepared_records.empty());
+        ASSERT_LT(0, storage->_prepared_bytes);
+        ASSERT_EQ(100, storage->append_entries(entries, NULL));
+        ASSERT_TRUE(storage->_prepared_records.empty());
+        ASSERT_EQ(0, storage->_prepared_bytes);
+        release_entries(&entries);
+        check_entries(storage, 1, 100, "prepared");
+
+        // Prepared ahead of the entries appended
+        std::vector<braft::LogEntry*> following;
+        new_entries(101, 200, "following", &entries);
+        new_entries(201, 300, "following", &following);
+        storage->prepare_entries(entries);
+        storage->prepare_entries(following);
+        ASSERT_EQ(100, storage->append_entries(entries, NULL));
+        ASSERT_FALSE(storage->_prepared_records.empty());
+        ASSERT_EQ(100, storage->append_entries(following, NULL));
+        ASSERT_TRUE(storage->_prepared_records.empty());
+        release_entries(&entries);
+        release_entries(&following);
+        check_entries(storage, 101, 300, "following");
+
+        // Records of other entries at the same indexes are not used
+        new_entries(301, 400, "stale", &entries);
+        storage->prepare_entries(entries);
+        release_entries(&entries);
+        new_entries(301, 400, "appended", &entries);
+        ASSERT_EQ(100, storage->append_entries(entries, NULL));
+        ASSERT_TRUE(storage->_prepared_records.empty());
+        release_entries(&entries);
+        check_entries(storage, 301, 400, "appended");
+
+        // Dropped by truncate_suffix
+        new_entries(401, 500, "truncated", &entries);
+        storage->prepare_entries(entries);
+        release_entries(&entries);
+        ASSERT_EQ(0, storage->truncate_suffix(350));
+        ASSERT_TRUE(storage->_prepared_records.empty());
+
+        // Not encoded beyond the limit
+        {
+            GFLAGS_NS::FlagSaver limit_saver;
+            braft::FLAGS_raft_max_prepared_log_bytes = 0;
+            new_entries(351, 400, "unprepared", &entries);
+            storage->prepare_entries(entries);
+            ASSERT_TRUE(storage->_prepared_records.empty());
+            ASSERT_EQ(50, storage->append_entries(entries, NULL));
+            release_entries(&entries);
+        }
+
+        delete storage;
+        delete configuration_manager;
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        check_entries(storage, 1, 100, "prepared");
+        check_entries(storage, 101, 300, "following");
+        check_entries(storage, 301, 350, "appended");
+        check_entries(storage, 351, 400, "unprepared");
+        delete storage;
+        delete configuration_manager;
+    }
+}
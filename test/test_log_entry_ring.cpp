@@ -0,0 +1,265 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <deque>
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include <butil/time.h>
+#include <butil/atomicops.h>
+#include "braft/log_entry_ring.h"
+#include "braft/util.h"
+
+class LogEntryRingTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+static braft::LogEntry* new_entry(int64_t index, int64_t term) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id = braft::LogId(index, term);
+    return entry;
+}
+
+static void release_all(std::vector<braft::LogEntry*>* entries) {
+    for (size_t i = 0; i < entries->size(); ++i) {
+        (*entries)[i]->Release();
+    }
+    entries->clear();
+}
+
+TEST_F(LogEntryRingTest, sanity) {
+    braft::LogEntryRing ring(4);
+    ASSERT_TRUE(ring.empty());
+    ASSERT_TRUE(ring.get(1) == NULL);
+    ASSERT_EQ(0, ring.get_term(1));
+
+    // Grows from 4 slots to 64
+    for (int64_t i = 10; i < 60; ++i) {
+        ring.push_back(new_entry(i, i / 10));
+    }
+    ASSERT_EQ(50u, ring.size());
+    ASSERT_EQ(10, ring.first_index());
+    ASSERT_EQ(59, ring.last_index());
+    ASSERT_EQ(10, ring.front()->id.index);
+    ASSERT_EQ(59, ring.back()->id.index);
+    for (int64_t i = 10; i < 60; ++i) {
+        ASSERT_EQ(i / 10, ring.get_term(i));
+        braft::LogEntry* entry = ring.get(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(i, entry->id.index);
+        ASSERT_EQ(i, ring.at(i)->id.index);
+        entry->Release();
+    }
+    ASSERT_TRUE(ring.get(9) == NULL);
+    ASSERT_TRUE(ring.get(60) == NULL);
+    ASSERT_TRUE(ring.at(60) == NULL);
+
+    for (int i = 0; i < 5; ++i) {
+        ring.pop_front();
+        ring.pop_back();
+    }
+    ASSERT_EQ(40u, ring.size());
+    ASSERT_EQ(15, ring.first_index());
+    ASSERT_EQ(54, ring.last_index());
+    ASSERT_TRUE(ring.get(14) == NULL);
+    ASSERT_EQ(0, ring.get_term(55));
+
+    std::vector<braft::LogEntry*> released;
+    ring.reclaim(&released);
+    ASSERT_EQ(10u, released.size());
+    release_all(&released);
+    ring.reclaim(&released);
+    ASSERT_TRUE(released.empty());
+
+    // Restart from another index after being cleared
+    ring.clear();
+    ASSERT_TRUE(ring.empty());
+    ring.push_back(new_entry(1000, 5));
+    ASSERT_EQ(1u, ring.size());
+    ASSERT_EQ(5, ring.get_term(1000));
+    ASSERT_EQ(0, ring.get_term(54));
+    ring.reclaim(&released);
+    ASSERT_EQ(40u, released.size());
+    release_all(&released);
+}
+
+TEST_F(LogEntryRingTest, keep_entries_referenced_by_reader) {
+    braft::LogEntryRing ring(4);
+    for (int64_t i = 1; i <= 10; ++i) {
+        ring.push_back(new_entry(i, 1));
+    }
+    // Simulate a lookup in progress
+    const int64_t epoch = ring.enter();
+    ring.pop_front();
+    std::vector<braft::LogEntry*> released;
+    ring.reclaim(&released);
+    ASSERT_TRUE(released.empty());
+    ring.leave(epoch);
+    ring.reclaim(&released);
+    ASSERT_EQ(1u, released.size());
+    ASSERT_EQ(1, released[0]->id.index);
+    release_all(&released);
+}
+
+struct ReaderArg {
+    braft::LogEntryRing* ring;
+    butil::atomic<bool>* stop;
+    butil::atomic<int64_t>* last_index;
+    int64_t nfound;
+};
+
+static void* read_ring(void* arg) {
+    ReaderArg* ra = (ReaderArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t last_index =
+                ra->last_index->load(butil::memory_order_acquire);
+        for (int64_t i = last_index; i > last_index - 100 && i > 0; --i) {
+            braft::LogEntry* entry = ra->ring->get(i);
+            if (entry) {
+                EXPECT_EQ(i, entry->id.index);
+                EXPECT_EQ(i, entry->id.term);
+                entry->Release();
+                ++ra->nfound;
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(LogEntryRingTest, concurrent_readers) {
+    braft::LogEntryRing ring(16);
+    butil::atomic<bool> stop(false);
+    butil::atomic<int64_t> last_index(0);
+    pthread_t threads[8];
+    ReaderArg args[ARRAY_SIZE(threads)];
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        args[i].ring = &ring;
+        args[i].stop = &stop;
+        args[i].last_index = &last_index;
+        args[i].nfound = 0;
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, read_ring, &args[i]));
+    }
+    std::vector<braft::LogEntry*> released;
+    for (int64_t i = 1; i <= 200000; ++i) {
+        ring.push_back(new_entry(i, i));
+        last_index.store(i, butil::memory_order_release);
+        // Keep at most 64 entries, and truncate the tail sometimes
+        if (ring.size() > 64) {
+            ring.pop_front();
+        }
+        if (i % 1000 == 0) {
+            for (int j = 0; j < 10; ++j) {
+                ring.pop_back();
+            }
+            for (int64_t j = i - 9; j <= i; ++j) {
+                ring.push_back(new_entry(j, j));
+            }
+        }
+        ring.reclaim(&released);
+        release_all(&released);
+    }
+    stop.store(true);
+    int64_t nfound = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_join(threads[i], NULL);
+        nfound += args[i].nfound;
+    }
+    ASSERT_GT(nfound, 0);
+    ring.reclaim(&released);
+    release_all(&released);
+}
+
+struct BenchmarkArg {
+    braft::LogEntryRing* ring;
+    std::deque<braft::LogEntry*>* deque;
+    raft_mutex_t* mutex;
+    int64_t first_index;
+    int64_t count;
+    int64_t rounds;
+    int64_t elapsed_ns;
+};
+
+static void* read_ring_benchmark(void* arg) {
+    BenchmarkArg* ba = (BenchmarkArg*)arg;
+    butil::Timer timer;
+    timer.start();
+    for (int64_t r = 0; r < ba->rounds; ++r) {
+        for (int64_t i = 0; i < ba->count; ++i) {
+            braft::LogEntry* entry = ba->ring->get(ba->first_index + i);
+            entry->Release();
+        }
+    }
+    timer.stop();
+    ba->elapsed_ns = timer.n_elapsed();
+    return NULL;
+}
+
+static void* read_deque_benchmark(void* arg) {
+    BenchmarkArg* ba = (BenchmarkArg*)arg;
+    butil::Timer timer;
+    timer.start();
+    for (int64_t r = 0; r < ba->rounds; ++r) {
+        for (int64_t i = 0; i < ba->count; ++i) {
+            braft::LogEntry* entry = NULL;
+            {
+                BAIDU_SCOPED_LOCK(*ba->mutex);
+                entry = (*ba->deque)[i];
+                entry->AddRef();
+            }
+            entry->Release();
+        }
+    }
+    timer.stop();
+    ba->elapsed_ns = timer.n_elapsed();
+    return NULL;
+}
+
+static int64_t run_benchmark(void* (*fn)(void*), int nthreads,
+                             BenchmarkArg* tmpl) {
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<BenchmarkArg> args(nthreads, *tmpl);
+    for (int i = 0; i < nthreads; ++i) {
+        EXPECT_EQ(0, pthread_create(&threads[i], NULL, fn, &args[i]));
+    }
+    int64_t elapsed_ns = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+        elapsed_ns += args[i].elapsed_ns;
+    }
+    return elapsed_ns / (nthreads * tmpl->rounds * tmpl->count);
+}
+
+TEST_F(LogEntryRingTest, benchmark_readers) {
+    const int64_t N = 1024;
+    braft::LogEntryRing ring;
+    std::deque<braft::LogEntry*> deque;
+    raft_mutex_t mutex;
+    for (int64_t i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new_entry(i, 1);
+        ring.push_back(entry);
+        entry->AddRef();
+        deque.push_back(entry);
+    }
+    BenchmarkArg tmpl;
+    tmpl.ring = &ring;
+    tmpl.deque = &deque;
+    tmpl.mutex = &mutex;
+    tmpl.first_index = 1;
+    tmpl.count = N;
+    tmpl.rounds = 200;
+    tmpl.elapsed_ns = 0;
+    for (int nthreads = 1; nthreads <= 32; nthreads *= 2) {
+        const int64_t ring_ns = run_benchmark(read_ring_benchmark,
+                                              nthreads, &tmpl);
+        const int64_t deque_ns = run_benchmark(read_deque_benchmark,
+                                               nthreads, &tmpl);
+        LOG(INFO) << "nthreads=" << nthreads
+                  << " ring_get=" << ring_ns << "ns"
+                  << " locked_deque_get=" << deque_ns << "ns";
+    }
+    for (size_t i = 0; i < deque.size(); ++i) {
+        deque[i]->Release();
+    }
+}
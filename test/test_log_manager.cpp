@@ -3,10 +3,13 @@
 // Author: Zhangyi Chen (chenzhangyi01@baidu.com)
 // Date: 2015/11/24 16:30:49
 
+#include <pthread.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
 #include <butil/memory/scoped_ptr.h>
 #include <butil/string_printf.h>
+#include <butil/time.h>
 #include <butil/macros.h>
 
 #include <bthread/countdown_event.h>
@@ -548,6 +551,64 @@ TEST_F(LogManagerTest, wait) {
     ASSERT_NE(0, lm->remove_waiter(wait_id));
 }
 
+struct WakeupRecorder {
+    WakeupRecorder() : event(0) {}
+    raft_mutex_t mutex;
+    std::vector<bthread_t> tids;
+    bthread::CountdownEvent event;
+};
+
+int record_wakeup(void* arg, int error_code) {
+    WakeupRecorder* recorder = (WakeupRecorder*)arg;
+    EXPECT_EQ(0, error_code);
+    {
+        BAIDU_SCOPED_LOCK(recorder->mutex);
+        recorder->tids.push_back(bthread_self());
+    }
+    recorder->event.signal();
+    return 0;
+}
+
+TEST_F(LogManagerTest, wakeup_waiters_in_batch) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 1));
+    const int N = 10;
+    WakeupRecorder recorder;
+    recorder.event.reset(N);
+    std::vector<braft::LogManager::WaitId> wait_ids;
+    for (int i = 0; i < N; ++i) {
+        wait_ids.push_back(lm->wait(1, record_wakeup, &recorder));
+        ASSERT_NE(0, wait_ids.back());
+    }
+    ASSERT_EQ((size_t)N, lm->_wait_index.size());
+    // Nothing changes with the duplicated entry
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 1));
+    usleep(10 * 1000);
+    ASSERT_EQ((size_t)N, lm->_wait_index.size());
+    ASSERT_TRUE(recorder.tids.empty());
+    // Removed from both the map and the index
+    ASSERT_EQ(0, lm->remove_waiter(wait_ids.back()));
+    ASSERT_EQ((size_t)N - 1, lm->_wait_index.size());
+    recorder.event.signal();
+    // Woken up together in one bthread
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 2));
+    recorder.event.wait();
+    ASSERT_TRUE(lm->_wait_index.empty());
+    ASSERT_EQ((size_t)N - 1, recorder.tids.size());
+    for (size_t i = 1; i < recorder.tids.size(); ++i) {
+        ASSERT_EQ(recorder.tids[0], recorder.tids[i]);
+    }
+}
+
 TEST_F(LogManagerTest, flush_and_get_last_id) {
     system("rm -rf ./data");
     {
@@ -681,3 +742,304 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+namespace braft {
+DECLARE_bool(raft_async_log_sync);
+}
+
+class CountdownStableClosure : public braft::LogManager::StableClosure {
+public:
+    explicit CountdownStableClosure(bthread::CountdownEvent* event)
+        : _event(event) {}
+    void Run() {
+        EXPECT_TRUE(status().ok()) << status();
+        _event->signal();
+        delete this;
+    }
+private:
+    bthread::CountdownEvent* _event;
+};
+
+TEST_F(LogManagerTest, async_log_sync) {
+    GFLAGS_NS::FlagSaver saver;
+    const int N = 10000;
+    for (int async = 0; async <= 1; ++async) {
+        system("rm -rf ./data");
+        braft::FLAGS_raft_async_log_sync = async;
+        {
+            scoped_ptr<braft::ConfigurationManager> cm(
+                                        new braft::ConfigurationManager);
+            scoped_ptr<braft::SegmentLogStorage> storage(
+                                        new braft::SegmentLogStorage("./data"));
+            scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+            braft::LogManagerOptions opt;
+            opt.log_storage = storage.get();
+            opt.configuration_manager = cm.get();
+            ASSERT_EQ(0, lm->init(opt));
+            bthread::CountdownEvent event(N);
+            butil::Timer timer;
+            timer.start();
+            for (int i = 0; i < N; ++i) {
+                braft::LogEntry* entry = new braft::LogEntry;
+                entry->AddRef();
+                entry->type = braft::ENTRY_TYPE_DATA;
+                entry->id = braft::LogId(i + 1, 1);
+                std::string buf;
+                butil::string_printf(&buf, "hello_%d", i);
+                entry->data.append(buf);
+                std::vector<braft::LogEntry*> entries;
+                entries.push_back(entry);
+                lm->append_entries(&entries, new CountdownStableClosure(&event));
+            }
+            event.wait();
+            timer.stop();
+            LOG(INFO) << "async_log_sync=" << async << " append " << N
+                      << " entries in " << timer.u_elapsed() << "us";
+            ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+            braft::LogManagerStatus status;
+            lm->get_status(&status);
+            ASSERT_EQ(N, status.disk_index);
+            // Conflicting entry truncates the suffix
+            ASSERT_EQ(0, append_entry(lm.get(), "conflict", N, 2));
+            ASSERT_EQ(braft::LogId(N, 2), lm->last_log_id(true));
+        }
+        // Load from disk again
+        braft::FLAGS_raft_async_log_sync = false;
+        scoped_ptr<braft::ConfigurationManager> cm(
+                                    new braft::ConfigurationManager);
+        scoped_ptr<braft::SegmentLogStorage> storage(
+                                    new braft::SegmentLogStorage("./data"));
+        scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+        braft::LogManagerOptions opt;
+        opt.log_storage = storage.get();
+        opt.configuration_manager = cm.get();
+        ASSERT_EQ(0, lm->init(opt));
+        ASSERT_EQ(braft::LogId(N, 2), lm->last_log_id(true));
+        for (int i = 0; i < N - 1; ++i) {
+            braft::LogEntry* entry = lm->get_entry(i + 1);
+            ASSERT_TRUE(entry != NULL) << "i=" << i;
+            std::string expected;
+            butil::string_printf(&expected, "hello_%d", i);
+            ASSERT_EQ(expected, entry->data.to_string());
+            entry->Release();
+        }
+        braft::LogEntry* entry = lm->get_entry(N);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ("conflict", entry->data.to_string());
+        entry->Release();
+    }
+}
+
+struct BoundsReaderArg {
+    std::vector<braft::LogManager*>* lms;
+    butil::atomic<bool>* stop;
+    bool locked;
+    int64_t nreads;
+};
+
+static void* read_log_bounds(void* arg) {
+    BoundsReaderArg* ra = (BoundsReaderArg*)arg;
+    std::vector<braft::LogManager*>& lms = *ra->lms;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        for (size_t i = 0; i < lms.size(); ++i) {
+            braft::LogId last_log_id;
+            if (ra->locked) {
+                // What the reads used to be
+                BAIDU_SCOPED_LOCK(lms[i]->_mutex);
+                last_log_id.index = lms[i]->_last_log_index;
+                last_log_id.term = lms[i]->unsafe_get_term(last_log_id.index);
+            } else {
+                last_log_id = lms[i]->last_log_id();
+            }
+            EXPECT_TRUE(last_log_id.index == 0 || last_log_id.term == 1)
+                    << last_log_id;
+            ++ra->nreads;
+        }
+    }
+    return NULL;
+}
+
+TEST_F(LogManagerTest, benchmark_read_bounds) {
+    const int ngroups = 32;
+    const int N = 2000;
+    for (int locked = 0; locked <= 1; ++locked) {
+        system("rm -rf ./data");
+        std::vector<braft::ConfigurationManager*> cms;
+        std::vector<braft::SegmentLogStorage*> storages;
+        std::vector<braft::LogManager*> lms;
+        for (int i = 0; i < ngroups; ++i) {
+            std::string path;
+            butil::string_printf(&path, "./data/%d", i);
+            cms.push_back(new braft::ConfigurationManager);
+            storages.push_back(new braft::SegmentLogStorage(path));
+            lms.push_back(new braft::LogManager);
+            braft::LogManagerOptions opt;
+            opt.log_storage = storages.back();
+            opt.configuration_manager = cms.back();
+            ASSERT_EQ(0, lms.back()->init(opt));
+        }
+        butil::atomic<bool> stop(false);
+        pthread_t threads[8];
+        BoundsReaderArg args[ARRAY_SIZE(threads)];
+        for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+            args[i].lms = &lms;
+            args[i].stop = &stop;
+            args[i].locked = locked;
+            args[i].nreads = 0;
+            ASSERT_EQ(0, pthread_create(&threads[i], NULL,
+                                        read_log_bounds, &args[i]));
+        }
+        bthread::CountdownEvent event(ngroups * N);
+        butil::Timer timer;
+        timer.start();
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < ngroups; ++j) {
+                braft::LogEntry* entry = new braft::LogEntry;
+                entry->AddRef();
+                entry->type = braft::ENTRY_TYPE_DATA;
+                entry->id = braft::LogId(i + 1, 1);
+                entry->data.append("hello");
+                std::vector<braft::LogEntry*> entries;
+                entries.push_back(entry);
+                lms[j]->append_entries(&entries,
+                                       new CountdownStableClosure(&event));
+            }
+        }
+        event.wait();
+        timer.stop();
+        stop.store(true);
+        int64_t nreads = 0;
+        for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+            pthread_join(threads[i], NULL);
+            nreads += args[i].nreads;
+        }
+        LOG(INFO) << "locked=" << locked << " ngroups=" << ngroups
+                  << " append_us=" << timer.u_elapsed()
+                  << " reads_per_us=" << nreads / (double)timer.u_elapsed();
+        for (int i = 0; i < ngroups; ++i) {
+            ASSERT_EQ(braft::LogId(N, 1), lms[i]->last_log_id(true));
+            ASSERT_EQ(1, lms[i]->first_log_index());
+            ASSERT_EQ(1, lms[i]->get_term(N / 2));
+            delete lms[i];
+            delete storages[i];
+            delete cms[i];
+        }
+    }
+}
+
+namespace braft {
+DECLARE_int32(raft_memory_log_budget_mb);
+}
+
+TEST_F(LogManagerTest, evict_logs_on_disk_beyond_budget) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_memory_log_budget_mb = 1;
+    system("rm -rf ./data ./data2");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    scoped_ptr<braft::ConfigurationManager> cm2(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage2(
+                                new braft::SegmentLogStorage("./data2"));
+    scoped_ptr<braft::LogManager> lm2(new braft::LogManager());
+    braft::LogManagerOptions opt2;
+    opt2.log_storage = storage2.get();
+    opt2.configuration_manager = cm2.get();
+    ASSERT_EQ(0, lm2->init(opt2));
+
+    // 800KB of logs kept in memory until applied within the budget
+    const int N = 200;
+    const std::string data(4096, 'a');
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), data, i + 1));
+    }
+    usleep(100 * 1000);
+    ASSERT_EQ((size_t)N, lm->_logs_in_memory.size());
+
+    // The budget is exceeded by the logs of the other group, which evicts the
+    // logs of the larger group first although none of them are applied
+    for (int i = 0; i < N / 2; ++i) {
+        ASSERT_EQ(0, append_entry(lm2.get(), data, i + 1));
+    }
+    for (int i = 0; i < 1000 && !lm->_logs_in_memory.empty(); ++i) {
+        usleep(1000);
+    }
+    ASSERT_EQ(0u, lm->_logs_in_memory.size());
+    ASSERT_EQ(0, lm->_memory_log_bytes);
+    ASSERT_EQ((size_t)N / 2, lm2->_logs_in_memory.size());
+    for (int i = 0; i < N; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(data, entry->data.to_string());
+        entry->Release();
+    }
+
+    lm2->set_applied_id(braft::LogId(N / 2, 1));
+    ASSERT_EQ(0u, lm2->_logs_in_memory.size());
+}
+
+namespace braft {
+DECLARE_bool(raft_log_encode_ahead);
+}
+
+TEST_F(LogManagerTest, encode_ahead) {
+    GFLAGS_NS::FlagSaver saver;
+    const int N = 10000;
+    for (int async = 0; async <= 1; ++async) {
+        for (int encode_ahead = 0; encode_ahead <= 1; ++encode_ahead) {
+            system("rm -rf ./data");
+            braft::FLAGS_raft_async_log_sync = async;
+            braft::FLAGS_raft_log_encode_ahead = encode_ahead;
+            scoped_ptr<braft::ConfigurationManager> cm(
+                                        new braft::ConfigurationManager);
+            scoped_ptr<braft::SegmentLogStorage> storage(
+                                        new braft::SegmentLogStorage("./data"));
+            scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+            braft::LogManagerOptions opt;
+            opt.log_storage = storage.get();
+            opt.configuration_manager = cm.get();
+            ASSERT_EQ(0, lm->init(opt));
+            const std::string data(1024, 'a');
+            bthread::CountdownEvent event(N);
+            butil::Timer timer;
+            timer.start();
+            for (int i = 0; i < N; ++i) {
+                braft::LogEntry* entry = new braft::LogEntry;
+                entry->AddRef();
+                entry->type = braft::ENTRY_TYPE_DATA;
+                entry->id = braft::LogId(i + 1, 1);
+                entry->data.append(data);
+                std::vector<braft::LogEntry*> entries;
+                entries.push_back(entry);
+                lm->append_entries(&entries, new CountdownStableClosure(&event));
+            }
+            event.wait();
+            timer.stop();
+            LOG(INFO) << "async_log_sync=" << async 
+                      << " encode_ahead=" << encode_ahead << " append " << N
+                      << " entries in " << timer.u_elapsed() << "us";
+            ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+            // Conflicting entry goes through the same queues
+            ASSERT_EQ(0, append_entry(lm.get(), "conflict", N, 2));
+            ASSERT_EQ(braft::LogId(N, 2), lm->last_log_id(true));
+            ASSERT_TRUE(storage->_prepared_records.empty());
+            for (int i = 0; i < N - 1; ++i) {
+                braft::LogEntry* entry = storage->get_entry(i + 1);
+                ASSERT_TRUE(entry != NULL);
+                ASSERT_EQ(data, entry->data.to_string());
+                entry->Release();
+            }
+            braft::LogEntry* entry = storage->get_entry(N);
+            ASSERT_TRUE(entry != NULL);
+            ASSERT_EQ("conflict", entry->data.to_string());
+            entry->Release();
+        }
+    }
+}
@@ -23,6 +23,14 @@ extern bvar::Adder<int64_t> g_num_nodes;
 DECLARE_int32(raft_max_parallel_append_entries_rpc_num);
 DECLARE_bool(raft_enable_append_entries_cache);
 DECLARE_int32(raft_max_append_entries_cache_size);
+DECLARE_int32(raft_apply_batch);
+DECLARE_int64(raft_apply_batch_bytes);
+DECLARE_int64(raft_apply_batch_flush_latency_us);
+DECLARE_int64(raft_max_pending_apply_tasks);
+DECLARE_bool(raft_heartbeat_batch);
+DECLARE_bool(raft_append_entries_batch);
+DECLARE_int32(raft_quiescent_idle_ms);
+DECLARE_bool(raft_enable_leader_lease);
 }
 
 using braft::raft_mutex_t;
@@ -152,6 +160,211 @@ TEST_P(NodeTest, SingleNode) {
     server.Join();
 }
 
+TEST_P(NodeTest, ApplyTasksInGroup) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    MockFSM* fsm = new MockFSM(butil::EndPoint());
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = fsm;
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+    while (!node.is_leader()) {
+        usleep(10 * 1000);
+    }
+
+    const int N = 100;
+    bthread::CountdownEvent cond(2 * N);
+    std::vector<butil::IOBuf> data(N);
+    std::vector<braft::Task> tasks(N);
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < N; i++) {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello: %d", round * N + i + 1);
+            data[i].append(data_buf);
+            tasks[i].data = &data[i];
+            tasks[i].done = NEW_APPLYCLOSURE(&cond, 0);
+        }
+        node.apply(&tasks[0], tasks.size());
+        for (int i = 0; i < N; i++) {
+            ASSERT_TRUE(data[i].empty());
+        }
+    }
+    cond.wait();
+    {
+        BAIDU_SCOPED_LOCK(fsm->mutex);
+        ASSERT_EQ((size_t)2 * N, fsm->logs.size());
+        for (int i = 0; i < 2 * N; ++i) {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+            ASSERT_EQ(data_buf, fsm->logs[i].to_string());
+        }
+    }
+
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, AdaptiveApplyBatch) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = new MockFSM(butil::EndPoint());
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+    while (!node.is_leader()) {
+        usleep(10 * 1000);
+    }
+
+    // The batches grow while the tasks pile up
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_apply_batch = 4;
+    std::string payload(1024, 'a');
+    {
+        bthread::CountdownEvent cond(1000);
+        for (int i = 0; i < 1000; i++) {
+            butil::IOBuf data;
+            data.append(payload);
+            braft::Task task;
+            task.data = &data;
+            task.done = NEW_APPLYCLOSURE(&cond, 0);
+            node.apply(task);
+        }
+        cond.wait();
+    }
+    ASSERT_GT(node._impl->_apply_batch_size,
+              (size_t)braft::FLAGS_raft_apply_batch);
+
+    // Any flush is slower than the target, so the batches keep shrinking
+    braft::FLAGS_raft_apply_batch = 32;
+    braft::FLAGS_raft_apply_batch_bytes = 4096;
+    braft::FLAGS_raft_apply_batch_flush_latency_us = 1;
+    for (int round = 0; round < 3; ++round) {
+        bthread::CountdownEvent cond(100);
+        for (int i = 0; i < 100; i++) {
+            butil::IOBuf data;
+            data.append(payload);
+            braft::Task task;
+            task.data = &data;
+            task.done = NEW_APPLYCLOSURE(&cond, 0);
+            node.apply(task);
+        }
+        cond.wait();
+    }
+    ASSERT_GT(node._impl->_log_manager->flush_latency_us(), 1);
+    ASSERT_LT(node._impl->_apply_batch_size,
+              (size_t)braft::FLAGS_raft_apply_batch);
+
+    bthread::CountdownEvent cond(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, RejectTasksBeyondPendingLimit) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    // stop the followers so that nothing gets committed
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        cluster.stop(nodes[i]->node_id().peer_id.addr);
+    }
+
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_max_pending_apply_tasks = 10;
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        // fail when the leader steps down
+        task.done = NEW_APPLYCLOSURE(&cond, -1);
+        leader->apply(task);
+    }
+    bthread::CountdownEvent rejected(5);
+    for (int i = 0; i < 5; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&rejected, EBUSY);
+        leader->apply(task);
+    }
+    rejected.wait();
+    // A rejected task without a closure is dropped silently
+    butil::IOBuf data;
+    data.append("hello");
+    braft::Task task;
+    task.data = &data;
+    leader->apply(task);
+    braft::NodeStatus status;
+    leader->get_status(&status);
+    ASSERT_EQ(6, status.apply_rejected_count);
+
+    cluster.stop_all();
+    cond.wait();
+}
+
 TEST_P(NodeTest, NoLeader) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -1709,6 +1922,274 @@ TEST_P(NodeTest, LeaderShouldNotChange) {
     cluster.stop_all();
 }
 
+TEST_P(NodeTest, HeartbeatBatch) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_heartbeat_batch = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_term = leader->_impl->_current_term;
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The followers keep following by the batched heartbeats
+    usleep(5000 * 1000);
+    cluster.wait_leader();
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+    cluster.ensure_same();
+
+    // Heartbeats to a stopped follower fail
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    const braft::PeerId follower_id = followers[0]->node_id().peer_id;
+    cluster.stop(follower_id.addr);
+    usleep(1000 * 1000);
+    braft::NodeStatus status;
+    leader->get_status(&status);
+    ASSERT_GT(status.stable_followers[follower_id].consecutive_error_times, 0);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, AppendEntriesBatch) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_append_entries_batch = true;
+    braft::FLAGS_raft_heartbeat_batch = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_term = leader->_impl->_current_term;
+
+    bthread::CountdownEvent cond(100);
+    for (int i = 0; i < 100; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // A follower restarted catches up by the batched requests
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    const butil::EndPoint follower_addr =
+            followers[0]->node_id().peer_id.addr;
+    cluster.stop(follower_addr);
+
+    cond.reset(100);
+    for (int i = 100; i < 200; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    ASSERT_EQ(0, cluster.start(follower_addr));
+    usleep(2000 * 1000);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+    cluster.ensure_same();
+
+    // Data sizes not matching the attachment fail the whole batch before
+    // any request is handled
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(followers[1]->node_id().peer_id.addr, NULL));
+    braft::RaftService_Stub stub(&channel);
+    braft::AppendEntriesBatchRequest request;
+    for (int i = 0; i < 2; ++i) {
+        braft::AppendEntriesRequest* sub_request = request.add_requests();
+        sub_request->set_group_id("unittest");
+        sub_request->set_server_id(leader->node_id().peer_id.to_string());
+        sub_request->set_peer_id(followers[1]->node_id().peer_id.to_string());
+        sub_request->set_term(saved_term);
+        sub_request->set_prev_log_term(saved_term);
+        sub_request->set_prev_log_index(0);
+        sub_request->set_committed_index(0);
+    }
+    for (int round = 0; round < 2; ++round) {
+        request.clear_data_sizes();
+        request.add_data_sizes(5);
+        if (round == 1) {
+            request.add_data_sizes(5);
+        }
+        brpc::Controller cntl;
+        cntl.request_attachment().append("hello");
+        braft::AppendEntriesBatchResponse response;
+        stub.append_entries_batch(&cntl, &request, &response, NULL);
+        ASSERT_TRUE(cntl.Failed());
+        ASSERT_EQ(EINVAL, cntl.ErrorCode());
+        ASSERT_EQ(0, response.results_size());
+    }
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, Quiescence) {
+    GFLAGS_NS::FlagSaver saver;
+    braft::FLAGS_raft_quiescent_idle_ms = 500;
+    braft::FLAGS_raft_enable_leader_lease = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers, 500);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_term = leader->_impl->_current_term;
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The whole group becomes quiescent once idle
+    usleep(3000 * 1000);
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    ASSERT_TRUE(leader->_impl->_quiescent);
+    for (size_t i = 0; i < followers.size(); ++i) {
+        ASSERT_TRUE(followers[i]->_impl->_quiescent);
+    }
+    // And keeps the leader without any heartbeat
+    usleep(2000 * 1000);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+
+    // Woken up by apply
+    cond.reset(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    usleep(100 * 1000);
+    ASSERT_FALSE(leader->_impl->_quiescent);
+    for (size_t i = 0; i < followers.size(); ++i) {
+        ASSERT_FALSE(followers[i]->_impl->_quiescent);
+    }
+    cluster.ensure_same();
+
+    // Checking the lease wakes the group up without deposing the leader
+    usleep(3000 * 1000);
+    ASSERT_TRUE(leader->_impl->_quiescent);
+    braft::LeaderLeaseStatus lease_status;
+    leader->get_leader_lease_status(&lease_status);
+    ASSERT_NE(braft::LEASE_EXPIRED, lease_status.state);
+    for (int i = 0; i < 100 && lease_status.state != braft::LEASE_VALID; ++i) {
+        usleep(10 * 1000);
+        leader->get_leader_lease_status(&lease_status);
+        ASSERT_NE(braft::LEASE_EXPIRED, lease_status.state);
+    }
+    ASSERT_EQ(braft::LEASE_VALID, lease_status.state);
+    ASSERT_FALSE(leader->_impl->_quiescent);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+
+    // A new leader is elected once the quiescent leader is stopped
+    usleep(3000 * 1000);
+    ASSERT_TRUE(leader->_impl->_quiescent);
+    const butil::EndPoint leader_addr = leader->node_id().peer_id.addr;
+    cluster.stop(leader_addr);
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(leader_addr, leader->node_id().peer_id.addr);
+    ASSERT_GT(leader->_impl->_current_term, saved_term);
+
+    // Or once the quiescent leader is shut down in a process still running
+    ASSERT_EQ(0, cluster.start(leader_addr));
+    usleep(3000 * 1000);
+    ASSERT_TRUE(leader->_impl->_quiescent);
+    const butil::EndPoint quiescent_addr = leader->node_id().peer_id.addr;
+    const int64_t quiescent_term = leader->_impl->_current_term;
+    leader->shutdown(NULL);
+    leader->join();
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(quiescent_addr, leader->node_id().peer_id.addr);
+    ASSERT_GT(leader->_impl->_current_term, quiescent_term);
+    cluster.stop_all();
+}
+
 TEST_P(NodeTest, RecoverFollower) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -2689,6 +3170,36 @@ TEST_P(NodeTest, change_peers_add_multiple_node) {
     ASSERT_TRUE(cluster.ensure_same());
 }
 
+TEST_P(NodeTest, change_peers_beyond_max_peers) {
+    std::vector<braft::PeerId> peers;
+    braft::PeerId peer0;
+    peer0.addr.ip = butil::my_ip();
+    peer0.addr.port = 5006;
+    peer0.idx = 0;
+
+    // start cluster
+    peers.push_back(peer0);
+    Cluster cluster("unittest", peers);
+    ASSERT_EQ(0, cluster.start(peer0.addr));
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    // The ballots can't count the votes of so many peers
+    braft::Configuration conf;
+    for (size_t i = 0; i <= braft::BallotVoters::MAX_PEERS; ++i) {
+        braft::PeerId peer = peer0;
+        peer.idx = i;
+        conf.add_peer(peer);
+    }
+    braft::SynchronizedClosure done;
+    leader->change_peers(conf, &done);
+    done.wait();
+    ASSERT_EQ(EINVAL, done.status().error_code()) << done.status();
+    ASSERT_EQ(EINVAL, leader->reset_peers(conf).error_code());
+    ASSERT_EQ(leader, cluster.leader());
+}
+
 TEST_P(NodeTest, change_peers_steps_down_in_joint_consensus) {
     std::vector<braft::PeerId> peers;
     braft::PeerId peer0("127.0.0.1:5006");
@@ -0,0 +1,135 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <algorithm>
+#include <limits>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "braft/pipeline_window.h"
+
+namespace braft {
+DECLARE_bool(raft_adaptive_pipeline_window);
+DECLARE_int32(raft_max_parallel_append_entries_rpc_num);
+DECLARE_int32(raft_max_pipeline_window_rpcs);
+DECLARE_int32(raft_max_body_size);
+}
+
+class PipelineWindowTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_adaptive_pipeline_window = true;
+        // The fixed window doesn't cap the adaptive one
+        braft::FLAGS_raft_max_parallel_append_entries_rpc_num = 1;
+        braft::FLAGS_raft_max_pipeline_window_rpcs = 64;
+        braft::FLAGS_raft_max_body_size = 1024;
+    }
+    // Restores the flags after each test
+    GFLAGS_NS::FlagSaver _saver;
+};
+
+// Acks a full window of requests of |bytes| each, which took |rtt_us|, in
+// one round of 1ms which is the min RTT
+static int64_t run_round(braft::PipelineWindow* window, int64_t now_us,
+                         int64_t rtt_us, int64_t bytes) {
+    const int rpcs = window->max_rpcs();
+    for (int i = 0; i < rpcs; ++i) {
+        now_us += (1000 + rpcs - 1) / rpcs;
+        window->on_acked(now_us, rtt_us, bytes, rpcs - i);
+    }
+    return now_us;
+}
+
+TEST_F(PipelineWindowTest, disabled) {
+    braft::FLAGS_raft_adaptive_pipeline_window = false;
+    braft::FLAGS_raft_max_parallel_append_entries_rpc_num = 4;
+    braft::PipelineWindow window;
+    ASSERT_EQ(4, window.max_rpcs());
+    ASSERT_EQ(std::numeric_limits<int64_t>::max(), window.max_bytes());
+    int64_t now_us = 1000000;
+    for (int i = 0; i < 10; ++i) {
+        now_us = run_round(&window, now_us, 1000, 1024);
+    }
+    window.on_error();
+    ASSERT_EQ(4, window.max_rpcs());
+    ASSERT_EQ(std::numeric_limits<int64_t>::max(), window.max_bytes());
+}
+
+TEST_F(PipelineWindowTest, grow_to_cap) {
+    braft::PipelineWindow window;
+    ASSERT_EQ(1, window.max_rpcs());
+    ASSERT_EQ(1024, window.max_bytes());
+    // Doubles every round while the RTT stays at the minimum
+    int64_t now_us = 1000000;
+    now_us = run_round(&window, now_us, 1000, 1024);
+    ASSERT_EQ(2, window.max_rpcs());
+    ASSERT_EQ(1000, window.min_rtt_us());
+    now_us = run_round(&window, now_us, 1000, 1024);
+    ASSERT_EQ(4, window.max_rpcs());
+    for (int i = 0; i < 10; ++i) {
+        now_us = run_round(&window, now_us, 1000, 1024);
+    }
+    ASSERT_EQ(64, window.max_rpcs());
+    ASSERT_EQ(64 * 1024, window.max_bytes());
+
+    braft::FLAGS_raft_max_pipeline_window_rpcs = 8;
+    ASSERT_EQ(8, window.max_rpcs());
+    ASSERT_EQ(8 * 1024, window.max_bytes());
+}
+
+TEST_F(PipelineWindowTest, idle_window_does_not_grow) {
+    braft::PipelineWindow window;
+    int64_t now_us = 1000000;
+    now_us = run_round(&window, now_us, 1000, 1024);
+    ASSERT_EQ(2, window.max_rpcs());
+    // Only one request is in flight at a time
+    for (int i = 0; i < 10; ++i) {
+        now_us += 1000;
+        window.on_acked(now_us, 1000, 1024, 1);
+    }
+    ASSERT_EQ(2, window.max_rpcs());
+}
+
+TEST_F(PipelineWindowTest, back_off_on_queueing) {
+    braft::PipelineWindow window;
+    int64_t now_us = 1000000;
+    for (int i = 0; i < 4; ++i) {
+        now_us = run_round(&window, now_us, 1000, 1024);
+    }
+    ASSERT_EQ(16, window.max_rpcs());
+    // The RTT doubles as requests queue up at the follower, 8 of the 16 are
+    // queued which is beyond the Vegas threshold
+    now_us = run_round(&window, now_us, 2000, 1024);
+    ASSERT_EQ(15, window.max_rpcs());
+    now_us = run_round(&window, now_us, 2000, 1024);
+    ASSERT_EQ(14, window.max_rpcs());
+    // Grows by one at a time after leaving startup
+    now_us = run_round(&window, now_us, 1000, 1024);
+    ASSERT_EQ(15, window.max_rpcs());
+    // Bytes in flight are bounded by twice the BDP
+    ASSERT_GT(window.bandwidth(), 0);
+    const int64_t bdp = window.bandwidth() * window.min_rtt_us() / 1000000;
+    ASSERT_EQ(std::min(2 * bdp, (int64_t)15 * 1024), window.max_bytes());
+}
+
+TEST_F(PipelineWindowTest, back_off_on_error) {
+    braft::PipelineWindow window;
+    int64_t now_us = 1000000;
+    for (int i = 0; i < 4; ++i) {
+        now_us = run_round(&window, now_us, 1000, 1024);
+    }
+    ASSERT_EQ(16, window.max_rpcs());
+    const int64_t bandwidth = window.bandwidth();
+    window.on_error();
+    ASSERT_EQ(8, window.max_rpcs());
+    ASSERT_EQ(bandwidth / 2, window.bandwidth());
+    window.on_error();
+    window.on_error();
+    window.on_error();
+    window.on_error();
+    ASSERT_EQ(1, window.max_rpcs());
+    ASSERT_EQ(1024, window.max_bytes());
+    // No longer in startup
+    now_us = run_round(&window, now_us + 1000000, 1000, 1024);
+    ASSERT_EQ(2, window.max_rpcs());
+    now_us = run_round(&window, now_us, 1000, 1024);
+    ASSERT_EQ(3, window.max_rpcs());
+}
@@ -12,6 +12,7 @@
 #include <butil/files/scoped_temp_dir.h>
 
 #include "braft/util.h"
+#include "braft/ring_queue.h"
 
 class TestUsageSuits : public testing::Test {
 protected:
@@ -262,3 +263,48 @@ TEST_F(TestUsageSuits, file_path) {
     LOG(INFO) << path.ReferencesParent();
 }
 
+
+TEST_F(TestUsageSuits, ring_queue) {
+    braft::RingQueue<int> queue(3);
+    ASSERT_EQ(4u, queue.capacity());
+    ASSERT_TRUE(queue.empty());
+    int next_push = 0;
+    int next_pop = 0;
+    // Wrap around without growing
+    for (int i = 0; i < 10; ++i) {
+        queue.push_back(next_push++);
+        queue.push_back(next_push++);
+        ASSERT_EQ(next_pop++, queue.front());
+        queue.pop_front();
+    }
+    ASSERT_EQ(10u, queue.size());
+    ASSERT_EQ(16u, queue.capacity());
+    for (size_t i = 0; i < queue.size(); ++i) {
+        ASSERT_EQ(next_pop + (int)i, queue[i]);
+    }
+    // Grows in the middle of the ring
+    queue.pop_front(5);
+    next_pop += 5;
+    queue.append(20);
+    for (size_t i = 5; i < queue.size(); ++i) {
+        queue[i] = next_push++;
+    }
+    ASSERT_EQ(25u, queue.size());
+    ASSERT_EQ(32u, queue.capacity());
+    for (size_t i = 0; i < queue.size(); ++i) {
+        ASSERT_EQ(next_pop + (int)i, queue[i]);
+    }
+    ASSERT_EQ(next_push - 1, queue.back());
+    // Shrinks once less than a quarter full
+    queue.pop_front(20);
+    next_pop += 20;
+    ASSERT_EQ(5u, queue.size());
+    ASSERT_EQ(16u, queue.capacity());
+    for (size_t i = 0; i < queue.size(); ++i) {
+        ASSERT_EQ(next_pop + (int)i, queue[i]);
+    }
+    queue.clear();
+    ASSERT_TRUE(queue.empty());
+    ASSERT_EQ(4u, queue.capacity());
+    ASSERT_EQ(16u, braft::RingQueue<int>().capacity());
+}